@@ -0,0 +1,1762 @@
+#include "accelerators/bvh.h"
+#include "accelerators/bvhcache.h"
+#include "accelerators/lazyaccel.h"
+#include "core/parallel.h"
+
+#include <algorithm>
+#include <deque>
+#if defined(PBRT_HAS_AVX)
+#include <immintrin.h>
+#elif defined(PBRT_HAS_SSE)
+#include <emmintrin.h>
+#endif
+
+// BVH Local Declarations
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(uint32_t pn, const BBox& b)
+        : primitiveNumber(pn), bounds(b) {
+        centroid = .5f * b.pMin + .5f * b.pMax;
+    }
+    uint32_t primitiveNumber;
+    Point centroid;
+    BBox bounds;
+};
+
+struct BVHBuildNode {
+    BVHBuildNode() { children[0] = children[1] = NULL; }
+    void InitLeaf(uint32_t first, uint32_t n, const BBox& b) {
+        firstPrimOffset = first;
+        nPrimitives = n;
+        bounds = b;
+    }
+    // 推迟构建的孩子这时还是空的, 所以包围盒由调用者直接给出
+    void InitInterior(uint32_t axis,
+                      BVHBuildNode* c0,
+                      BVHBuildNode* c1,
+                      const BBox& b) {
+        children[0] = c0;
+        children[1] = c1;
+        bounds = b;
+        splitAxis = axis;
+        nPrimitives = 0;
+    }
+    BBox bounds;
+    BVHBuildNode* children[2];
+    uint32_t splitAxis, firstPrimOffset, nPrimitives;
+};
+
+// 分桶 SAH 的桶数, 以及内部节点相对一次图元测试的遍历代价
+static const int nBuckets = 12;
+static const float traversalCost = .125f;
+// 超过这个深度就改为按数量对半分, 保证遍历栈不会溢出
+static const uint32_t maxSAHDepth = 32;
+// 图元数少于它时整棵树串行构建
+static const uint32_t minParallelPrims = 64 * 1024;
+// 节点数少于它时整棵树串行重新拟合
+static const uint32_t minParallelRefitNodes = 16 * 1024;
+// Morton 码每轴 10 位, 一共 30 位. 高 12 位相同的图元组成一棵小树
+static const int mortonBits = 30;
+static const int treeletBits = 12;
+// 基数排序每趟 10 位, 三趟排完
+static const int radixBits = 10;
+static const int nRadixBuckets = 1 << radixBits;
+
+struct MortonPrimitive {
+    uint32_t primitiveIndex;
+    uint32_t mortonCode;
+};
+
+// 一棵小树在排好序的 Morton 数组里的范围, 以及生成出来的根
+struct LBVHTreelet {
+    uint32_t start, nPrimitives;
+    BVHBuildNode* root;
+};
+
+class BVHSubtreeTask;
+
+class BVHBuilder {
+   public:
+    BVHBuilder(const vector<BBox>& primBounds,
+               uint32_t maxPrims,
+               uint32_t leafBlockSize,
+               BVHSplitMethod splitMethod);
+    ~BVHBuilder();
+    void Build(vector<LinearBVHNode>* nodes, vector<uint32_t>* primOrder);
+    BVHBuildNode* recursiveBuild(std::deque<BVHBuildNode>& arena,
+                                 uint32_t start,
+                                 uint32_t end,
+                                 uint32_t depth,
+                                 vector<Task*>* deferred);
+    BVHBuildNode* emitLBVH(std::deque<BVHBuildNode>& arena,
+                           const MortonPrimitive* mortonPrims,
+                           uint32_t start,
+                           uint32_t nPrimitives,
+                           int bitIndex);
+
+   private:
+    BVHBuildNode* linearBuild();
+    BVHBuildNode* buildUpperSAH(vector<BVHBuildNode*>& roots,
+                                uint32_t start,
+                                uint32_t end);
+    BVHBuildNode* buildUpperMorton(const vector<LBVHTreelet>& treelets,
+                                   const MortonPrimitive* mortonPrims,
+                                   uint32_t start,
+                                   uint32_t end,
+                                   int bitIndex);
+    uint32_t flatten(const BVHBuildNode* node, vector<LinearBVHNode>* nodes);
+    // n 个图元的求交代价: 按块测试时不满的块和满的块一样贵
+    float intersectCost(uint32_t n) const {
+        return float((n + blockSize - 1) / blockSize);
+    }
+
+    uint32_t maxPrimsInNode, blockSize;
+    BVHSplitMethod splitMethod;
+    // 不超过这么多图元的子树交给 Task 构建
+    uint32_t subtreeSize;
+    vector<BVHPrimitiveInfo> buildData;
+    std::deque<BVHBuildNode> topArena;
+    vector<Task*> subtreeTasks;
+};
+
+// 一棵顶层子树的构建任务. 节点放在任务自己的 arena 里,
+// 根节点最后拷到上层预留的位置
+class BVHSubtreeTask : public Task {
+   public:
+    BVHSubtreeTask(BVHBuilder* b,
+                   BVHBuildNode* n,
+                   uint32_t s,
+                   uint32_t e,
+                   uint32_t d)
+        : builder(b), node(n), start(s), end(e), depth(d) {}
+    void Run() {
+        *node = *builder->recursiveBuild(arena, start, end, depth, NULL);
+    }
+
+   private:
+    BVHBuilder* builder;
+    BVHBuildNode* node;
+    uint32_t start, end, depth;
+    std::deque<BVHBuildNode> arena;
+};
+
+// BVH Method Definitions
+BVHBuilder::BVHBuilder(const vector<BBox>& primBounds,
+                       uint32_t maxPrims,
+                       uint32_t leafBlockSize,
+                       BVHSplitMethod method) {
+    maxPrimsInNode = min(maxPrims, 255u);
+    blockSize = max(leafBlockSize, 1u);
+    splitMethod = method;
+    buildData.reserve(primBounds.size());
+    for (uint32_t i = 0; i < primBounds.size(); ++i)
+        buildData.push_back(BVHPrimitiveInfo(i, primBounds[i]));
+    uint32_t n = (uint32_t)buildData.size();
+    if (n < minParallelPrims)
+        subtreeSize = n + 1;
+    else
+        subtreeSize = max(n / (8 * NumSystemCores()), 4096u);
+}
+
+BVHBuilder::~BVHBuilder() {
+    for (uint32_t i = 0; i < subtreeTasks.size(); ++i)
+        delete subtreeTasks[i];
+}
+
+void BVHBuilder::Build(vector<LinearBVHNode>* nodes,
+                       vector<uint32_t>* primOrder) {
+    nodes->clear();
+    primOrder->clear();
+    if (buildData.empty())
+        return;
+    BVHBuildNode* root;
+    if (splitMethod == BVH_SPLIT_SAH) {
+        // 先串行划分顶层, 小于 subtreeSize 的子树都推迟成任务一起跑
+        root = recursiveBuild(topArena, 0, (uint32_t)buildData.size(), 0,
+                              &subtreeTasks);
+        if (subtreeTasks.size()) {
+            EnqueueTasks(subtreeTasks);
+            WaitForAllTasks();
+        }
+    } else
+        root = linearBuild();
+
+    nodes->reserve(2 * buildData.size() / maxPrimsInNode + 1);
+    flatten(root, nodes);
+    primOrder->resize(buildData.size());
+    for (uint32_t i = 0; i < buildData.size(); ++i)
+        (*primOrder)[i] = buildData[i].primitiveNumber;
+}
+
+BVHBuildNode* BVHBuilder::recursiveBuild(std::deque<BVHBuildNode>& arena,
+                                         uint32_t start,
+                                         uint32_t end,
+                                         uint32_t depth,
+                                         vector<Task*>* deferred) {
+    arena.push_back(BVHBuildNode());
+    BVHBuildNode* node = &arena.back();
+    uint32_t nPrimitives = end - start;
+    if (deferred && nPrimitives <= subtreeSize) {
+        deferred->push_back(
+            new BVHSubtreeTask(this, node, start, end, depth));
+        return node;
+    }
+
+    BBox bbox, centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        bbox = Union(bbox, buildData[i].bounds);
+        centroidBounds = Union(centroidBounds, buildData[i].centroid);
+    }
+    if (nPrimitives == 1) {
+        node->InitLeaf(start, nPrimitives, bbox);
+        return node;
+    }
+
+    // 叶子里的图元就是 buildData[start, end), 划分都是原地做的,
+    // 所以不需要额外的有序图元数组, 各个任务之间也不用同步
+    int dim = centroidBounds.MaximumExtent();
+    uint32_t mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        // 质心都重合, 没法按空间划分
+        if (nPrimitives <= maxPrimsInNode) {
+            node->InitLeaf(start, nPrimitives, bbox);
+            return node;
+        }
+        // 太多了就只能按数量对半分
+    } else if (depth >= maxSAHDepth) {
+        std::nth_element(
+            &buildData[start], &buildData[mid], &buildData[end - 1] + 1,
+            [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+    } else {
+        // 按质心分到桶里, 在桶的边界上找 SAH 代价最小的划分
+        uint32_t count[nBuckets] = {0};
+        BBox bucketBounds[nBuckets];
+        float cmin = centroidBounds.pMin[dim];
+        float scale = nBuckets / (centroidBounds.pMax[dim] - cmin);
+        for (uint32_t i = start; i < end; ++i) {
+            int b = (int)((buildData[i].centroid[dim] - cmin) * scale);
+            b = min(b, nBuckets - 1);
+            count[b]++;
+            bucketBounds[b] = Union(bucketBounds[b], buildData[i].bounds);
+        }
+
+        // 从右往左扫一遍算出每个划分右边的面积和数量, 再从左往右求代价
+        float rightArea[nBuckets - 1];
+        uint32_t rightCount[nBuckets - 1];
+        BBox b1;
+        uint32_t c1 = 0;
+        for (int i = nBuckets - 1; i > 0; --i) {
+            b1 = Union(b1, bucketBounds[i]);
+            c1 += count[i];
+            rightArea[i - 1] = c1 ? b1.SurfaceArea() : 0.f;
+            rightCount[i - 1] = c1;
+        }
+        BBox b0;
+        uint32_t c0 = 0;
+        float minCost = INFINITY;
+        int minCostSplit = 0;
+        float invArea = 1.f / bbox.SurfaceArea();
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            b0 = Union(b0, bucketBounds[i]);
+            c0 += count[i];
+            if (c0 == 0 || rightCount[i] == 0)
+                continue;
+            float cost =
+                traversalCost + (intersectCost(c0) * b0.SurfaceArea() +
+                                 intersectCost(rightCount[i]) * rightArea[i]) *
+                                    invArea;
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplit = i;
+            }
+        }
+
+        if (nPrimitives <= maxPrimsInNode &&
+            minCost >= intersectCost(nPrimitives)) {
+            node->InitLeaf(start, nPrimitives, bbox);
+            return node;
+        }
+        BVHPrimitiveInfo* pmid = std::partition(
+            &buildData[start], &buildData[end - 1] + 1,
+            [=](const BVHPrimitiveInfo& p) {
+                int b = (int)((p.centroid[dim] - cmin) * scale);
+                return min(b, nBuckets - 1) <= minCostSplit;
+            });
+        mid = uint32_t(pmid - &buildData[0]);
+    }
+
+    node->InitInterior(
+        dim, recursiveBuild(arena, start, mid, depth + 1, deferred),
+        recursiveBuild(arena, mid, end, depth + 1, deferred), bbox);
+    return node;
+}
+
+uint32_t BVHBuilder::flatten(const BVHBuildNode* node,
+                             vector<LinearBVHNode>* nodes) {
+    uint32_t offset = (uint32_t)nodes->size();
+    nodes->push_back(LinearBVHNode());
+    LinearBVHNode& linearNode = (*nodes)[offset];
+    linearNode.bounds = node->bounds;
+    if (node->nPrimitives > 0) {
+        linearNode.primitivesOffset = node->firstPrimOffset;
+        linearNode.nPrimitives = (uint16_t)node->nPrimitives;
+        linearNode.axis = 0;
+    } else {
+        linearNode.nPrimitives = 0;
+        linearNode.axis = (uint8_t)node->splitAxis;
+        flatten(node->children[0], nodes);
+        uint32_t second = flatten(node->children[1], nodes);
+        // push_back 可能让前面的引用失效, 重新取一次
+        (*nodes)[offset].secondChildOffset = second;
+    }
+    return offset;
+}
+
+// 把 [0, n) 分成 nChunks 段, 每段一个任务调用 func(chunk, start, end).
+// 分段只由 n 和 nChunks 决定, 两次调用的分段相同
+template <typename Func>
+class BVHChunkTask : public Task {
+   public:
+    BVHChunkTask(const Func& f, uint32_t c, uint32_t s, uint32_t e)
+        : func(f), chunk(c), start(s), end(e) {}
+    void Run() { func(chunk, start, end); }
+
+   private:
+    const Func& func;
+    uint32_t chunk, start, end;
+};
+
+template <typename Func>
+static void ParallelChunks(uint32_t n, uint32_t nChunks, const Func& func) {
+    if (nChunks == 1) {
+        func(0, 0, n);
+        return;
+    }
+    vector<Task*> tasks;
+    for (uint32_t c = 0; c < nChunks; ++c)
+        tasks.push_back(new BVHChunkTask<Func>(
+            func, c, uint32_t(uint64_t(n) * c / nChunks),
+            uint32_t(uint64_t(n) * (c + 1) / nChunks)));
+    EnqueueTasks(tasks);
+    WaitForAllTasks();
+    for (uint32_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+}
+
+// 按 Morton 码的 LSD 基数排序. 每趟每段先数自己的直方图, 按
+// (桶, 段) 的顺序求前缀和得到各段的写入位置, 再各自分发, 排序是稳定的
+static void RadixSort(vector<MortonPrimitive>* v, uint32_t nChunks) {
+    uint32_t n = (uint32_t)v->size();
+    vector<MortonPrimitive> temp(n);
+    vector<uint32_t> offsets(nChunks * nRadixBuckets);
+    for (int pass = 0; pass < mortonBits / radixBits; ++pass) {
+        int lowBit = pass * radixBits;
+        const vector<MortonPrimitive>& in = (pass & 1) ? temp : *v;
+        vector<MortonPrimitive>& out = (pass & 1) ? *v : temp;
+        ParallelChunks(n, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+            uint32_t* count = &offsets[c * nRadixBuckets];
+            memset(count, 0, nRadixBuckets * sizeof(uint32_t));
+            for (uint32_t i = s; i < e; ++i)
+                count[(in[i].mortonCode >> lowBit) & (nRadixBuckets - 1)]++;
+        });
+        uint32_t sum = 0;
+        for (int b = 0; b < nRadixBuckets; ++b)
+            for (uint32_t c = 0; c < nChunks; ++c) {
+                uint32_t count = offsets[c * nRadixBuckets + b];
+                offsets[c * nRadixBuckets + b] = sum;
+                sum += count;
+            }
+        ParallelChunks(n, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+            uint32_t* offset = &offsets[c * nRadixBuckets];
+            for (uint32_t i = s; i < e; ++i)
+                out[offset[(in[i].mortonCode >> lowBit) &
+                           (nRadixBuckets - 1)]++] = in[i];
+        });
+    }
+    if ((mortonBits / radixBits) & 1)
+        v->swap(temp);
+}
+
+// 一棵小树的生成任务, 节点放在任务自己的 arena 里
+class LBVHTreeletTask : public Task {
+   public:
+    LBVHTreeletTask(BVHBuilder* b, const MortonPrimitive* m, LBVHTreelet* t)
+        : builder(b), mortonPrims(m), treelet(t) {}
+    void Run() {
+        treelet->root = builder->emitLBVH(arena, mortonPrims, treelet->start,
+                                          treelet->nPrimitives,
+                                          mortonBits - treeletBits - 1);
+    }
+
+   private:
+    BVHBuilder* builder;
+    const MortonPrimitive* mortonPrims;
+    LBVHTreelet* treelet;
+    std::deque<BVHBuildNode> arena;
+};
+
+BVHBuildNode* BVHBuilder::linearBuild() {
+    uint32_t n = (uint32_t)buildData.size();
+    uint32_t nChunks = n < minParallelPrims ? 1 : 4 * NumSystemCores();
+
+    // 在质心的包围盒里算 Morton 码. 扁平的轴撑开一点, 免得除以零
+    vector<BBox> chunkBounds(nChunks);
+    ParallelChunks(n, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+        for (uint32_t i = s; i < e; ++i)
+            chunkBounds[c] = Union(chunkBounds[c], buildData[i].centroid);
+    });
+    BBox centroidBounds;
+    for (uint32_t c = 0; c < nChunks; ++c)
+        centroidBounds = Union(centroidBounds, chunkBounds[c]);
+    for (int axis = 0; axis < 3; ++axis)
+        if (!(centroidBounds.pMax[axis] > centroidBounds.pMin[axis]))
+            centroidBounds.pMax[axis] = centroidBounds.pMin[axis] + 1.f;
+    vector<MortonPrimitive> mortonPrims(n);
+    ParallelChunks(n, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+        for (uint32_t i = s; i < e; ++i) {
+            mortonPrims[i].primitiveIndex = i;
+            mortonPrims[i].mortonCode =
+                EncodeMorton3(centroidBounds.Offset(buildData[i].centroid));
+        }
+    });
+    RadixSort(&mortonPrims, nChunks);
+
+    // 图元按 Morton 顺序重排, 叶子直接引用重排后的位置
+    vector<BVHPrimitiveInfo> sorted(n);
+    ParallelChunks(n, nChunks, [&](uint32_t c, uint32_t s, uint32_t e) {
+        for (uint32_t i = s; i < e; ++i)
+            sorted[i] = buildData[mortonPrims[i].primitiveIndex];
+    });
+    buildData.swap(sorted);
+
+    // 按高位分出小树, 每棵一个任务
+    const uint32_t mask = ~0u << (mortonBits - treeletBits);
+    vector<LBVHTreelet> treelets;
+    for (uint32_t start = 0, end = 1; end <= n; ++end)
+        if (end == n || (mortonPrims[start].mortonCode & mask) !=
+                            (mortonPrims[end].mortonCode & mask)) {
+            LBVHTreelet t = {start, end - start, NULL};
+            treelets.push_back(t);
+            start = end;
+        }
+    vector<Task*> tasks;
+    for (uint32_t i = 0; i < treelets.size(); ++i)
+        tasks.push_back(
+            new LBVHTreeletTask(this, &mortonPrims[0], &treelets[i]));
+    if (nChunks > 1) {
+        EnqueueTasks(tasks);
+        WaitForAllTasks();
+    } else
+        for (uint32_t i = 0; i < tasks.size(); ++i)
+            tasks[i]->Run();
+    // 任务要等 flatten 以后才能删, 节点在它们的 arena 里
+    subtreeTasks.insert(subtreeTasks.end(), tasks.begin(), tasks.end());
+
+    if (splitMethod == BVH_SPLIT_LBVH)
+        return buildUpperMorton(treelets, &mortonPrims[0], 0,
+                                (uint32_t)treelets.size(), mortonBits - 1);
+    vector<BVHBuildNode*> roots(treelets.size());
+    for (uint32_t i = 0; i < treelets.size(); ++i)
+        roots[i] = treelets[i].root;
+    return buildUpperSAH(roots, 0, (uint32_t)roots.size());
+}
+
+// 码在 bitIndex 这一位上分成 0 和 1 两半, 前面几位都相同
+BVHBuildNode* BVHBuilder::emitLBVH(std::deque<BVHBuildNode>& arena,
+                                   const MortonPrimitive* mortonPrims,
+                                   uint32_t start,
+                                   uint32_t nPrimitives,
+                                   int bitIndex) {
+    // 这一位全相同就不用分, 往下一位走
+    while (bitIndex >= 0) {
+        uint32_t bit = 1u << bitIndex;
+        if ((mortonPrims[start].mortonCode & bit) !=
+            (mortonPrims[start + nPrimitives - 1].mortonCode & bit))
+            break;
+        --bitIndex;
+    }
+    arena.push_back(BVHBuildNode());
+    BVHBuildNode* node = &arena.back();
+    if (nPrimitives <= maxPrimsInNode ||
+        (bitIndex < 0 && nPrimitives == 1)) {
+        BBox bounds;
+        for (uint32_t i = start; i < start + nPrimitives; ++i)
+            bounds = Union(bounds, buildData[i].bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
+        return node;
+    }
+
+    uint32_t mid;
+    if (bitIndex < 0) {
+        // 码全相同还装不进一个叶子, 只能按数量对半分
+        mid = start + nPrimitives / 2;
+    } else {
+        // 二分找到这一位变成 1 的第一个图元
+        uint32_t bit = 1u << bitIndex;
+        uint32_t lo = start, hi = start + nPrimitives - 1;
+        while (lo + 1 != hi) {
+            uint32_t m = (lo + hi) / 2;
+            if (mortonPrims[m].mortonCode & bit)
+                hi = m;
+            else
+                lo = m;
+        }
+        mid = hi;
+    }
+    BVHBuildNode* c0 =
+        emitLBVH(arena, mortonPrims, start, mid - start, bitIndex - 1);
+    BVHBuildNode* c1 = emitLBVH(arena, mortonPrims, mid,
+                                start + nPrimitives - mid, bitIndex - 1);
+    node->InitInterior(bitIndex < 0 ? 0 : bitIndex % 3, c0, c1,
+                       Union(c0->bounds, c1->bounds));
+    return node;
+}
+
+// 小树之上的几层继续按 Morton 码的高位划分
+BVHBuildNode* BVHBuilder::buildUpperMorton(
+    const vector<LBVHTreelet>& treelets,
+    const MortonPrimitive* mortonPrims,
+    uint32_t start,
+    uint32_t end,
+    int bitIndex) {
+    if (end - start == 1)
+        return treelets[start].root;
+    // 小树的高位各不相同, 总能找到分开它们的一位
+    uint32_t bit = 1u << bitIndex;
+    uint32_t mid = start;
+    while (mid < end &&
+           !(mortonPrims[treelets[mid].start].mortonCode & bit))
+        ++mid;
+    if (mid == start || mid == end)
+        return buildUpperMorton(treelets, mortonPrims, start, end,
+                                bitIndex - 1);
+    BVHBuildNode* c0 =
+        buildUpperMorton(treelets, mortonPrims, start, mid, bitIndex - 1);
+    BVHBuildNode* c1 =
+        buildUpperMorton(treelets, mortonPrims, mid, end, bitIndex - 1);
+    topArena.push_back(BVHBuildNode());
+    BVHBuildNode* node = &topArena.back();
+    node->InitInterior(bitIndex % 3, c0, c1, Union(c0->bounds, c1->bounds));
+    return node;
+}
+
+// 把小树的根当作图元, 在上面做分桶的 SAH
+BVHBuildNode* BVHBuilder::buildUpperSAH(vector<BVHBuildNode*>& roots,
+                                        uint32_t start,
+                                        uint32_t end) {
+    uint32_t nNodes = end - start;
+    if (nNodes == 1)
+        return roots[start];
+
+    BBox bounds, centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        const BBox& b = roots[i]->bounds;
+        bounds = Union(bounds, b);
+        centroidBounds = Union(centroidBounds, .5f * b.pMin + .5f * b.pMax);
+    }
+    int dim = centroidBounds.MaximumExtent();
+    float cmin = centroidBounds.pMin[dim];
+    float cextent = centroidBounds.pMax[dim] - cmin;
+    uint32_t mid = (start + end) / 2;
+    if (cextent > 0.f) {
+        float scale = nBuckets / cextent;
+        auto bucketOf = [&](const BVHBuildNode* n) {
+            float c = .5f * n->bounds.pMin[dim] + .5f * n->bounds.pMax[dim];
+            return min((int)((c - cmin) * scale), nBuckets - 1);
+        };
+        uint32_t count[nBuckets] = {0};
+        BBox bucketBounds[nBuckets];
+        for (uint32_t i = start; i < end; ++i) {
+            int b = bucketOf(roots[i]);
+            count[b]++;
+            bucketBounds[b] = Union(bucketBounds[b], roots[i]->bounds);
+        }
+        float minCost = INFINITY;
+        int minCostSplit = -1;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            BBox b0, b1;
+            uint32_t c0 = 0, c1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, bucketBounds[j]);
+                c0 += count[j];
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1 = Union(b1, bucketBounds[j]);
+                c1 += count[j];
+            }
+            if (c0 == 0 || c1 == 0)
+                continue;
+            float cost = traversalCost +
+                         (c0 * b0.SurfaceArea() + c1 * b1.SurfaceArea()) /
+                             bounds.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplit = i;
+            }
+        }
+        if (minCostSplit >= 0)
+            mid = uint32_t(
+                std::partition(&roots[start], &roots[end - 1] + 1,
+                               [&](const BVHBuildNode* n) {
+                                   return bucketOf(n) <= minCostSplit;
+                               }) -
+                &roots[0]);
+    }
+
+    topArena.push_back(BVHBuildNode());
+    BVHBuildNode* node = &topArena.back();
+    node->InitInterior(dim, buildUpperSAH(roots, start, mid),
+                       buildUpperSAH(roots, mid, end), bounds);
+    return node;
+}
+
+void BuildBVH(const vector<BBox>& primBounds,
+              uint32_t maxPrimsInNode,
+              vector<LinearBVHNode>* nodes,
+              vector<uint32_t>* primOrder,
+              uint32_t leafBlockSize,
+              BVHSplitMethod splitMethod) {
+    BVHBuilder builder(primBounds, maxPrimsInNode, leafBlockSize,
+                       splitMethod);
+    builder.Build(nodes, primOrder);
+}
+
+// 从二叉内部节点 nodeNum 收集最多 N 个孩子, 内部孩子递归压缩
+template <int N>
+static uint32_t collapse(const vector<LinearBVHNode>& nodes,
+                         uint32_t nodeNum,
+                         vector<WideBVHNode<N>>* wideNodes) {
+    uint32_t kids[N];
+    int nKids = 0;
+    kids[nKids++] = nodeNum + 1;
+    kids[nKids++] = nodes[nodeNum].secondChildOffset;
+    while (nKids < N) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < nKids; ++i) {
+            const LinearBVHNode& c = nodes[kids[i]];
+            if (c.nPrimitives == 0 && c.bounds.SurfaceArea() > bestArea) {
+                best = i;
+                bestArea = c.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+        uint32_t n = kids[best];
+        kids[best] = n + 1;
+        kids[nKids++] = nodes[n].secondChildOffset;
+    }
+
+    uint32_t offset = (uint32_t)wideNodes->size();
+    wideNodes->push_back(WideBVHNode<N>());
+    for (int i = 0; i < N; ++i) {
+        uint32_t child = 0;
+        uint16_t nPrimitives = 0;
+        if (i < nKids) {
+            const LinearBVHNode& c = nodes[kids[i]];
+            nPrimitives = c.nPrimitives;
+            child = nPrimitives ? c.primitivesOffset
+                                : collapse(nodes, kids[i], wideNodes);
+            (*wideNodes)[offset].childBounds.Set(i, c.bounds);
+        }
+        (*wideNodes)[offset].child[i] = child;
+        (*wideNodes)[offset].nPrimitives[i] = nPrimitives;
+    }
+    return offset;
+}
+
+template <int N>
+void CollapseBVH(const vector<LinearBVHNode>& nodes,
+                 vector<WideBVHNode<N>>* wideNodes) {
+    wideNodes->clear();
+    if (nodes.empty())
+        return;
+    if (nodes[0].nPrimitives == 0) {
+        collapse(nodes, 0, wideNodes);
+        return;
+    }
+    // 整棵树只有一个叶子
+    WideBVHNode<N> root;
+    root.childBounds.Set(0, nodes[0].bounds);
+    for (int i = 0; i < N; ++i) {
+        root.child[i] = i ? 0 : nodes[0].primitivesOffset;
+        root.nPrimitives[i] = i ? 0 : nodes[0].nPrimitives;
+    }
+    wideNodes->push_back(root);
+}
+
+template void CollapseBVH(const vector<LinearBVHNode>& nodes,
+                          vector<WideBVHNode<4>>* wideNodes);
+template void CollapseBVH(const vector<LinearBVHNode>& nodes,
+                          vector<WideBVHNode<8>>* wideNodes);
+
+static float dequantize(float origin, int q, float scale) {
+    return origin + float(q) * scale;
+}
+
+template <int N>
+static QuantizedBVHNode<N> quantize(const WideBVHNode<N>& wide) {
+    QuantizedBVHNode<N> node;
+    memset(&node, 0, sizeof(node));
+    // 父节点坐标系取有效孩子的并集, 空盒子不参与
+    BBox frame;
+    for (int i = 0; i < N; ++i) {
+        BBox b = wide.childBounds.Get(i);
+        if (b.pMin.x <= b.pMax.x && b.pMin.y <= b.pMax.y &&
+            b.pMin.z <= b.pMax.z) {
+            node.validMask |= 1 << i;
+            frame = Union(frame, b);
+        }
+        node.child[i] = wide.child[i];
+        node.nPrimitives[i] = (uint8_t)wide.nPrimitives[i];
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float origin = node.validMask ? frame.pMin[axis] : 0.f;
+        float extent = node.validMask ? frame.pMax[axis] - origin : 0.f;
+        // 步长取能让 255 格盖住整个范围的最小 2 的幂, 加法舍入不够时再放大
+        int e = extent > 0.f ? (int)ceilf(log2f(extent / 255.f)) : -126;
+        e = clamp(e, -126, 127);
+        while (e < 127 &&
+               dequantize(origin, 255, QuantizedScale(e)) < frame.pMax[axis])
+            ++e;
+        float scale = QuantizedScale(e);
+        node.origin[axis] = origin;
+        node.exponent[axis] = (int8_t)e;
+
+        for (int i = 0; i < N; ++i) {
+            if (!(node.validMask & (1 << i))) {
+                node.q[0][axis][i] = 255;
+                node.q[1][axis][i] = 0;
+                continue;
+            }
+            BBox b = wide.childBounds.Get(i);
+            // pMin 向下, pMax 向上取整, 再按实际的浮点运算结果修正,
+            // 保证解出来的盒子包住原来的盒子
+            int lo = clamp((int)floorf((b.pMin[axis] - origin) / scale), 0,
+                           255);
+            while (lo > 0 && dequantize(origin, lo, scale) > b.pMin[axis])
+                --lo;
+            int hi = clamp((int)ceilf((b.pMax[axis] - origin) / scale), lo,
+                           255);
+            while (hi < 255 && dequantize(origin, hi, scale) < b.pMax[axis])
+                ++hi;
+            node.q[0][axis][i] = (uint8_t)lo;
+            node.q[1][axis][i] = (uint8_t)hi;
+        }
+    }
+    return node;
+}
+
+template <int N>
+void QuantizeBVH(const vector<WideBVHNode<N>>& wideNodes,
+                 vector<QuantizedBVHNode<N>>* quantizedNodes) {
+    quantizedNodes->resize(wideNodes.size());
+    for (uint32_t i = 0; i < wideNodes.size(); ++i)
+        (*quantizedNodes)[i] = quantize(wideNodes[i]);
+}
+
+template void QuantizeBVH(const vector<WideBVHNode<4>>& wideNodes,
+                          vector<QuantizedBVHNode<4>>* quantizedNodes);
+template void QuantizeBVH(const vector<WideBVHNode<8>>& wideNodes,
+                          vector<QuantizedBVHNode<8>>* quantizedNodes);
+
+#ifdef PBRT_HAS_SSE
+// 4 个 8 位整数转成浮点, 再解成坐标 origin + q * scale
+static inline __m128 dequantize4(const uint8_t* q,
+                                 __m128 origin,
+                                 __m128 scale) {
+    int32_t bytes;
+    memcpy(&bytes, q, sizeof(int32_t));
+    __m128i zero = _mm_setzero_si128();
+    __m128i qi = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(qi), scale));
+}
+
+// 量化节点里 4 个孩子的 slab 测试. q 指向 [2][3][stride] 布局里
+// 这 4 个孩子的起点
+static inline int IntersectQuantized4(const float origin[3],
+                                      const int8_t exponent[3],
+                                      const uint8_t* q,
+                                      int stride,
+                                      const TraversalRay& ray,
+                                      float tNear[4]) {
+    const int nx = ray.dirIsNeg[0], ny = ray.dirIsNeg[1], nz = ray.dirIsNeg[2];
+    __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y),
+           oz = _mm_set1_ps(ray.o.z);
+    __m128 idx = _mm_set1_ps(ray.invDir.x), idy = _mm_set1_ps(ray.invDir.y),
+           idz = _mm_set1_ps(ray.invDir.z);
+    __m128 bx = _mm_set1_ps(origin[0]), by = _mm_set1_ps(origin[1]),
+           bz = _mm_set1_ps(origin[2]);
+    __m128 sx = _mm_set1_ps(QuantizedScale(exponent[0])),
+           sy = _mm_set1_ps(QuantizedScale(exponent[1])),
+           sz = _mm_set1_ps(QuantizedScale(exponent[2]));
+#define SLAB(neg, axis, b, s) \
+    dequantize4(q + ((neg)*3 + (axis)) * stride, b, s)
+    __m128 txMin = _mm_mul_ps(_mm_sub_ps(SLAB(nx, 0, bx, sx), ox), idx);
+    __m128 txMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - nx, 0, bx, sx), ox), idx);
+    __m128 tyMin = _mm_mul_ps(_mm_sub_ps(SLAB(ny, 1, by, sy), oy), idy);
+    __m128 tyMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - ny, 1, by, sy), oy), idy);
+    __m128 tzMin = _mm_mul_ps(_mm_sub_ps(SLAB(nz, 2, bz, sz), oz), idz);
+    __m128 tzMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - nz, 2, bz, sz), oz), idz);
+#undef SLAB
+
+    __m128 t0 = _mm_max_ps(_mm_max_ps(txMin, tyMin),
+                           _mm_max_ps(tzMin, _mm_set1_ps(ray.mint)));
+    __m128 t1 = _mm_min_ps(
+        _mm_mul_ps(_mm_min_ps(_mm_min_ps(txMax, tyMax), tzMax),
+                   _mm_set1_ps(BBOX_TMAX_SCALE)),
+        _mm_set1_ps(ray.maxt));
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+template <>
+int QuantizedBVHNode<4>::IntersectP(const TraversalRay& ray,
+                                    float tNear[4]) const {
+    return IntersectQuantized4(origin, exponent, &q[0][0][0], 4, ray, tNear) &
+           validMask;
+}
+#endif  // PBRT_HAS_SSE
+
+#ifdef PBRT_HAS_AVX
+// AVX 没有 256 位整数指令, 8 个整数分两半转换后再拼起来
+static inline __m256 dequantize8(const uint8_t* q,
+                                 __m256 origin,
+                                 __m256 scale) {
+    __m128i q16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)q),
+                                    _mm_setzero_si128());
+    __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(q16, _mm_setzero_si128()));
+    __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(q16, _mm_setzero_si128()));
+    __m256 qf = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    return _mm256_add_ps(origin, _mm256_mul_ps(qf, scale));
+}
+
+template <>
+int QuantizedBVHNode<8>::IntersectP(const TraversalRay& ray,
+                                    float tNear[8]) const {
+    const int nx = ray.dirIsNeg[0], ny = ray.dirIsNeg[1], nz = ray.dirIsNeg[2];
+    __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y),
+           oz = _mm256_set1_ps(ray.o.z);
+    __m256 idx = _mm256_set1_ps(ray.invDir.x),
+           idy = _mm256_set1_ps(ray.invDir.y),
+           idz = _mm256_set1_ps(ray.invDir.z);
+    __m256 bx = _mm256_set1_ps(origin[0]), by = _mm256_set1_ps(origin[1]),
+           bz = _mm256_set1_ps(origin[2]);
+    __m256 sx = _mm256_set1_ps(QuantizedScale(exponent[0])),
+           sy = _mm256_set1_ps(QuantizedScale(exponent[1])),
+           sz = _mm256_set1_ps(QuantizedScale(exponent[2]));
+
+    __m256 txMin =
+        _mm256_mul_ps(_mm256_sub_ps(dequantize8(q[nx][0], bx, sx), ox), idx);
+    __m256 txMax = _mm256_mul_ps(
+        _mm256_sub_ps(dequantize8(q[1 - nx][0], bx, sx), ox), idx);
+    __m256 tyMin =
+        _mm256_mul_ps(_mm256_sub_ps(dequantize8(q[ny][1], by, sy), oy), idy);
+    __m256 tyMax = _mm256_mul_ps(
+        _mm256_sub_ps(dequantize8(q[1 - ny][1], by, sy), oy), idy);
+    __m256 tzMin =
+        _mm256_mul_ps(_mm256_sub_ps(dequantize8(q[nz][2], bz, sz), oz), idz);
+    __m256 tzMax = _mm256_mul_ps(
+        _mm256_sub_ps(dequantize8(q[1 - nz][2], bz, sz), oz), idz);
+
+    __m256 t0 = _mm256_max_ps(_mm256_max_ps(txMin, tyMin),
+                              _mm256_max_ps(tzMin, _mm256_set1_ps(ray.mint)));
+    __m256 t1 = _mm256_min_ps(
+        _mm256_mul_ps(_mm256_min_ps(_mm256_min_ps(txMax, tyMax), tzMax),
+                      _mm256_set1_ps(BBOX_TMAX_SCALE)),
+        _mm256_set1_ps(ray.maxt));
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & validMask;
+}
+#elif defined(PBRT_HAS_SSE)
+// 没有 AVX 时分两半用 SSE 测
+template <>
+int QuantizedBVHNode<8>::IntersectP(const TraversalRay& ray,
+                                    float tNear[8]) const {
+    int mask =
+        IntersectQuantized4(origin, exponent, &q[0][0][0], 8, ray, tNear) |
+        (IntersectQuantized4(origin, exponent, &q[0][0][4], 8, ray, tNear + 4)
+         << 4);
+    return mask & validMask;
+}
+#endif  // PBRT_HAS_AVX
+
+void BVHTree::Build(const vector<BBox>& primBounds,
+                    uint32_t maxPrimsInNode,
+                    BVHLayout l,
+                    vector<uint32_t>* primOrder,
+                    uint32_t leafBlockSize,
+                    BVHSplitMethod splitMethod) {
+    layout = l;
+    blockSize = max(leafBlockSize, 1u);
+    refitRoots.clear();
+    mapping = NULL;
+    mappedNodes = NULL;
+    nMappedNodes = 0;
+    nodes4.clear();
+    nodes8.clear();
+    nodes4q.clear();
+    nodes8q.clear();
+    BuildBVH(primBounds, maxPrimsInNode, &nodes, primOrder, leafBlockSize,
+             splitMethod);
+    bounds = nodes.size() ? nodes[0].bounds : BBox();
+    if (layout == BVH_4 || layout == BVH_4_QUANTIZED)
+        CollapseBVH(nodes, &nodes4);
+    else if (layout == BVH_8 || layout == BVH_8_QUANTIZED)
+        CollapseBVH(nodes, &nodes8);
+    // 量化节点由全精度的宽节点转换, 转完不再需要它们
+    if (layout == BVH_4_QUANTIZED) {
+        QuantizeBVH(nodes4, &nodes4q);
+        vector<BVH4Node>().swap(nodes4);
+    } else if (layout == BVH_8_QUANTIZED) {
+        QuantizeBVH(nodes8, &nodes8q);
+        vector<BVH8Node>().swap(nodes8);
+    }
+    if (layout != BVH_BINARY)
+        vector<LinearBVHNode>().swap(nodes);
+    // 节点是逐个 push_back 的, 容量可能接近实际的两倍
+    nodes.shrink_to_fit();
+    nodes4.shrink_to_fit();
+    nodes8.shrink_to_fit();
+}
+
+// 当前布局的节点大小, 写缓存和检查缓存时用
+static uint32_t layoutNodeSize(BVHLayout layout) {
+    switch (layout) {
+        case BVH_4:
+            return sizeof(BVH4Node);
+        case BVH_8:
+            return sizeof(BVH8Node);
+        case BVH_4_QUANTIZED:
+            return sizeof(BVH4QNode);
+        case BVH_8_QUANTIZED:
+            return sizeof(BVH8QNode);
+        default:
+            return sizeof(LinearBVHNode);
+    }
+}
+
+template <typename Node>
+static void copyMappedNodes(const void* mapped, uint32_t n, vector<Node>* v) {
+    const Node* p = (const Node*)mapped;
+    v->assign(p, p + n);
+}
+
+void BVHTree::detach() {
+    if (!mappedNodes)
+        return;
+    switch (layout) {
+        case BVH_4:
+            copyMappedNodes(mappedNodes, nMappedNodes, &nodes4);
+            break;
+        case BVH_8:
+            copyMappedNodes(mappedNodes, nMappedNodes, &nodes8);
+            break;
+        case BVH_4_QUANTIZED:
+            copyMappedNodes(mappedNodes, nMappedNodes, &nodes4q);
+            break;
+        case BVH_8_QUANTIZED:
+            copyMappedNodes(mappedNodes, nMappedNodes, &nodes8q);
+            break;
+        default:
+            copyMappedNodes(mappedNodes, nMappedNodes, &nodes);
+            break;
+    }
+    // 使用者拿到的 primOrder 也在映射里, 所以映射本身留到树析构
+    mappedNodes = NULL;
+    nMappedNodes = 0;
+}
+
+bool BVHTree::SaveCache(uint64_t key, const vector<uint32_t>& primOrder) const {
+    if (!BVHCacheEnabled())
+        return false;
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.key = key;
+    header.layout = layout;
+    header.blockSize = blockSize;
+    header.nodeSize = layoutNodeSize(layout);
+    header.nNodes = nodeCount();
+    header.nPrimOrder = (uint32_t)primOrder.size();
+    for (int i = 0; i < 3; ++i) {
+        header.bounds[0][i] = bounds.pMin[i];
+        header.bounds[1][i] = bounds.pMax[i];
+    }
+    const void* data;
+    switch (layout) {
+        case BVH_4:
+            data = nodeArray(nodes4);
+            break;
+        case BVH_8:
+            data = nodeArray(nodes8);
+            break;
+        case BVH_4_QUANTIZED:
+            data = nodeArray(nodes4q);
+            break;
+        case BVH_8_QUANTIZED:
+            data = nodeArray(nodes8q);
+            break;
+        default:
+            data = nodeArray(nodes);
+            break;
+    }
+    return WriteBVHCache(BVHCacheFilename(key), header, data,
+                         primOrder.size() ? &primOrder[0] : NULL);
+}
+
+// 映射来的节点原地使用, 被截断或损坏的文件会让遍历越界读, 所以
+// 加载时把每个节点查一遍: 孩子必须在父节点后面 (所以没有环) 且在
+// 节点数组里, 叶子的范围必须在 primOrder 里. 遍历的栈有 64 层,
+// 内部节点的深度也不能超过它
+static const uint32_t BVH_CACHE_MAX_DEPTH = 64;
+
+// 叶子占 ceil(n / blockSize) 个块, offset 按块计
+static bool validCachedLeaf(uint64_t offset,
+                            uint64_t n,
+                            uint32_t blockSize,
+                            uint32_t nPrimOrder) {
+    return (offset + (n + blockSize - 1) / blockSize) * blockSize <=
+           nPrimOrder;
+}
+
+// 孩子 child 的深度比 parent 多一层, 返回是否还在限制以内
+static bool validCachedChild(uint32_t parent,
+                             uint32_t child,
+                             vector<uint8_t>& depth) {
+    if (child <= parent || child >= depth.size() ||
+        depth[parent] + 1u >= BVH_CACHE_MAX_DEPTH)
+        return false;
+    depth[child] = max<uint8_t>(depth[child], depth[parent] + 1);
+    return true;
+}
+
+static bool validCachedNodes(const LinearBVHNode* nodes,
+                             uint32_t nNodes,
+                             uint32_t blockSize,
+                             uint32_t nPrimOrder) {
+    vector<uint8_t> depth(nNodes, 0);
+    for (uint32_t i = 0; i < nNodes; ++i) {
+        const LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0) {
+            if (!validCachedLeaf(node.primitivesOffset, node.nPrimitives,
+                                 blockSize, nPrimOrder))
+                return false;
+        } else if (node.axis > 2 || !validCachedChild(i, i + 1, depth) ||
+                   node.secondChildOffset == i + 1 ||
+                   !validCachedChild(i, node.secondChildOffset, depth))
+            return false;
+    }
+    return true;
+}
+
+// 宽节点的空位 (child 和 nPrimitives 都是 0) 必须不会被光线命中,
+// 否则遍历会回到根节点
+template <int N>
+static bool cachedSlotEmpty(const WideBVHNode<N>& node, int i) {
+    const BBoxSoA<N>& b = node.childBounds;
+    return b.b[0][0][i] > b.b[1][0][i] || b.b[0][1][i] > b.b[1][1][i] ||
+           b.b[0][2][i] > b.b[1][2][i];
+}
+
+template <int N>
+static bool cachedSlotEmpty(const QuantizedBVHNode<N>& node, int i) {
+    return !(node.validMask & (1 << i));
+}
+
+template <int N>
+static bool validCachedFrame(const WideBVHNode<N>&) {
+    return true;
+}
+
+template <int N>
+static bool validCachedFrame(const QuantizedBVHNode<N>& node) {
+    for (int axis = 0; axis < 3; ++axis)
+        if (node.exponent[axis] < -126)
+            return false;
+    return true;
+}
+
+template <template <int> class Node, int N>
+static bool validCachedNodes(const Node<N>* nodes,
+                             uint32_t nNodes,
+                             uint32_t blockSize,
+                             uint32_t nPrimOrder) {
+    vector<uint8_t> depth(nNodes, 0);
+    for (uint32_t n = 0; n < nNodes; ++n) {
+        const Node<N>& node = nodes[n];
+        if (!validCachedFrame(node))
+            return false;
+        for (int i = 0; i < N; ++i) {
+            if (node.nPrimitives[i] > 0) {
+                if (!validCachedLeaf(node.child[i], node.nPrimitives[i],
+                                     blockSize, nPrimOrder))
+                    return false;
+            } else if (node.child[i] != 0) {
+                if (!validCachedChild(n, node.child[i], depth))
+                    return false;
+            } else if (!cachedSlotEmpty(node, i))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool BVHTree::LoadCache(uint64_t key,
+                        BVHLayout l,
+                        uint32_t leafBlockSize,
+                        const uint32_t** primOrder,
+                        uint32_t* nPrimOrder) {
+    if (!BVHCacheEnabled())
+        return false;
+    const BVHCacheHeader* header;
+    Reference<MappedFile> file =
+        MapBVHCache(BVHCacheFilename(key), key, &header);
+    leafBlockSize = max(leafBlockSize, 1u);
+    // 哈希相同但构建参数不同的文件不应该出现, 以防万一也当作没有
+    if (!file || header->layout != (uint32_t)l ||
+        header->blockSize != leafBlockSize ||
+        header->nodeSize != layoutNodeSize(l) || header->nNodes == 0)
+        return false;
+
+    const char* base = (const char*)file->Data();
+    const void* fileNodes = base + header->nodesOffset;
+    uint32_t n = header->nNodes, nPrims = header->nPrimOrder;
+    bool valid;
+    switch (l) {
+        case BVH_4:
+            valid = validCachedNodes((const BVH4Node*)fileNodes, n,
+                                     leafBlockSize, nPrims);
+            break;
+        case BVH_8:
+            valid = validCachedNodes((const BVH8Node*)fileNodes, n,
+                                     leafBlockSize, nPrims);
+            break;
+        case BVH_4_QUANTIZED:
+            valid = validCachedNodes((const BVH4QNode*)fileNodes, n,
+                                     leafBlockSize, nPrims);
+            break;
+        case BVH_8_QUANTIZED:
+            valid = validCachedNodes((const BVH8QNode*)fileNodes, n,
+                                     leafBlockSize, nPrims);
+            break;
+        default:
+            valid = validCachedNodes((const LinearBVHNode*)fileNodes, n,
+                                     leafBlockSize, nPrims);
+            break;
+    }
+    if (!valid) {
+        fprintf(stderr, "BVH cache: \"%s\" is corrupt, rebuilding\n",
+                BVHCacheFilename(key).c_str());
+        return false;
+    }
+
+    layout = l;
+    blockSize = leafBlockSize;
+    refitRoots.clear();
+    nodes.clear();
+    nodes4.clear();
+    nodes8.clear();
+    nodes4q.clear();
+    nodes8q.clear();
+    mapping = file;
+    mappedNodes = fileNodes;
+    nMappedNodes = header->nNodes;
+    bounds = BBox(Point(header->bounds[0][0], header->bounds[0][1],
+                        header->bounds[0][2]),
+                  Point(header->bounds[1][0], header->bounds[1][1],
+                        header->bounds[1][2]));
+    *primOrder = (const uint32_t*)(base + header->primOrderOffset);
+    *nPrimOrder = header->nPrimOrder;
+    return true;
+}
+
+size_t BVHTree::MemoryUsage() const {
+    // 映射的缓存文件也算上, 虽然它的页面可以和别的进程共用
+    return (mapping ? mapping->Size() : 0) +
+           nodes.capacity() * sizeof(LinearBVHNode) +
+           nodes4.capacity() * sizeof(BVH4Node) +
+           nodes8.capacity() * sizeof(BVH8Node) +
+           nodes4q.capacity() * sizeof(BVH4QNode) +
+           nodes8q.capacity() * sizeof(BVH8QNode) +
+           refitRoots.capacity() * sizeof(BVHRefitRoot);
+}
+
+// 空盒子的表面积按 0 算, 不让它把代价变成无穷大
+static float refitArea(const BBox& b) {
+    if (b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z)
+        return 0.f;
+    return b.SurfaceArea();
+}
+
+// 一次重新拟合遍历的参数. 代价是子树里每个节点的表面积乘上访问它的
+// 代价之和, 和构建时的 SAH 一致
+struct RefitContext {
+    RefitContext(const BVHLeafBounds* lb,
+                 uint32_t bs,
+                 const vector<BVHRefitRoot>* r)
+        : leafBounds(lb), blockSize(bs), roots(r) {}
+    float intersectCost(uint32_t n) const {
+        return float((n + blockSize - 1) / blockSize);
+    }
+    // 顶层遍历碰到已经拟合好的子树根时直接用结果, 子树任务里为 NULL
+    const BVHRefitRoot* FindRoot(uint32_t node) const {
+        if (!roots)
+            return NULL;
+        vector<BVHRefitRoot>::const_iterator it = std::lower_bound(
+            roots->begin(), roots->end(), node,
+            [](const BVHRefitRoot& r, uint32_t n) { return r.node < n; });
+        return (it != roots->end() && it->node == node) ? &*it : NULL;
+    }
+
+    const BVHLeafBounds* leafBounds;
+    uint32_t blockSize;
+    const vector<BVHRefitRoot>* roots;
+};
+
+static BBox refitBinary(LinearBVHNode* nodes,
+                        uint32_t n,
+                        const RefitContext& ctx,
+                        float* cost) {
+    if (const BVHRefitRoot* root = ctx.FindRoot(n)) {
+        *cost += root->cost * refitArea(root->bounds);
+        return root->bounds;
+    }
+    LinearBVHNode* node = &nodes[n];
+    BBox b;
+    if (node->nPrimitives > 0) {
+        b = ctx.leafBounds ? (*ctx.leafBounds)(node->primitivesOffset,
+                                               node->nPrimitives)
+                           : node->bounds;
+        *cost += ctx.intersectCost(node->nPrimitives) * refitArea(b);
+    } else {
+        b = Union(refitBinary(nodes, n + 1, ctx, cost),
+                  refitBinary(nodes, node->secondChildOffset, ctx, cost));
+        *cost += traversalCost * refitArea(b);
+    }
+    node->bounds = b;
+    return b;
+}
+
+template <int N>
+static BBox childBounds(const WideBVHNode<N>& node, int i) {
+    return node.childBounds.Get(i);
+}
+
+template <int N>
+static BBox childBounds(const QuantizedBVHNode<N>& node, int i) {
+    return node.Get(i);
+}
+
+template <int N>
+static void storeNode(const WideBVHNode<N>& wide, WideBVHNode<N>* node) {
+    *node = wide;
+}
+
+template <int N>
+static void storeNode(const WideBVHNode<N>& wide, QuantizedBVHNode<N>* node) {
+    *node = quantize(wide);
+}
+
+// 宽节点的空位: 既不是叶子也不指向节点 (根节点不会是别人的孩子)
+template <template <int> class Node, int N>
+static bool isInterior(const Node<N>& node, int i) {
+    return node.nPrimitives[i] == 0 && node.child[i] != 0;
+}
+
+// 量化节点也按精确的包围盒重新量化, 不在量化过的盒子上累积误差
+template <template <int> class Node, int N>
+static BBox refitWide(Node<N>* nodes,
+                      uint32_t n,
+                      const RefitContext& ctx,
+                      float* cost) {
+    if (const BVHRefitRoot* root = ctx.FindRoot(n)) {
+        *cost += root->cost * refitArea(root->bounds);
+        return root->bounds;
+    }
+    Node<N>* node = &nodes[n];
+    WideBVHNode<N> wide;
+    BBox b;
+    for (int i = 0; i < N; ++i) {
+        wide.child[i] = node->child[i];
+        wide.nPrimitives[i] = node->nPrimitives[i];
+        BBox cb;
+        if (node->nPrimitives[i] > 0) {
+            cb = ctx.leafBounds ? (*ctx.leafBounds)(node->child[i],
+                                                    node->nPrimitives[i])
+                                : childBounds(*node, i);
+            *cost += ctx.intersectCost(node->nPrimitives[i]) * refitArea(cb);
+        } else if (node->child[i] != 0)
+            cb = refitWide(nodes, node->child[i], ctx, cost);
+        else
+            continue;
+        wide.childBounds.Set(i, cb);
+        b = Union(b, cb);
+    }
+    if (ctx.leafBounds)
+        storeNode(wide, node);
+    *cost += traversalCost * refitArea(b);
+    return b;
+}
+
+// 在子树的叶子上重建二叉层次: 每个叶子当作一个不可再分的图元,
+// 建出来的叶子原样指回旧叶子的图元. leaves 的 bounds 都不能是空的
+static void buildOverLeaves(const vector<LinearBVHNode>& leaves,
+                            vector<LinearBVHNode>* sub) {
+    vector<BBox> leafBounds(leaves.size());
+    for (uint32_t i = 0; i < leaves.size(); ++i)
+        leafBounds[i] = leaves[i].bounds;
+    vector<uint32_t> order;
+    BuildBVH(leafBounds, 1, sub, &order);
+    for (uint32_t i = 0; i < sub->size(); ++i) {
+        LinearBVHNode& node = (*sub)[i];
+        if (node.nPrimitives == 0)
+            continue;
+        const LinearBVHNode& leaf = leaves[order[node.primitivesOffset]];
+        node.primitivesOffset = leaf.primitivesOffset;
+        node.nPrimitives = leaf.nPrimitives;
+    }
+}
+
+// 二叉树的节点数总是叶子数的两倍减一, 重建的子树正好放回原处
+static bool rebuildBinary(vector<LinearBVHNode>& nodes, uint32_t r) {
+    vector<LinearBVHNode> leaves;
+    vector<uint32_t> todo(1, r);
+    while (!todo.empty()) {
+        uint32_t n = todo.back();
+        todo.pop_back();
+        if (nodes[n].nPrimitives > 0) {
+            if (nodes[n].bounds.pMin.x > nodes[n].bounds.pMax.x)
+                return false;
+            leaves.push_back(nodes[n]);
+        } else {
+            todo.push_back(nodes[n].secondChildOffset);
+            todo.push_back(n + 1);
+        }
+    }
+    if (leaves.size() <= 2)
+        return false;
+    vector<LinearBVHNode> sub;
+    buildOverLeaves(leaves, &sub);
+    for (uint32_t i = 0; i < sub.size(); ++i) {
+        if (sub[i].nPrimitives == 0)
+            sub[i].secondChildOffset += r;
+        nodes[r + i] = sub[i];
+    }
+    return true;
+}
+
+// 宽节点的个数和层次有关, 重建的子树接在数组末尾,
+// 父节点改指向它, 旧节点由 compactWide 回收
+template <template <int> class Node, int N>
+static bool rebuildWide(vector<Node<N>>& nodes, BVHRefitRoot* root) {
+    vector<LinearBVHNode> leaves;
+    vector<uint32_t> todo(1, root->node);
+    while (!todo.empty()) {
+        const Node<N>& node = nodes[todo.back()];
+        todo.pop_back();
+        for (int i = 0; i < N; ++i) {
+            if (isInterior(node, i))
+                todo.push_back(node.child[i]);
+            else if (node.nPrimitives[i] > 0) {
+                LinearBVHNode leaf;
+                leaf.bounds = childBounds(node, i);
+                if (leaf.bounds.pMin.x > leaf.bounds.pMax.x)
+                    return false;
+                leaf.primitivesOffset = node.child[i];
+                leaf.nPrimitives = node.nPrimitives[i];
+                leaves.push_back(leaf);
+            }
+        }
+    }
+    if (leaves.size() <= 2)
+        return false;
+    vector<LinearBVHNode> sub;
+    buildOverLeaves(leaves, &sub);
+    vector<WideBVHNode<N>> wide;
+    CollapseBVH(sub, &wide);
+
+    uint32_t base = (uint32_t)nodes.size();
+    for (uint32_t i = 0; i < wide.size(); ++i) {
+        for (int c = 0; c < N; ++c)
+            if (isInterior(wide[i], c))
+                wide[i].child[c] += base;
+        nodes.push_back(Node<N>());
+        storeNode(wide[i], &nodes.back());
+    }
+    if (root->parent != ~0u)
+        nodes[root->parent].child[root->slot] = base;
+    root->node = base;
+    return true;
+}
+
+// 从根开始按深度优先把还能走到的节点拷到新数组, 丢掉重建换下来的
+template <template <int> class Node, int N>
+static void compactWide(vector<Node<N>>& nodes,
+                        uint32_t rootNode,
+                        vector<BVHRefitRoot>* roots) {
+    vector<Node<N>> compacted;
+    compacted.reserve(nodes.size());
+    vector<uint32_t> remap(nodes.size(), ~0u);
+    vector<uint32_t> todo(1, rootNode);
+    while (!todo.empty()) {
+        uint32_t n = todo.back();
+        todo.pop_back();
+        remap[n] = (uint32_t)compacted.size();
+        compacted.push_back(nodes[n]);
+        for (int i = N - 1; i >= 0; --i)
+            if (isInterior(nodes[n], i))
+                todo.push_back(nodes[n].child[i]);
+    }
+    for (uint32_t i = 0; i < compacted.size(); ++i)
+        for (int c = 0; c < N; ++c)
+            if (isInterior(compacted[i], c))
+                compacted[i].child[c] = remap[compacted[i].child[c]];
+    for (uint32_t i = 0; i < roots->size(); ++i) {
+        BVHRefitRoot& r = (*roots)[i];
+        r.node = remap[r.node];
+        if (r.parent != ~0u)
+            r.parent = remap[r.parent];
+    }
+    nodes.swap(compacted);
+}
+
+template <template <int> class Node, int N>
+static void interiorChildren(const vector<Node<N>>& nodes,
+                             uint32_t n,
+                             vector<BVHRefitRoot>* children) {
+    for (int i = 0; i < N; ++i)
+        if (isInterior(nodes[n], i)) {
+            BVHRefitRoot r;
+            r.node = nodes[n].child[i];
+            r.parent = n;
+            r.slot = i;
+            children->push_back(r);
+        }
+}
+
+static void interiorChildren(const vector<LinearBVHNode>& nodes,
+                             uint32_t n,
+                             vector<BVHRefitRoot>* children) {
+    if (nodes[n].nPrimitives > 0)
+        return;
+    BVHRefitRoot r;
+    r.node = n + 1;
+    r.parent = n;
+    r.slot = 0;
+    children->push_back(r);
+    r.node = nodes[n].secondChildOffset;
+    r.slot = 1;
+    children->push_back(r);
+}
+
+// 一棵顶层子树的重新拟合任务, 结果写回它自己的 BVHRefitRoot
+class BVHRefitTask : public Task {
+   public:
+    BVHRefitTask(BVHTree* t, BVHRefitRoot* r, const BVHLeafBounds* lb)
+        : tree(t), root(r), leafBounds(lb) {}
+    void Run() { tree->refitRoot(root, leafBounds); }
+
+   private:
+    BVHTree* tree;
+    BVHRefitRoot* root;
+    const BVHLeafBounds* leafBounds;
+};
+
+uint32_t BVHTree::nodeCount() const {
+    if (mappedNodes)
+        return nMappedNodes;
+    switch (layout) {
+        case BVH_4:
+            return (uint32_t)nodes4.size();
+        case BVH_8:
+            return (uint32_t)nodes8.size();
+        case BVH_4_QUANTIZED:
+            return (uint32_t)nodes4q.size();
+        case BVH_8_QUANTIZED:
+            return (uint32_t)nodes8q.size();
+        default:
+            return (uint32_t)nodes.size();
+    }
+}
+
+void BVHTree::refitRoot(BVHRefitRoot* root, const BVHLeafBounds* leafBounds) {
+    RefitContext ctx(leafBounds, blockSize, NULL);
+    float cost = 0.f;
+    switch (layout) {
+        case BVH_4:
+            root->bounds = refitWide(&nodes4[0], root->node, ctx, &cost);
+            break;
+        case BVH_8:
+            root->bounds = refitWide(&nodes8[0], root->node, ctx, &cost);
+            break;
+        case BVH_4_QUANTIZED:
+            root->bounds = refitWide(&nodes4q[0], root->node, ctx, &cost);
+            break;
+        case BVH_8_QUANTIZED:
+            root->bounds = refitWide(&nodes8q[0], root->node, ctx, &cost);
+            break;
+        default:
+            root->bounds = refitBinary(&nodes[0], root->node, ctx, &cost);
+            break;
+    }
+    float area = refitArea(root->bounds);
+    root->cost = area > 0.f ? cost / area : 0.f;
+}
+
+// 子树根以上的部分串行拟合, 返回整棵树归一化的代价
+float BVHTree::refitTop(const BVHLeafBounds* leafBounds) {
+    RefitContext ctx(leafBounds, blockSize, &refitRoots);
+    float cost = 0.f;
+    switch (layout) {
+        case BVH_4:
+            bounds = refitWide(&nodes4[0], 0, ctx, &cost);
+            break;
+        case BVH_8:
+            bounds = refitWide(&nodes8[0], 0, ctx, &cost);
+            break;
+        case BVH_4_QUANTIZED:
+            bounds = refitWide(&nodes4q[0], 0, ctx, &cost);
+            break;
+        case BVH_8_QUANTIZED:
+            bounds = refitWide(&nodes8q[0], 0, ctx, &cost);
+            break;
+        default:
+            bounds = refitBinary(&nodes[0], 0, ctx, &cost);
+            break;
+    }
+    float area = refitArea(bounds);
+    return area > 0.f ? cost / area : 0.f;
+}
+
+void BVHTree::runRefitTasks(const BVHLeafBounds* leafBounds) {
+    if (refitRoots.size() == 1) {
+        refitRoot(&refitRoots[0], leafBounds);
+        return;
+    }
+    vector<Task*> tasks;
+    tasks.reserve(refitRoots.size());
+    for (uint32_t i = 0; i < refitRoots.size(); ++i)
+        tasks.push_back(new BVHRefitTask(this, &refitRoots[i], leafBounds));
+    EnqueueTasks(tasks);
+    WaitForAllTasks();
+    for (uint32_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+}
+
+// 一层一层往下展开内部节点, 直到子树够每个核分到几棵.
+// 展开过的节点和中途碰到的叶子留给 refitTop
+void BVHTree::initRefit() {
+    BVHRefitRoot root;
+    root.node = 0;
+    root.parent = ~0u;
+    root.slot = 0;
+    vector<BVHRefitRoot> level(1, root);
+    if (nodeCount() >= minParallelRefitNodes) {
+        uint32_t target = 8 * NumSystemCores();
+        while (level.size() < target) {
+            vector<BVHRefitRoot> next;
+            for (uint32_t i = 0; i < level.size(); ++i) {
+                uint32_t n = level[i].node;
+                switch (layout) {
+                    case BVH_4:
+                        interiorChildren(nodes4, n, &next);
+                        break;
+                    case BVH_8:
+                        interiorChildren(nodes8, n, &next);
+                        break;
+                    case BVH_4_QUANTIZED:
+                        interiorChildren(nodes4q, n, &next);
+                        break;
+                    case BVH_8_QUANTIZED:
+                        interiorChildren(nodes8q, n, &next);
+                        break;
+                    default:
+                        interiorChildren(nodes, n, &next);
+                        break;
+                }
+            }
+            if (next.empty())
+                break;
+            level.swap(next);
+        }
+    }
+    std::sort(level.begin(), level.end(),
+              [](const BVHRefitRoot& a, const BVHRefitRoot& b) {
+                  return a.node < b.node;
+              });
+    refitRoots.swap(level);
+
+    // 按构建出来的包围盒记下初始代价
+    runRefitTasks(NULL);
+    for (uint32_t i = 0; i < refitRoots.size(); ++i)
+        refitRoots[i].initialCost = refitRoots[i].cost;
+    initialCost = refitTop(NULL);
+}
+
+bool BVHTree::rebuildRoot(BVHRefitRoot* root) {
+    switch (layout) {
+        case BVH_4:
+            return rebuildWide(nodes4, root);
+        case BVH_8:
+            return rebuildWide(nodes8, root);
+        case BVH_4_QUANTIZED:
+            return rebuildWide(nodes4q, root);
+        case BVH_8_QUANTIZED:
+            return rebuildWide(nodes8q, root);
+        default:
+            return rebuildBinary(nodes, root->node);
+    }
+}
+
+float BVHTree::refit(const BVHLeafBounds& leafBounds, float rebuildThreshold) {
+    detach();
+    if (nodeCount() == 0)
+        return 1.f;
+    if (refitRoots.empty())
+        initRefit();
+    runRefitTasks(&leafBounds);
+
+    // 退化的子树在刚拟合好的叶子包围盒上重建, 代价重新起算.
+    // 量化节点里存的叶子包围盒偏大, 重建后再精确拟合一遍
+    bool rebuilt = false;
+    for (uint32_t i = 0; i < refitRoots.size(); ++i) {
+        BVHRefitRoot& root = refitRoots[i];
+        if (root.initialCost <= 0.f ||
+            root.cost <= rebuildThreshold * root.initialCost)
+            continue;
+        if (rebuildRoot(&root)) {
+            refitRoot(&root, &leafBounds);
+            root.initialCost = root.cost;
+            rebuilt = true;
+        }
+    }
+    if (rebuilt && layout != BVH_BINARY) {
+        // 只有一棵子树时它就是整棵树, 根可能被换到了数组末尾
+        uint32_t rootNode =
+            refitRoots[0].parent == ~0u ? refitRoots[0].node : 0;
+        switch (layout) {
+            case BVH_4:
+                compactWide(nodes4, rootNode, &refitRoots);
+                break;
+            case BVH_8:
+                compactWide(nodes8, rootNode, &refitRoots);
+                break;
+            case BVH_4_QUANTIZED:
+                compactWide(nodes4q, rootNode, &refitRoots);
+                break;
+            case BVH_8_QUANTIZED:
+                compactWide(nodes8q, rootNode, &refitRoots);
+                break;
+            default:
+                break;
+        }
+        std::sort(refitRoots.begin(), refitRoots.end(),
+                  [](const BVHRefitRoot& a, const BVHRefitRoot& b) {
+                      return a.node < b.node;
+                  });
+    }
+
+    float cost = refitTop(&leafBounds);
+    return initialCost > 0.f ? cost / initialCost : 1.f;
+}
+
+BVHAccel::BVHAccel(const vector<Reference<Shape>>& p,
+                   uint32_t maxPrims,
+                   BVHLayout layout,
+                   BVHSplitMethod splitMethod)
+    : maxPrimsInNode(maxPrims) {
+    PBRT_BVH_STARTED_CONSTRUCTION(this, p.size());
+    vector<BBox> primBounds(p.size());
+    for (uint32_t i = 0; i < p.size(); ++i)
+        primBounds[i] = p[i]->WorldBound();
+    vector<uint32_t> primOrder;
+    tree.Build(primBounds, maxPrimsInNode, layout, &primOrder, 1,
+               splitMethod);
+    primitives.reserve(p.size());
+    // 不能直接求交的图元等光线碰到时再细分
+    for (uint32_t i = 0; i < primOrder.size(); ++i)
+        primitives.push_back(LazyAccel::Wrap(p[primOrder[i]]));
+    PBRT_BVH_FINISHED_CONSTRUCTION(this);
+}
+
+BVHAccel::~BVHAccel() {}
+
+BBox BVHAccel::objectBound() const {
+    return WorldBound();
+}
+
+BBox BVHAccel::WorldBound() const {
+    return tree.Bounds();
+}
+
+float BVHAccel::Refit(float rebuildThreshold) {
+    return tree.Refit(
+        [&](uint32_t offset, uint32_t n) {
+            BBox b;
+            for (uint32_t i = 0; i < n; ++i)
+                b = Union(b, primitives[offset + i]->WorldBound());
+            return b;
+        },
+        rebuildThreshold);
+}
+
+size_t BVHAccel::MemoryUsage() const {
+    size_t bytes = sizeof(*this) + tree.MemoryUsage();
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        bytes += primitives[i]->MemoryUsage();
+    return bytes;
+}
+
+bool BVHAccel::Intersect(const Ray& ray,
+                         float* tHit,
+                         float* rayEpsilon,
+                         DifferentialGeometry* dg) const {
+    if (tree.Empty())
+        return false;
+    PBRT_BVH_INTERSECTION_STARTED(const_cast<BVHAccel*>(this),
+                                  const_cast<Ray*>(&ray));
+    TraversalRay tray(ray);
+    bool hit = tree.Intersect(
+        tray, [&](uint32_t i, const TraversalRay& r) {
+            const Shape* prim = primitives[i].GetPtr();
+            PBRT_BVH_INTERSECTION_PRIMITIVE_TEST(const_cast<Shape*>(prim));
+            // 图元只认 Ray, 用它的 maxt 把已有的最近命中传下去
+            ray.maxt = r.maxt;
+            if (prim->Intersect(ray, tHit, rayEpsilon, dg)) {
+                PBRT_BVH_INTERSECTION_PRIMITIVE_HIT(const_cast<Shape*>(prim));
+                r.maxt = *tHit;
+                return true;
+            }
+            PBRT_BVH_INTERSECTION_PRIMITIVE_MISSED(const_cast<Shape*>(prim));
+            return false;
+        });
+    ray.maxt = tray.maxt;
+    PBRT_BVH_INTERSECTION_FINISHED();
+    return hit;
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const {
+    if (tree.Empty())
+        return false;
+    PBRT_BVH_INTERSECTIONP_STARTED(const_cast<BVHAccel*>(this),
+                                   const_cast<Ray*>(&ray));
+    TraversalRay tray(ray);
+    bool hit = tree.IntersectP(
+        tray, [&](uint32_t i, const TraversalRay& r) {
+            const Shape* prim = primitives[i].GetPtr();
+            PBRT_BVH_INTERSECTIONP_PRIMITIVE_TEST(const_cast<Shape*>(prim));
+            if (prim->IntersectP(ray)) {
+                PBRT_BVH_INTERSECTIONP_PRIMITIVE_HIT(const_cast<Shape*>(prim));
+                return true;
+            }
+            PBRT_BVH_INTERSECTIONP_PRIMITIVE_MISSED(
+                const_cast<Shape*>(prim));
+            return false;
+        });
+    PBRT_BVH_INTERSECTIONP_FINISHED();
+    return hit;
+}
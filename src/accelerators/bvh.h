@@ -0,0 +1,551 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/shape.h"
+#include "core/probes.h"
+#include "core/mmap.h"
+
+// 展平后的 BVH 节点, 按深度优先排列: 内部节点的第一个孩子紧跟在
+// 自己后面, 只需要存第二个孩子的位置. 32 字节, 两个节点一个缓存行
+struct alignas(32) LinearBVHNode {
+    BBox bounds;
+    union {
+        uint32_t primitivesOffset;   // 叶子
+        uint32_t secondChildOffset;  // 内部节点
+    };
+    uint16_t nPrimitives;  // 0 表示内部节点
+    uint8_t axis;          // 内部节点的划分轴
+    uint8_t pad[1];
+};
+
+// 构建时的划分方法.
+// SAH: 分桶的 SAH, 树的质量最好, 构建最慢.
+// LBVH: 按质心的 Morton 码排序后直接按码的位划分, 构建最快.
+// HLBVH: 同 LBVH, 但顶上几层在 Morton 码高 12 位分出的小树上做 SAH
+enum BVHSplitMethod { BVH_SPLIT_SAH, BVH_SPLIT_LBVH, BVH_SPLIT_HLBVH };
+
+// 通用的 BVH 构建, 只需要每个图元的包围盒. SAH 划分时顶层拆出的
+// 子树作为 Task 并行构建; LBVH 的 Morton 码, 基数排序和各个小树也都
+// 分成 Task 做. 输出深度优先的节点数组;
+// 叶子里第 i 个位置对应原来的第 (*primOrder)[i] 个图元.
+// 叶子里的图元按 leafBlockSize 个一块做 SIMD 测试时, SAH 按块数计代价
+void BuildBVH(const vector<BBox>& primBounds,
+              uint32_t maxPrimsInNode,
+              vector<LinearBVHNode>* nodes,
+              vector<uint32_t>* primOrder,
+              uint32_t leafBlockSize = 1,
+              BVHSplitMethod splitMethod = BVH_SPLIT_SAH);
+
+// 最近命中的遍历. intersectLeaf(offset, n, ray) 测试从 offset 开始的
+// n 个图元, 命中时要把 ray.maxt 缩短到交点, 后面的节点测试才能剔除得更多
+template <typename LeafIntersect>
+bool IntersectBVH(const LinearBVHNode* nodes,
+                  const TraversalRay& ray,
+                  LeafIntersect intersectLeaf) {
+    bool hit = false;
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint32_t todo[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[nodeNum];
+        if (node->bounds.IntersectP(ray)) {
+            if (node->nPrimitives > 0) {
+                PBRT_BVH_INTERSECTION_TRAVERSED_LEAF_NODE(
+                    const_cast<LinearBVHNode*>(node));
+                if (intersectLeaf(node->primitivesOffset, node->nPrimitives,
+                                  ray))
+                    hit = true;
+                if (todoOffset == 0)
+                    break;
+                nodeNum = todo[--todoOffset];
+            } else {
+                // 先走光线方向上近的孩子
+                PBRT_BVH_INTERSECTION_TRAVERSED_INTERIOR_NODE(
+                    const_cast<LinearBVHNode*>(node));
+                if (ray.dirIsNeg[node->axis]) {
+                    todo[todoOffset++] = nodeNum + 1;
+                    nodeNum = node->secondChildOffset;
+                } else {
+                    todo[todoOffset++] = node->secondChildOffset;
+                    nodeNum = nodeNum + 1;
+                }
+            }
+        } else {
+            if (todoOffset == 0)
+                break;
+            nodeNum = todo[--todoOffset];
+        }
+    }
+    return hit;
+}
+
+// 只判断有没有遮挡, 第一次命中就返回
+template <typename LeafIntersectP>
+bool IntersectPBVH(const LinearBVHNode* nodes,
+                   const TraversalRay& ray,
+                   LeafIntersectP intersectLeafP) {
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint32_t todo[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[nodeNum];
+        if (node->bounds.IntersectP(ray)) {
+            if (node->nPrimitives > 0) {
+                PBRT_BVH_INTERSECTIONP_TRAVERSED_LEAF_NODE(
+                    const_cast<LinearBVHNode*>(node));
+                if (intersectLeafP(node->primitivesOffset, node->nPrimitives,
+                                   ray))
+                    return true;
+                if (todoOffset == 0)
+                    break;
+                nodeNum = todo[--todoOffset];
+            } else {
+                PBRT_BVH_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(
+                    const_cast<LinearBVHNode*>(node));
+                if (ray.dirIsNeg[node->axis]) {
+                    todo[todoOffset++] = nodeNum + 1;
+                    nodeNum = node->secondChildOffset;
+                } else {
+                    todo[todoOffset++] = node->secondChildOffset;
+                    nodeNum = nodeNum + 1;
+                }
+            }
+        } else {
+            if (todoOffset == 0)
+                break;
+            nodeNum = todo[--todoOffset];
+        }
+    }
+    return false;
+}
+
+// 节点宽度和精度, 在构建时选择. 宽节点由二叉树压缩而来,
+// 量化节点再由宽节点压缩而来
+enum BVHLayout { BVH_BINARY, BVH_4, BVH_8, BVH_4_QUANTIZED, BVH_8_QUANTIZED };
+
+// N 叉节点: N 个孩子的包围盒按 SoA 存在节点里, 一次 SIMD 测试全部孩子.
+// BVH4 节点 128 字节, BVH8 节点 256 字节, 都是整数个缓存行
+template <int N>
+struct alignas(32) WideBVHNode {
+    BBoxSoA<N> childBounds;
+    // 内部孩子是节点下标, 叶子孩子是图元的起始位置
+    uint32_t child[N];
+    // 0 表示内部孩子, 否则是叶子里的图元数. 空位的包围盒是空的, 不会命中
+    uint16_t nPrimitives[N];
+
+    // 返回命中的孩子掩码, tNear 写入每个孩子的入点距离
+    int IntersectP(const TraversalRay& ray, float tNear[N]) const;
+};
+
+template <int N>
+int WideBVHNode<N>::IntersectP(const TraversalRay& ray, float tNear[N]) const {
+    return childBounds.IntersectP(ray, tNear);
+}
+
+typedef WideBVHNode<4> BVH4Node;
+typedef WideBVHNode<8> BVH8Node;
+
+// 2^exponent, 量化节点的步长. 直接拼浮点数的位, exponent 在 [-126, 127]
+inline float QuantizedScale(int exponent) {
+    int32_t bits = (exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return scale;
+}
+
+// 量化的 N 叉节点: 孩子的包围盒存成相对父节点坐标系的 8 位整数,
+// 坐标 = origin + q * 2^exponent. 构建时 pMin 向下, pMax 向上取整,
+// 解出来的盒子只会比原来大, 不会漏掉命中. 反量化在 SIMD 盒子测试里做.
+// BVH4 节点 64 字节, BVH8 节点 128 字节, 是全精度节点的一半
+template <int N>
+struct alignas(32) QuantizedBVHNode {
+    int IntersectP(const TraversalRay& ray, float tNear[N]) const;
+    // 反量化出来的第 i 个孩子的包围盒
+    BBox Get(int i) const;
+
+    float origin[3];
+    int8_t exponent[3];
+    // 有孩子的槽位, 空位不参与测试
+    uint8_t validMask;
+    uint8_t q[2][3][N];  // [pMin/pMax][轴][孩子]
+    uint32_t child[N];
+    // 叶子的图元数不超过 255, 一个字节就够
+    uint8_t nPrimitives[N];
+};
+
+template <int N>
+BBox QuantizedBVHNode<N>::Get(int i) const {
+    BBox b;
+    if (!(validMask & (1 << i)))
+        return b;
+    for (int axis = 0; axis < 3; ++axis) {
+        float scale = QuantizedScale(exponent[axis]);
+        b.pMin[axis] = origin[axis] + float(q[0][axis][i]) * scale;
+        b.pMax[axis] = origin[axis] + float(q[1][axis][i]) * scale;
+    }
+    return b;
+}
+
+// 标量版本, 没有 SIMD 时使用
+template <int N>
+int QuantizedBVHNode<N>::IntersectP(const TraversalRay& ray,
+                                    float tNear[N]) const {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = ray.mint, t1 = ray.maxt;
+        for (int axis = 0; axis < 3; ++axis) {
+            int neg = ray.dirIsNeg[axis];
+            float scale = QuantizedScale(exponent[axis]);
+            float bNear = origin[axis] + float(q[neg][axis][i]) * scale;
+            float bFar = origin[axis] + float(q[1 - neg][axis][i]) * scale;
+            t0 = max(t0, (bNear - ray.o[axis]) * ray.invDir[axis]);
+            t1 = min(t1, (bFar - ray.o[axis]) * ray.invDir[axis] *
+                             BBOX_TMAX_SCALE);
+        }
+        tNear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask & validMask;
+}
+
+#ifdef PBRT_HAS_SSE
+template <>
+int QuantizedBVHNode<4>::IntersectP(const TraversalRay& ray,
+                                    float tNear[4]) const;
+template <>
+int QuantizedBVHNode<8>::IntersectP(const TraversalRay& ray,
+                                    float tNear[8]) const;
+#endif
+
+typedef QuantizedBVHNode<4> BVH4QNode;
+typedef QuantizedBVHNode<8> BVH8QNode;
+
+// 把深度优先的二叉节点压成 N 叉: 反复展开表面积最大的内部孩子,
+// 直到凑满 N 个. 叶子和图元顺序不变
+template <int N>
+void CollapseBVH(const vector<LinearBVHNode>& nodes,
+                 vector<WideBVHNode<N>>* wideNodes);
+
+// 逐个节点量化, 节点顺序和孩子下标不变
+template <int N>
+void QuantizeBVH(const vector<WideBVHNode<N>>& wideNodes,
+                 vector<QuantizedBVHNode<N>>* quantizedNodes);
+
+struct WideBVHStackEntry {
+    uint32_t offset;
+    uint16_t nPrimitives;
+    float tNear;
+    // 所在的节点, 只给探针用
+    uint32_t parent;
+};
+
+// 孩子按入点距离从近到远访问; 出栈时已经比当前最近命中远的直接跳过.
+// Node 是 WideBVHNode 或 QuantizedBVHNode
+template <template <int> class Node, int N, typename LeafIntersect>
+bool IntersectWideBVH(const Node<N>* nodes,
+                      const TraversalRay& ray,
+                      LeafIntersect intersectLeaf) {
+    bool hit = false;
+    WideBVHStackEntry todo[64 * N];
+    int todoOffset = 0;
+    todo[todoOffset++] = {0, 0, ray.mint, 0};
+    while (todoOffset > 0) {
+        WideBVHStackEntry e = todo[--todoOffset];
+        if (e.tNear > ray.maxt)
+            continue;
+        if (e.nPrimitives > 0) {
+            PBRT_BVH_INTERSECTION_TRAVERSED_LEAF_NODE(
+                const_cast<Node<N>*>(&nodes[e.parent]));
+            if (intersectLeaf(e.offset, e.nPrimitives, ray))
+                hit = true;
+            continue;
+        }
+        const Node<N>* node = &nodes[e.offset];
+        PBRT_BVH_INTERSECTION_TRAVERSED_INTERIOR_NODE(
+            const_cast<Node<N>*>(node));
+        float tNear[N];
+        int mask = node->IntersectP(ray, tNear);
+        if (!mask)
+            continue;
+        // 命中的孩子按距离插入排序, 远的先压栈
+        WideBVHStackEntry hits[N];
+        int nHits = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            WideBVHStackEntry c = {node->child[i], node->nPrimitives[i],
+                                   tNear[i], e.offset};
+            int j = nHits++;
+            for (; j > 0 && hits[j - 1].tNear < c.tNear; --j)
+                hits[j] = hits[j - 1];
+            hits[j] = c;
+        }
+        for (int i = 0; i < nHits; ++i)
+            todo[todoOffset++] = hits[i];
+    }
+    return hit;
+}
+
+// 只找遮挡, 不需要排序
+template <template <int> class Node, int N, typename LeafIntersectP>
+bool IntersectPWideBVH(const Node<N>* nodes,
+                       const TraversalRay& ray,
+                       LeafIntersectP intersectLeafP) {
+    uint32_t todo[64 * N];
+    int todoOffset = 0;
+    todo[todoOffset++] = 0;
+    while (todoOffset > 0) {
+        const Node<N>* node = &nodes[todo[--todoOffset]];
+        PBRT_BVH_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(
+            const_cast<Node<N>*>(node));
+        float tNear[N];
+        int mask = node->IntersectP(ray, tNear);
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            if (node->nPrimitives[i] == 0) {
+                todo[todoOffset++] = node->child[i];
+                continue;
+            }
+            PBRT_BVH_INTERSECTIONP_TRAVERSED_LEAF_NODE(
+                const_cast<Node<N>*>(node));
+            if (intersectLeafP(node->child[i], node->nPrimitives[i], ray))
+                return true;
+        }
+    }
+    return false;
+}
+
+// 重新拟合时求叶子的包围盒. 参数和遍历时传给叶子回调的相同:
+// 叶子从 offset 开始, 有 n 个图元. 会被多个线程同时调用
+class BVHLeafBounds {
+   public:
+    virtual ~BVHLeafBounds() {}
+    virtual BBox operator()(uint32_t offset, uint32_t n) const = 0;
+};
+
+template <typename F>
+class BVHLeafBoundsFunc : public BVHLeafBounds {
+   public:
+    BVHLeafBoundsFunc(F f) : f(f) {}
+    BBox operator()(uint32_t offset, uint32_t n) const {
+        return f(offset, n);
+    }
+
+   private:
+    F f;
+};
+
+// 重新拟合时划出的一棵顶层子树, 每棵一个任务
+struct BVHRefitRoot {
+    uint32_t node;
+    // 宽节点里指向它的父节点和槽位, 整棵树的根没有父节点 (~0u)
+    uint32_t parent;
+    int slot;
+    // 构建 (或上次重建) 时和最近一次拟合后的 SAH 代价,
+    // 按子树根的表面积归一, 平移和整体缩放不改变它
+    float initialCost, cost;
+    BBox bounds;
+};
+
+// SAH 代价涨到构建时的这么多倍, 子树就重建
+static const float BVH_REBUILD_THRESHOLD = 1.5f;
+
+// 一棵建好的 BVH, 按选定的布局保存节点并分派遍历.
+// 图元本身由使用者按 primOrder 的顺序保存
+class BVHTree {
+   public:
+    BVHTree()
+        : layout(BVH_BINARY),
+          blockSize(1),
+          mappedNodes(NULL),
+          nMappedNodes(0),
+          initialCost(0.f) {}
+    void Build(const vector<BBox>& primBounds,
+               uint32_t maxPrimsInNode,
+               BVHLayout layout,
+               vector<uint32_t>* primOrder,
+               uint32_t leafBlockSize = 1,
+               BVHSplitMethod splitMethod = BVH_SPLIT_SAH);
+    bool Empty() const { return bounds.pMin.x > bounds.pMax.x; }
+    const BBox& Bounds() const { return bounds; }
+    BVHLayout Layout() const { return layout; }
+    size_t MemoryUsage() const;
+
+    // 磁盘缓存, 见 bvhcache.h. key 是使用者对决定这棵树的所有输入
+    // (图元, 变换, 构建参数) 算出的内容哈希. primOrder 按叶子顺序
+    // 保存, 含义由使用者决定, 比如 RemapLeaves 以后的块内容.
+    // 没有开启缓存时两个都直接返回 false
+    bool SaveCache(uint64_t key, const vector<uint32_t>& primOrder) const;
+    // 成功时节点直接从映射的文件里读, *primOrder 也指向映射,
+    // 和这棵树的寿命相同. 第一次修改节点时才拷贝出来
+    bool LoadCache(uint64_t key,
+                   BVHLayout layout,
+                   uint32_t leafBlockSize,
+                   const uint32_t** primOrder,
+                   uint32_t* nPrimOrder);
+
+    // 逐个图元测试: intersect(i, ray) 测叶子里第 i 个位置的图元
+    template <typename PrimIntersect>
+    bool Intersect(const TraversalRay& ray, PrimIntersect intersect) const {
+        return IntersectLeaves(
+            ray, [&](uint32_t offset, uint32_t n, const TraversalRay& r) {
+                bool hit = false;
+                for (uint32_t i = 0; i < n; ++i)
+                    if (intersect(offset + i, r))
+                        hit = true;
+                return hit;
+            });
+    }
+    template <typename PrimIntersectP>
+    bool IntersectP(const TraversalRay& ray,
+                    PrimIntersectP intersectP) const {
+        return IntersectPLeaves(
+            ray, [&](uint32_t offset, uint32_t n, const TraversalRay& r) {
+                for (uint32_t i = 0; i < n; ++i)
+                    if (intersectP(offset + i, r))
+                        return true;
+                return false;
+            });
+    }
+
+    // 整个叶子一起测试: intersectLeaf(offset, n, ray), 给把叶子里的
+    // 图元打包成 SIMD 块的使用者用
+    template <typename LeafIntersect>
+    bool IntersectLeaves(const TraversalRay& ray,
+                         LeafIntersect intersectLeaf) const {
+        switch (layout) {
+            case BVH_4:
+                return IntersectWideBVH(nodeArray(nodes4), ray, intersectLeaf);
+            case BVH_8:
+                return IntersectWideBVH(nodeArray(nodes8), ray, intersectLeaf);
+            case BVH_4_QUANTIZED:
+                return IntersectWideBVH(nodeArray(nodes4q), ray,
+                                        intersectLeaf);
+            case BVH_8_QUANTIZED:
+                return IntersectWideBVH(nodeArray(nodes8q), ray,
+                                        intersectLeaf);
+            default:
+                return IntersectBVH(nodeArray(nodes), ray, intersectLeaf);
+        }
+    }
+    template <typename LeafIntersectP>
+    bool IntersectPLeaves(const TraversalRay& ray,
+                          LeafIntersectP intersectLeafP) const {
+        switch (layout) {
+            case BVH_4:
+                return IntersectPWideBVH(nodeArray(nodes4), ray,
+                                         intersectLeafP);
+            case BVH_8:
+                return IntersectPWideBVH(nodeArray(nodes8), ray,
+                                         intersectLeafP);
+            case BVH_4_QUANTIZED:
+                return IntersectPWideBVH(nodeArray(nodes4q), ray,
+                                         intersectLeafP);
+            case BVH_8_QUANTIZED:
+                return IntersectPWideBVH(nodeArray(nodes8q), ray,
+                                         intersectLeafP);
+            default:
+                return IntersectPBVH(nodeArray(nodes), ray, intersectLeafP);
+        }
+    }
+
+    // 对每个叶子调用 remap(offset, n), 用返回值替换叶子的起点.
+    // 使用者把叶子里的图元重新打包以后, 让叶子直接指向新的存储
+    template <typename LeafRemap>
+    void RemapLeaves(LeafRemap remap) {
+        detach();
+        for (uint32_t i = 0; i < nodes.size(); ++i)
+            if (nodes[i].nPrimitives > 0)
+                nodes[i].primitivesOffset = remap(
+                    nodes[i].primitivesOffset, nodes[i].nPrimitives);
+        remapWideLeaves(nodes4, remap);
+        remapWideLeaves(nodes8, remap);
+        remapWideLeaves(nodes4q, remap);
+        remapWideLeaves(nodes8q, remap);
+    }
+
+    // 图元移动以后保持拓扑, 自底向上重算包围盒, 顶层子树并行拟合.
+    // leafBounds(offset, n) 返回叶子的新包围盒. SAH 代价比构建时
+    // 涨过 rebuildThreshold 倍的子树保留叶子, 重建上面的层次, 所以
+    // 叶子的内容和使用者的图元顺序都不变. 子树根以上的几层和叶子
+    // 本身只拟合不重建, 返回值仍然超过阈值时应该整个重新构建.
+    // 返回整棵树的 SAH 代价和构建时之比
+    template <typename LeafBoundsFunc>
+    float Refit(LeafBoundsFunc leafBounds,
+                float rebuildThreshold = BVH_REBUILD_THRESHOLD) {
+        return refit(BVHLeafBoundsFunc<LeafBoundsFunc>(leafBounds),
+                     rebuildThreshold);
+    }
+
+   private:
+    friend class BVHRefitTask;
+    float refit(const BVHLeafBounds& leafBounds, float rebuildThreshold);
+    void initRefit();
+    // leafBounds 为 NULL 时不改节点, 只按现有的包围盒计算代价
+    void runRefitTasks(const BVHLeafBounds* leafBounds);
+    void refitRoot(BVHRefitRoot* root, const BVHLeafBounds* leafBounds);
+    float refitTop(const BVHLeafBounds* leafBounds);
+    bool rebuildRoot(BVHRefitRoot* root);
+    uint32_t nodeCount() const;
+    // 当前布局的节点数组: 映射着缓存文件时在映射里, 否则在 vector 里
+    template <typename Node>
+    const Node* nodeArray(const vector<Node>& v) const {
+        return mappedNodes ? (const Node*)mappedNodes : &v[0];
+    }
+    // 修改节点之前把映射的节点拷到 vector 里, 然后解除映射
+    void detach();
+
+    template <template <int> class Node, int N, typename LeafRemap>
+    static void remapWideLeaves(vector<Node<N>>& wideNodes, LeafRemap remap) {
+        for (uint32_t i = 0; i < wideNodes.size(); ++i)
+            for (int c = 0; c < N; ++c)
+                if (wideNodes[i].nPrimitives[c] > 0)
+                    wideNodes[i].child[c] = remap(
+                        wideNodes[i].child[c], wideNodes[i].nPrimitives[c]);
+    }
+
+    BVHLayout layout;
+    uint32_t blockSize;
+    BBox bounds;
+    // 只有当前布局的节点数组非空
+    vector<LinearBVHNode> nodes;
+    vector<BVH4Node> nodes4;
+    vector<BVH8Node> nodes8;
+    vector<BVH4QNode> nodes4q;
+    vector<BVH8QNode> nodes8q;
+    // 从缓存加载时代替上面的数组
+    Reference<MappedFile> mapping;
+    const void* mappedNodes;
+    uint32_t nMappedNodes;
+    // 第一次重新拟合时才划分, 按节点下标排序
+    vector<BVHRefitRoot> refitRoots;
+    float initialCost;
+};
+
+// 以 Shape 为图元的 BVH 聚合体. 它自己也是一个世界空间的 Shape,
+// 所以可以再被别的聚合体或实例引用
+class BVHAccel : public Shape {
+   public:
+    BVHAccel(const vector<Reference<Shape>>& p,
+             uint32_t maxPrims = 4,
+             BVHLayout layout = BVH_BINARY,
+             BVHSplitMethod splitMethod = BVH_SPLIT_SAH);
+    ~BVHAccel();
+
+    BBox objectBound() const;
+    BBox WorldBound() const;
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+    size_t MemoryUsage() const;
+    // 图元的世界包围盒变了以后 (比如实例换了变换) 重新拟合,
+    // 返回值同 BVHTree::Refit
+    float Refit(float rebuildThreshold = BVH_REBUILD_THRESHOLD);
+
+   private:
+    uint32_t maxPrimsInNode;
+    // 按叶子里的顺序重排过
+    vector<Reference<Shape>> primitives;
+    BVHTree tree;
+};
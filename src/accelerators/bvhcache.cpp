@@ -0,0 +1,134 @@
+#include "accelerators/bvhcache.h"
+#include <unistd.h>
+
+static const char bvhCacheMagic[8] = "PBRTBVH";
+// 节点段按页对齐, 图元下标段按缓存行对齐
+static const uint64_t bvhCachePageSize = 4096;
+
+static std::string cacheDirectory;
+
+BVHCacheKey::BVHCacheKey() {
+    for (int i = 0; i < 4; ++i)
+        hash[i] = 14695981039346656037ull + i;
+}
+
+void BVHCacheKey::Add(const void* data, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t w[4];
+    for (; bytes >= sizeof(w); p += sizeof(w), bytes -= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        for (int i = 0; i < 4; ++i)
+            hash[i] = (hash[i] ^ w[i]) * 1099511628211ull;
+    }
+    // 不满 16 字节的尾巴补零, 再把尾巴的长度也算进去
+    memset(w, 0, sizeof(w));
+    memcpy(w, p, bytes);
+    for (int i = 0; i < 4; ++i)
+        hash[i] = (hash[i] ^ w[i] ^ (uint64_t(bytes) << 32)) * 1099511628211ull;
+}
+
+uint64_t BVHCacheKey::Value() const {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 4; ++i)
+        h = (h ^ hash[i]) * 1099511628211ull;
+    // FNV 的乘法只把低位往高位扩散, 最后再混一次, 让每一位都依赖所有输入
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+void SetBVHCacheDirectory(const std::string& dir) {
+    cacheDirectory = dir;
+}
+
+bool BVHCacheEnabled() {
+    return !cacheDirectory.empty();
+}
+
+std::string BVHCacheFilename(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)key);
+    return cacheDirectory + name;
+}
+
+static uint64_t roundUp(uint64_t n, uint64_t align) {
+    return (n + align - 1) / align * align;
+}
+
+bool WriteBVHCache(const std::string& filename,
+                   BVHCacheHeader header,
+                   const void* nodes,
+                   const uint32_t* primOrder) {
+    memcpy(header.magic, bvhCacheMagic, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.byteOrder = BVH_CACHE_BYTE_ORDER;
+    header.pad = 0;
+    uint64_t nodeBytes = uint64_t(header.nodeSize) * header.nNodes;
+    header.nodesOffset = bvhCachePageSize;
+    header.primOrderOffset =
+        roundUp(header.nodesOffset + nodeBytes, PBRT_L1_CACHE_LINE_SIZE);
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    std::string tmpName = filename + suffix;
+    FILE* fp = fopen(tmpName.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "BVH cache: unable to create \"%s\"\n",
+                tmpName.c_str());
+        return false;
+    }
+    // 段之间的空隙写零
+    vector<char> zeros(bvhCachePageSize, 0);
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(&zeros[0], header.nodesOffset - sizeof(header), 1, fp) ==
+                  1 &&
+              (nodeBytes == 0 || fwrite(nodes, nodeBytes, 1, fp) == 1);
+    uint64_t gap = header.primOrderOffset - header.nodesOffset - nodeBytes;
+    if (ok && gap)
+        ok = fwrite(&zeros[0], gap, 1, fp) == 1;
+    if (ok && header.nPrimOrder)
+        ok = fwrite(primOrder, header.nPrimOrder * sizeof(uint32_t), 1, fp) ==
+             1;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpName.c_str(), filename.c_str()) != 0) {
+        fprintf(stderr, "BVH cache: unable to write \"%s\"\n",
+                filename.c_str());
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+MappedFile* MapBVHCache(const std::string& filename,
+                        uint64_t key,
+                        const BVHCacheHeader** header) {
+    MappedFile* file = MappedFile::Open(filename);
+    if (!file)
+        return NULL;
+    const BVHCacheHeader* h = (const BVHCacheHeader*)file->Data();
+    uint64_t size = file->Size();
+    bool ok = size >= sizeof(BVHCacheHeader) &&
+              memcmp(h->magic, bvhCacheMagic, sizeof(h->magic)) == 0;
+    if (ok && (h->version != BVH_CACHE_VERSION ||
+               h->byteOrder != BVH_CACHE_BYTE_ORDER)) {
+        fprintf(stderr,
+                "BVH cache: \"%s\" was written by another version or byte "
+                "order, rebuilding\n",
+                filename.c_str());
+        ok = false;
+    }
+    ok = ok && h->key == key && h->nodesOffset % bvhCachePageSize == 0 &&
+         h->primOrderOffset % sizeof(uint32_t) == 0 &&
+         h->nodesOffset + uint64_t(h->nodeSize) * h->nNodes <= size &&
+         h->primOrderOffset + uint64_t(h->nPrimOrder) * sizeof(uint32_t) <=
+             size;
+    if (!ok) {
+        delete file;
+        return NULL;
+    }
+    *header = h;
+    return file;
+}
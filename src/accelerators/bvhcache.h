@@ -0,0 +1,59 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/mmap.h"
+
+// 建好的 BVH 的磁盘缓存. 文件名由使用者算出的内容哈希决定, 几何没变
+// 的下一次运行直接映射文件, 不再构建. 文件里是一个文件头, 一段节点
+// 数组和一段叶子顺序的图元下标, 节点数组按页对齐, 映射后原地使用.
+// 文件头的版本, 字节序, 哈希或节点大小对不上时当作没有缓存
+
+// 节点布局或者文件格式变了就加一
+static const uint32_t BVH_CACHE_VERSION = 1;
+static const uint32_t BVH_CACHE_BYTE_ORDER = 0x01020304;
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    // 写入的机器上的 BVH_CACHE_BYTE_ORDER, 字节序不同时读出来不相等
+    uint32_t byteOrder;
+    uint64_t key;
+    uint32_t layout, blockSize;
+    uint32_t nodeSize, nNodes;
+    uint64_t nodesOffset;
+    uint32_t nPrimOrder, pad;
+    uint64_t primOrderOffset;
+    float bounds[2][3];
+};
+
+// 内容哈希: 按 32 位字做 FNV-1a 的 64 位版本, 四路交错以免每个字
+// 都等上一次乘法. 同样的 Add 序列总是得到同样的值
+class BVHCacheKey {
+   public:
+    BVHCacheKey();
+    void Add(const void* data, size_t bytes);
+    template <typename T>
+    void Add(const T& v) {
+        Add(&v, sizeof(T));
+    }
+    uint64_t Value() const;
+
+   private:
+    uint64_t hash[4];
+};
+
+// 缓存文件放在这个目录里. 空字符串 (默认) 表示不用缓存
+void SetBVHCacheDirectory(const std::string& dir);
+bool BVHCacheEnabled();
+std::string BVHCacheFilename(uint64_t key);
+
+// 先写到临时文件再改名, 同时读这个文件的进程看不到写了一半的内容.
+// header 里的 magic, version, byteOrder 和两个偏移由这里填
+bool WriteBVHCache(const std::string& filename,
+                   BVHCacheHeader header,
+                   const void* nodes,
+                   const uint32_t* primOrder);
+// 映射文件并检查文件头和各段的范围, 不能用时返回 NULL
+MappedFile* MapBVHCache(const std::string& filename,
+                        uint64_t key,
+                        const BVHCacheHeader** header);
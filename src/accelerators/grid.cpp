@@ -0,0 +1,217 @@
+#include "accelerators/grid.h"
+#include "accelerators/lazyaccel.h"
+#include "core/probes.h"
+
+// Voxel Method Definitions
+bool Voxel::Intersect(const Ray& ray,
+                      float* tHit,
+                      float* rayEpsilon,
+                      DifferentialGeometry* dg) const {
+    bool hitSomething = false;
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        const Shape* prim = primitives[i].GetPtr();
+        PBRT_GRID_RAY_PRIMITIVE_INTERSECTION_TEST(const_cast<Shape*>(prim));
+        if (prim->Intersect(ray, tHit, rayEpsilon, dg)) {
+            PBRT_GRID_RAY_PRIMITIVE_HIT(const_cast<Shape*>(prim));
+            ray.maxt = *tHit;
+            hitSomething = true;
+        }
+    }
+    return hitSomething;
+}
+
+bool Voxel::IntersectP(const Ray& ray) const {
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        const Shape* prim = primitives[i].GetPtr();
+        PBRT_GRID_RAY_PRIMITIVE_INTERSECTIONP_TEST(const_cast<Shape*>(prim));
+        if (prim->IntersectP(ray)) {
+            PBRT_GRID_RAY_PRIMITIVE_HIT(const_cast<Shape*>(prim));
+            return true;
+        }
+    }
+    return false;
+}
+
+// GridAccel Method Definitions
+GridAccel::GridAccel(const vector<Reference<Shape>>& p,
+                     bool refineImmediately) {
+    PBRT_GRID_STARTED_CONSTRUCTION(this, p.size());
+    if (refineImmediately)
+        for (uint32_t i = 0; i < p.size(); ++i)
+            p[i]->FullyRefine(primitives);
+    else
+        // 不在体素里细分: 图元包成 LazyAccel, 覆盖多个体素时也只细分
+        // 一次, 读写锁和升级在 LazyAccel::acquire 里
+        for (uint32_t i = 0; i < p.size(); ++i)
+            primitives.push_back(LazyAccel::Wrap(p[i]));
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        bounds = Union(bounds, primitives[i]->WorldBound());
+    Vector delta = bounds.pMax - bounds.pMin;
+
+    // 每个轴的体素数和该轴的长度成正比, 总数约为图元数的 27 倍开方
+    int maxAxis = bounds.MaximumExtent();
+    float invMaxWidth = delta[maxAxis] > 0.f ? 1.f / delta[maxAxis] : 0.f;
+    float cubeRoot = 3.f * powf(float(primitives.size()), 1.f / 3.f);
+    float voxelsPerUnitDist = cubeRoot * invMaxWidth;
+    for (int axis = 0; axis < 3; ++axis) {
+        nVoxels[axis] = (int)roundf(delta[axis] * voxelsPerUnitDist);
+        nVoxels[axis] = min(max(nVoxels[axis], 1), 64);
+    }
+    PBRT_GRID_BOUNDS_AND_RESOLUTION(&bounds, nVoxels);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        width[axis] = delta[axis] / nVoxels[axis];
+        invWidth[axis] = (width[axis] == 0.f) ? 0.f : 1.f / width[axis];
+    }
+    int nv = nVoxels[0] * nVoxels[1] * nVoxels[2];
+    voxels = new Voxel*[nv];
+    memset(voxels, 0, nv * sizeof(Voxel*));
+    size_t bytes = nv * sizeof(Voxel*);
+
+    // 图元加到它包围盒覆盖的所有体素里
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        BBox pb = primitives[i]->WorldBound();
+        int vmin[3], vmax[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            vmin[axis] = posToVoxel(pb.pMin, axis);
+            vmax[axis] = posToVoxel(pb.pMax, axis);
+        }
+        PBRT_GRID_VOXELIZED_PRIMITIVE(vmin, vmax);
+        for (int z = vmin[2]; z <= vmax[2]; ++z)
+            for (int y = vmin[1]; y <= vmax[1]; ++y)
+                for (int x = vmin[0]; x <= vmax[0]; ++x) {
+                    int o = offset(x, y, z);
+                    if (!voxels[o]) {
+                        voxels[o] = new Voxel(primitives[i]);
+                        bytes += sizeof(Voxel);
+                    } else
+                        voxels[o]->AddPrimitive(primitives[i]);
+                    bytes += sizeof(Reference<Shape>);
+                }
+    }
+    voxelBytes = bytes;
+    PBRT_GRID_MEMORY_ALLOCATED(bytes);
+    PBRT_GRID_FINISHED_CONSTRUCTION(this);
+}
+
+GridAccel::~GridAccel() {
+    int nv = nVoxels[0] * nVoxels[1] * nVoxels[2];
+    for (int i = 0; i < nv; ++i)
+        delete voxels[i];
+    delete[] voxels;
+}
+
+BBox GridAccel::objectBound() const {
+    return bounds;
+}
+
+BBox GridAccel::WorldBound() const {
+    return bounds;
+}
+
+size_t GridAccel::MemoryUsage() const {
+    size_t bytes = sizeof(*this) + voxelBytes;
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        bytes += primitives[i]->MemoryUsage();
+    return bytes;
+}
+
+bool GridAccel::setupDDA(const Ray& ray,
+                         float nextCrossingT[3],
+                         float deltaT[3],
+                         int step[3],
+                         int out[3],
+                         int pos[3]) const {
+    float rayT;
+    if (bounds.Inside(ray(ray.mint)))
+        rayT = ray.mint;
+    else if (!bounds.IntersectP(TraversalRay(ray), &rayT))
+        return false;
+    Point gridIntersect = ray(rayT);
+    for (int axis = 0; axis < 3; ++axis) {
+        pos[axis] = posToVoxel(gridIntersect, axis);
+        if (ray.d[axis] >= 0) {
+            nextCrossingT[axis] =
+                rayT + (voxelToPos(pos[axis] + 1, axis) - gridIntersect[axis]) /
+                           ray.d[axis];
+            deltaT[axis] = width[axis] / ray.d[axis];
+            step[axis] = 1;
+            out[axis] = nVoxels[axis];
+        } else {
+            nextCrossingT[axis] =
+                rayT + (voxelToPos(pos[axis], axis) - gridIntersect[axis]) /
+                           ray.d[axis];
+            deltaT[axis] = -width[axis] / ray.d[axis];
+            step[axis] = -1;
+            out[axis] = -1;
+        }
+    }
+    return true;
+}
+
+// 由三个下一次穿越距离两两比较的结果查出最先穿越的轴
+static const int cmpToAxis[8] = {2, 1, 2, 1, 2, 2, 0, 0};
+
+bool GridAccel::Intersect(const Ray& ray,
+                          float* tHit,
+                          float* rayEpsilon,
+                          DifferentialGeometry* dg) const {
+    PBRT_GRID_INTERSECTION_TEST(const_cast<GridAccel*>(this),
+                                const_cast<Ray*>(&ray));
+    float nextCrossingT[3], deltaT[3];
+    int step[3], out[3], pos[3];
+    if (!setupDDA(ray, nextCrossingT, deltaT, step, out, pos)) {
+        PBRT_GRID_RAY_MISSED_BOUNDS();
+        return false;
+    }
+
+    bool hitSomething = false;
+    for (;;) {
+        Voxel* voxel = voxels[offset(pos[0], pos[1], pos[2])];
+        PBRT_GRID_RAY_TRAVERSED_VOXEL(pos, voxel ? voxel->size() : 0);
+        if (voxel != NULL)
+            hitSomething |= voxel->Intersect(ray, tHit, rayEpsilon, dg);
+
+        int bits = ((nextCrossingT[0] < nextCrossingT[1]) << 2) +
+                   ((nextCrossingT[0] < nextCrossingT[2]) << 1) +
+                   ((nextCrossingT[1] < nextCrossingT[2]));
+        int stepAxis = cmpToAxis[bits];
+        if (ray.maxt < nextCrossingT[stepAxis])
+            break;
+        pos[stepAxis] += step[stepAxis];
+        if (pos[stepAxis] == out[stepAxis])
+            break;
+        nextCrossingT[stepAxis] += deltaT[stepAxis];
+    }
+    return hitSomething;
+}
+
+bool GridAccel::IntersectP(const Ray& ray) const {
+    PBRT_GRID_INTERSECTIONP_TEST(const_cast<GridAccel*>(this),
+                                 const_cast<Ray*>(&ray));
+    float nextCrossingT[3], deltaT[3];
+    int step[3], out[3], pos[3];
+    if (!setupDDA(ray, nextCrossingT, deltaT, step, out, pos)) {
+        PBRT_GRID_RAY_MISSED_BOUNDS();
+        return false;
+    }
+
+    for (;;) {
+        Voxel* voxel = voxels[offset(pos[0], pos[1], pos[2])];
+        PBRT_GRID_RAY_TRAVERSED_VOXEL(pos, voxel ? voxel->size() : 0);
+        if (voxel && voxel->IntersectP(ray))
+            return true;
+
+        int bits = ((nextCrossingT[0] < nextCrossingT[1]) << 2) +
+                   ((nextCrossingT[0] < nextCrossingT[2]) << 1) +
+                   ((nextCrossingT[1] < nextCrossingT[2]));
+        int stepAxis = cmpToAxis[bits];
+        if (ray.maxt < nextCrossingT[stepAxis])
+            break;
+        pos[stepAxis] += step[stepAxis];
+        if (pos[stepAxis] == out[stepAxis])
+            break;
+        nextCrossingT[stepAxis] += deltaT[stepAxis];
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/shape.h"
+
+// 体素里的图元. 不能直接求交的图元已经在 GridAccel 里包成了
+// LazyAccel, 所有覆盖到它的体素共用同一份细分结果
+struct Voxel {
+    uint32_t size() const { return (uint32_t)primitives.size(); }
+    Voxel() {}
+    Voxel(const Reference<Shape>& op) { primitives.push_back(op); }
+    void AddPrimitive(const Reference<Shape>& prim) {
+        primitives.push_back(prim);
+    }
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+
+   private:
+    vector<Reference<Shape>> primitives;
+};
+
+// 均匀网格聚合体, 用 3D-DDA 逐个体素遍历.
+// 适合大量尺寸相近的图元
+class GridAccel : public Shape {
+   public:
+    // refineImmediately 为 false 时, 图元留到光线第一次碰到它时再细分
+    GridAccel(const vector<Reference<Shape>>& p, bool refineImmediately);
+    ~GridAccel();
+
+    BBox objectBound() const;
+    BBox WorldBound() const;
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+    size_t MemoryUsage() const;
+
+   private:
+    int posToVoxel(const Point& P, int axis) const {
+        int v = (int)((P[axis] - bounds.pMin[axis]) * invWidth[axis]);
+        return min(max(v, 0), nVoxels[axis] - 1);
+    }
+    float voxelToPos(int p, int axis) const {
+        return bounds.pMin[axis] + p * width[axis];
+    }
+    inline int offset(int x, int y, int z) const {
+        return z * nVoxels[0] * nVoxels[1] + y * nVoxels[0] + x;
+    }
+    // 初始化 3D-DDA, 光线没碰到网格时返回 false
+    bool setupDDA(const Ray& ray,
+                  float nextCrossingT[3],
+                  float deltaT[3],
+                  int step[3],
+                  int out[3],
+                  int pos[3]) const;
+
+    vector<Reference<Shape>> primitives;
+    int nVoxels[3];
+    BBox bounds;
+    Vector width, invWidth;
+    Voxel** voxels;
+    size_t voxelBytes;
+};
@@ -0,0 +1,527 @@
+#include "accelerators/kdtreeaccel.h"
+#include "accelerators/lazyaccel.h"
+#include "core/parallel.h"
+#include "core/probes.h"
+
+#include <algorithm>
+#include <map>
+
+// KdTreeAccel Local Declarations
+struct BoundEdge {
+    BoundEdge() {}
+    BoundEdge(float tt, uint32_t pn, bool starting) {
+        t = tt;
+        primNum = pn;
+        type = starting ? START : END;
+    }
+    bool operator<(const BoundEdge& e) const {
+        if (t == e.t)
+            return (int)type < (int)e.type;
+        else
+            return t < e.t;
+    }
+    float t;
+    uint32_t primNum;
+    enum { START, END } type;
+};
+
+// 一棵子树构建的结果, 下标都相对于它自己
+struct KdBuildOutput {
+    vector<KdAccelNode> nodes;
+    vector<uint32_t> primitiveIndices;
+};
+
+// 图元数少于它时整棵树串行构建
+static const uint32_t minParallelPrims = 64 * 1024;
+
+// 每个线程一份的划分标记, 按图元编号索引. 横跨划分面的图元会同时
+// 出现在两棵子树里, 所以不能全局共用一份
+static thread_local vector<uint8_t> primSide;
+
+class KdSubtreeTask;
+
+class KdTreeBuilder {
+   public:
+    KdTreeBuilder(KdTreeAccel* a, const vector<BBox>& primBounds);
+    ~KdTreeBuilder();
+    void Build();
+    void buildTree(KdBuildOutput* out,
+                   const BBox& nodeBounds,
+                   vector<BoundEdge> edges[3],
+                   uint32_t nPrims,
+                   int depth,
+                   int badRefines,
+                   bool defer);
+
+   private:
+    uint32_t append(const KdBuildOutput& src,
+                    uint32_t nodeNum,
+                    bool isTop,
+                    KdBuildOutput* dst);
+
+    KdTreeAccel* accel;
+    const vector<BBox>& primBounds;
+    uint32_t subtreeSize;
+    KdBuildOutput top;
+    // 顶层里的占位叶子 -> 构建它的任务
+    std::map<uint32_t, KdSubtreeTask*> placeholders;
+    vector<Task*> subtreeTasks;
+};
+
+class KdSubtreeTask : public Task {
+   public:
+    KdSubtreeTask(KdTreeBuilder* b,
+                  const BBox& nb,
+                  vector<BoundEdge> e[3],
+                  uint32_t np,
+                  int d,
+                  int br)
+        : builder(b), nodeBounds(nb), nPrims(np), depth(d), badRefines(br) {
+        for (int i = 0; i < 3; ++i)
+            edges[i].swap(e[i]);
+    }
+    void Run() {
+        builder->buildTree(&out, nodeBounds, edges, nPrims, depth, badRefines,
+                           false);
+    }
+
+    KdBuildOutput out;
+
+   private:
+    KdTreeBuilder* builder;
+    BBox nodeBounds;
+    vector<BoundEdge> edges[3];
+    uint32_t nPrims;
+    int depth, badRefines;
+};
+
+// KdTreeAccel Method Definitions
+void KdAccelNode::initLeaf(const uint32_t* primNums,
+                           uint32_t np,
+                           vector<uint32_t>* primitiveIndices) {
+    flags = 3;
+    nPrims |= (np << 2);
+    if (np == 0)
+        onePrimitive = 0;
+    else if (np == 1)
+        onePrimitive = primNums[0];
+    else {
+        primitiveIndicesOffset = (uint32_t)primitiveIndices->size();
+        primitiveIndices->insert(primitiveIndices->end(), primNums,
+                                 primNums + np);
+    }
+}
+
+KdTreeBuilder::KdTreeBuilder(KdTreeAccel* a, const vector<BBox>& pb)
+    : accel(a), primBounds(pb) {
+    uint32_t n = (uint32_t)primBounds.size();
+    subtreeSize = max(n / (8 * NumSystemCores()), 4096u);
+}
+
+KdTreeBuilder::~KdTreeBuilder() {
+    for (uint32_t i = 0; i < subtreeTasks.size(); ++i)
+        delete subtreeTasks[i];
+}
+
+void KdTreeBuilder::Build() {
+    uint32_t nPrims = (uint32_t)primBounds.size();
+    // 三个轴的边界各排一次序, 之后不再排序
+    vector<BoundEdge> edges[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        edges[axis].reserve(2 * nPrims);
+        for (uint32_t i = 0; i < nPrims; ++i) {
+            edges[axis].push_back(
+                BoundEdge(primBounds[i].pMin[axis], i, true));
+            edges[axis].push_back(
+                BoundEdge(primBounds[i].pMax[axis], i, false));
+        }
+        std::sort(edges[axis].begin(), edges[axis].end());
+    }
+
+    if (nPrims < minParallelPrims) {
+        KdBuildOutput out;
+        buildTree(&out, accel->bounds, edges, nPrims, accel->maxDepth, 0,
+                  false);
+        accel->nodes.swap(out.nodes);
+        accel->primitiveIndices.swap(out.primitiveIndices);
+        return;
+    }
+    buildTree(&top, accel->bounds, edges, nPrims, accel->maxDepth, 0, true);
+    EnqueueTasks(subtreeTasks);
+    WaitForAllTasks();
+
+    // 把各个子树按深度优先接到顶层的占位叶子上
+    KdBuildOutput out;
+    append(top, 0, true, &out);
+    accel->nodes.swap(out.nodes);
+    accel->primitiveIndices.swap(out.primitiveIndices);
+}
+
+void KdTreeBuilder::buildTree(KdBuildOutput* out,
+                              const BBox& nodeBounds,
+                              vector<BoundEdge> edges[3],
+                              uint32_t nPrims,
+                              int depth,
+                              int badRefines,
+                              bool defer) {
+    uint32_t nodeNum = (uint32_t)out->nodes.size();
+    out->nodes.push_back(KdAccelNode());
+    if (defer && nPrims <= subtreeSize) {
+        KdSubtreeTask* task = new KdSubtreeTask(this, nodeBounds, edges,
+                                                nPrims, depth, badRefines);
+        placeholders[nodeNum] = task;
+        subtreeTasks.push_back(task);
+        return;
+    }
+
+    // 图元够少或者到了最大深度就建叶子
+    if (nPrims <= (uint32_t)accel->maxPrims || depth == 0) {
+        vector<uint32_t> prims;
+        prims.reserve(nPrims);
+        for (uint32_t i = 0; i < 2 * nPrims; ++i)
+            if (edges[0][i].type == BoundEdge::START)
+                prims.push_back(edges[0][i].primNum);
+        out->nodes[nodeNum].initLeaf(prims.size() ? &prims[0] : NULL, nPrims,
+                                     &out->primitiveIndices);
+        PBRT_KDTREE_CREATED_LEAF(nPrims, accel->maxDepth - depth);
+        return;
+    }
+
+    // 边界已经有序, 每个轴从左往右扫一遍就能算出所有候选面的 SAH 代价
+    int bestAxis = -1, bestOffset = -1;
+    float bestCost = INFINITY;
+    float oldCost = accel->isectCost * float(nPrims);
+    float invTotalSA = 1.f / nodeBounds.SurfaceArea();
+    Vector d = nodeBounds.pMax - nodeBounds.pMin;
+    for (int axis = 0; axis < 3; ++axis) {
+        int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+        uint32_t nBelow = 0, nAbove = nPrims;
+        const vector<BoundEdge>& e = edges[axis];
+        for (uint32_t i = 0; i < 2 * nPrims; ++i) {
+            if (e[i].type == BoundEdge::END)
+                --nAbove;
+            float edget = e[i].t;
+            if (edget > nodeBounds.pMin[axis] &&
+                edget < nodeBounds.pMax[axis]) {
+                float belowSA =
+                    2 * (d[otherAxis0] * d[otherAxis1] +
+                         (edget - nodeBounds.pMin[axis]) *
+                             (d[otherAxis0] + d[otherAxis1]));
+                float aboveSA =
+                    2 * (d[otherAxis0] * d[otherAxis1] +
+                         (nodeBounds.pMax[axis] - edget) *
+                             (d[otherAxis0] + d[otherAxis1]));
+                float pBelow = belowSA * invTotalSA;
+                float pAbove = aboveSA * invTotalSA;
+                float eb =
+                    (nAbove == 0 || nBelow == 0) ? accel->emptyBonus : 0.f;
+                float cost =
+                    accel->traversalCost +
+                    accel->isectCost * (1.f - eb) *
+                        (pBelow * nBelow + pAbove * nAbove);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
+            }
+            if (e[i].type == BoundEdge::START)
+                ++nBelow;
+        }
+    }
+
+    if (bestCost > oldCost)
+        ++badRefines;
+    if ((bestCost > 4.f * oldCost && nPrims < 16) || bestAxis == -1 ||
+        badRefines == 3) {
+        vector<uint32_t> prims;
+        prims.reserve(nPrims);
+        for (uint32_t i = 0; i < 2 * nPrims; ++i)
+            if (edges[0][i].type == BoundEdge::START)
+                prims.push_back(edges[0][i].primNum);
+        out->nodes[nodeNum].initLeaf(&prims[0], nPrims,
+                                     &out->primitiveIndices);
+        PBRT_KDTREE_CREATED_LEAF(nPrims, accel->maxDepth - depth);
+        return;
+    }
+
+    // 标出每个图元在划分面的哪一边: 1 下方, 2 上方, 3 横跨
+    vector<uint8_t>& side = primSide;
+    if (side.size() < primBounds.size())
+        side.resize(primBounds.size());
+    const vector<BoundEdge>& be = edges[bestAxis];
+    for (uint32_t i = 0; i < 2 * nPrims; ++i)
+        if (be[i].type == BoundEdge::START)
+            side[be[i].primNum] = 0;
+    for (int i = 0; i < bestOffset; ++i)
+        if (be[i].type == BoundEdge::START)
+            side[be[i].primNum] |= 1;
+    for (uint32_t i = bestOffset + 1; i < 2 * nPrims; ++i)
+        if (be[i].type == BoundEdge::END)
+            side[be[i].primNum] |= 2;
+    float tSplit = be[bestOffset].t;
+
+    // 按原来的顺序把边界分给两个孩子, 孩子里仍然有序
+    vector<BoundEdge> below[3], above[3];
+    uint32_t nBelow = 0, nAbove = 0;
+    for (uint32_t i = 0; i < 2 * nPrims; ++i)
+        if (be[i].type == BoundEdge::START) {
+            nBelow += side[be[i].primNum] & 1;
+            nAbove += side[be[i].primNum] >> 1;
+        }
+    for (int axis = 0; axis < 3; ++axis) {
+        below[axis].reserve(2 * nBelow);
+        above[axis].reserve(2 * nAbove);
+        for (uint32_t i = 0; i < 2 * nPrims; ++i) {
+            const BoundEdge& e = edges[axis][i];
+            if (side[e.primNum] & 1)
+                below[axis].push_back(e);
+            if (side[e.primNum] & 2)
+                above[axis].push_back(e);
+        }
+        vector<BoundEdge>().swap(edges[axis]);
+    }
+
+    PBRT_KDTREE_CREATED_INTERIOR_NODE(bestAxis, tSplit);
+    BBox bounds0 = nodeBounds, bounds1 = nodeBounds;
+    bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
+    buildTree(out, bounds0, below, nBelow, depth - 1, badRefines, defer);
+    uint32_t aboveChild = (uint32_t)out->nodes.size();
+    out->nodes[nodeNum].initInterior(bestAxis, aboveChild, tSplit);
+    buildTree(out, bounds1, above, nAbove, depth - 1, badRefines, defer);
+}
+
+uint32_t KdTreeBuilder::append(const KdBuildOutput& src,
+                               uint32_t nodeNum,
+                               bool isTop,
+                               KdBuildOutput* dst) {
+    if (isTop) {
+        std::map<uint32_t, KdSubtreeTask*>::const_iterator it =
+            placeholders.find(nodeNum);
+        if (it != placeholders.end())
+            return append(it->second->out, 0, false, dst);
+    }
+    const KdAccelNode& node = src.nodes[nodeNum];
+    uint32_t offset = (uint32_t)dst->nodes.size();
+    dst->nodes.push_back(KdAccelNode());
+    if (node.IsLeaf()) {
+        uint32_t np = node.nPrimitives();
+        const uint32_t* prims =
+            np > 1 ? &src.primitiveIndices[node.primitiveIndicesOffset]
+                   : &node.onePrimitive;
+        dst->nodes[offset].initLeaf(prims, np, &dst->primitiveIndices);
+    } else {
+        append(src, nodeNum + 1, isTop, dst);
+        uint32_t aboveChild = append(src, node.AboveChild(), isTop, dst);
+        dst->nodes[offset].initInterior(node.SplitAxis(), aboveChild,
+                                        node.SplitPos());
+    }
+    return offset;
+}
+
+KdTreeAccel::KdTreeAccel(const vector<Reference<Shape>>& p,
+                         int icost,
+                         int tcost,
+                         float ebonus,
+                         int maxp,
+                         int md)
+    : isectCost(icost),
+      traversalCost(tcost),
+      maxPrims(maxp),
+      maxDepth(md),
+      emptyBonus(ebonus) {
+    PBRT_KDTREE_STARTED_CONSTRUCTION(this, p.size());
+    // 不能直接求交的图元等光线碰到时再细分
+    primitives.reserve(p.size());
+    for (uint32_t i = 0; i < p.size(); ++i)
+        primitives.push_back(LazyAccel::Wrap(p[i]));
+    if (maxDepth <= 0)
+        maxDepth = (int)roundf(8 + 1.3f * log2f(float(max<size_t>(
+                                              primitives.size(), 1))));
+
+    vector<BBox> primBounds;
+    primBounds.reserve(primitives.size());
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        BBox b = primitives[i]->WorldBound();
+        bounds = Union(bounds, b);
+        primBounds.push_back(b);
+    }
+    if (primitives.size()) {
+        KdTreeBuilder builder(this, primBounds);
+        builder.Build();
+    }
+    PBRT_KDTREE_FINISHED_CONSTRUCTION(this);
+}
+
+KdTreeAccel::~KdTreeAccel() {}
+
+BBox KdTreeAccel::objectBound() const {
+    return bounds;
+}
+
+BBox KdTreeAccel::WorldBound() const {
+    return bounds;
+}
+
+size_t KdTreeAccel::MemoryUsage() const {
+    size_t bytes = sizeof(*this) + nodes.size() * sizeof(KdAccelNode) +
+                   primitiveIndices.size() * sizeof(uint32_t);
+    for (uint32_t i = 0; i < primitives.size(); ++i)
+        bytes += primitives[i]->MemoryUsage();
+    return bytes;
+}
+
+struct KdToDo {
+    const KdAccelNode* node;
+    float tmin, tmax;
+};
+
+// 遍历栈的最大深度
+static const int MAX_TODO = 64;
+
+bool KdTreeAccel::Intersect(const Ray& ray,
+                            float* tHit,
+                            float* rayEpsilon,
+                            DifferentialGeometry* dg) const {
+    float tmin, tmax;
+    TraversalRay tray(ray);
+    if (nodes.empty() || !bounds.IntersectP(tray, &tmin, &tmax)) {
+        PBRT_KDTREE_RAY_MISSED_BOUNDS();
+        return false;
+    }
+    PBRT_KDTREE_INTERSECTION_TEST(const_cast<KdTreeAccel*>(this),
+                                  const_cast<Ray*>(&ray));
+
+    KdToDo todo[MAX_TODO];
+    int todoPos = 0;
+    bool hit = false;
+    const KdAccelNode* node = &nodes[0];
+    while (node != NULL) {
+        // 已经找到比这个节点更近的交点
+        if (ray.maxt < tmin)
+            break;
+        if (!node->IsLeaf()) {
+            PBRT_KDTREE_INTERSECTION_TRAVERSED_INTERIOR_NODE(
+                const_cast<KdAccelNode*>(node));
+            // 用光线方向的符号选出先走的孩子, 不做比较分支
+            uint32_t axis = node->SplitAxis();
+            float split = node->SplitPos();
+            float tplane = (split - tray.o[axis]) * tray.invDir[axis];
+            int belowFirst = (tray.o[axis] < split) ||
+                             (tray.o[axis] == split && tray.dirIsNeg[axis]);
+            const KdAccelNode* children[2] = {node + 1,
+                                              &nodes[node->AboveChild()]};
+            const KdAccelNode* firstChild = children[1 - belowFirst];
+            const KdAccelNode* secondChild = children[belowFirst];
+
+            if (tplane > tmax || tplane <= 0)
+                node = firstChild;
+            else if (tplane < tmin)
+                node = secondChild;
+            else {
+                todo[todoPos].node = secondChild;
+                todo[todoPos].tmin = tplane;
+                todo[todoPos].tmax = tmax;
+                ++todoPos;
+                node = firstChild;
+                tmax = tplane;
+            }
+        } else {
+            uint32_t nPrimitives = node->nPrimitives();
+            PBRT_KDTREE_INTERSECTION_TRAVERSED_LEAF_NODE(
+                const_cast<KdAccelNode*>(node), nPrimitives);
+            const uint32_t* prims =
+                nPrimitives == 1
+                    ? &node->onePrimitive
+                    : &primitiveIndices[node->primitiveIndicesOffset];
+            for (uint32_t i = 0; i < nPrimitives; ++i) {
+                const Shape* prim = primitives[prims[i]].GetPtr();
+                PBRT_KDTREE_INTERSECTION_PRIMITIVE_TEST(
+                    const_cast<Shape*>(prim));
+                if (prim->Intersect(ray, tHit, rayEpsilon, dg)) {
+                    PBRT_KDTREE_INTERSECTION_HIT(const_cast<Shape*>(prim));
+                    ray.maxt = *tHit;
+                    hit = true;
+                }
+            }
+            if (todoPos > 0) {
+                --todoPos;
+                node = todo[todoPos].node;
+                tmin = todo[todoPos].tmin;
+                tmax = todo[todoPos].tmax;
+            } else
+                break;
+        }
+    }
+    PBRT_KDTREE_INTERSECTION_FINISHED();
+    return hit;
+}
+
+bool KdTreeAccel::IntersectP(const Ray& ray) const {
+    float tmin, tmax;
+    TraversalRay tray(ray);
+    if (nodes.empty() || !bounds.IntersectP(tray, &tmin, &tmax)) {
+        PBRT_KDTREE_RAY_MISSED_BOUNDS();
+        return false;
+    }
+    PBRT_KDTREE_INTERSECTIONP_TEST(const_cast<KdTreeAccel*>(this),
+                                   const_cast<Ray*>(&ray));
+
+    KdToDo todo[MAX_TODO];
+    int todoPos = 0;
+    const KdAccelNode* node = &nodes[0];
+    while (node != NULL) {
+        if (!node->IsLeaf()) {
+            PBRT_KDTREE_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(
+                const_cast<KdAccelNode*>(node));
+            uint32_t axis = node->SplitAxis();
+            float split = node->SplitPos();
+            float tplane = (split - tray.o[axis]) * tray.invDir[axis];
+            int belowFirst = (tray.o[axis] < split) ||
+                             (tray.o[axis] == split && tray.dirIsNeg[axis]);
+            const KdAccelNode* children[2] = {node + 1,
+                                              &nodes[node->AboveChild()]};
+            const KdAccelNode* firstChild = children[1 - belowFirst];
+            const KdAccelNode* secondChild = children[belowFirst];
+
+            if (tplane > tmax || tplane <= 0)
+                node = firstChild;
+            else if (tplane < tmin)
+                node = secondChild;
+            else {
+                todo[todoPos].node = secondChild;
+                todo[todoPos].tmin = tplane;
+                todo[todoPos].tmax = tmax;
+                ++todoPos;
+                node = firstChild;
+                tmax = tplane;
+            }
+        } else {
+            uint32_t nPrimitives = node->nPrimitives();
+            PBRT_KDTREE_INTERSECTIONP_TRAVERSED_LEAF_NODE(
+                const_cast<KdAccelNode*>(node), nPrimitives);
+            const uint32_t* prims =
+                nPrimitives == 1
+                    ? &node->onePrimitive
+                    : &primitiveIndices[node->primitiveIndicesOffset];
+            for (uint32_t i = 0; i < nPrimitives; ++i) {
+                const Shape* prim = primitives[prims[i]].GetPtr();
+                PBRT_KDTREE_INTERSECTIONP_PRIMITIVE_TEST(
+                    const_cast<Shape*>(prim));
+                if (prim->IntersectP(ray)) {
+                    PBRT_KDTREE_INTERSECTIONP_HIT(const_cast<Shape*>(prim));
+                    return true;
+                }
+            }
+            if (todoPos > 0) {
+                --todoPos;
+                node = todo[todoPos].node;
+                tmin = todo[todoPos].tmin;
+                tmax = todo[todoPos].tmax;
+            } else
+                break;
+        }
+    }
+    PBRT_KDTREE_INTERSECTIONP_MISSED();
+    return false;
+}
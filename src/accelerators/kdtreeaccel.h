@@ -0,0 +1,67 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/shape.h"
+
+// kd 树节点, 8 字节. 低 2 位是划分轴, 3 表示叶子; 高 30 位是
+// 叶子里的图元数或者上方孩子的位置. 下方孩子紧跟在节点后面
+struct KdAccelNode {
+    void initLeaf(const uint32_t* primNums,
+                  uint32_t np,
+                  vector<uint32_t>* primitiveIndices);
+    void initInterior(uint32_t axis, uint32_t ac, float s) {
+        split = s;
+        flags = axis;
+        aboveChild |= (ac << 2);
+    }
+    float SplitPos() const { return split; }
+    uint32_t nPrimitives() const { return nPrims >> 2; }
+    uint32_t SplitAxis() const { return flags & 3; }
+    bool IsLeaf() const { return (flags & 3) == 3; }
+    uint32_t AboveChild() const { return aboveChild >> 2; }
+
+    union {
+        float split;                      // 内部节点
+        uint32_t onePrimitive;            // 只有一个图元的叶子
+        uint32_t primitiveIndicesOffset;  // 多个图元的叶子
+    };
+    union {
+        uint32_t flags;
+        uint32_t nPrims;
+        uint32_t aboveChild;
+    };
+};
+
+// SAH kd 树聚合体. 每个轴的包围盒边界只在根节点排一次序,
+// 往下划分时按原顺序分给两个孩子, 构建是 O(N log N) 的;
+// 顶层拆出的子树作为 Task 并行构建
+class KdTreeAccel : public Shape {
+   public:
+    // maxDepth <= 0 时按图元数自动决定
+    KdTreeAccel(const vector<Reference<Shape>>& p,
+                int icost = 80,
+                int scost = 1,
+                float ebonus = 0.5f,
+                int maxp = 1,
+                int maxDepth = -1);
+    ~KdTreeAccel();
+
+    BBox objectBound() const;
+    BBox WorldBound() const;
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+    size_t MemoryUsage() const;
+
+   private:
+    friend class KdTreeBuilder;
+
+    int isectCost, traversalCost, maxPrims, maxDepth;
+    float emptyBonus;
+    vector<Reference<Shape>> primitives;
+    vector<uint32_t> primitiveIndices;
+    vector<KdAccelNode> nodes;
+    BBox bounds;
+};
@@ -0,0 +1,210 @@
+#include "accelerators/lazyaccel.h"
+#include "accelerators/grid.h"
+#include "core/probes.h"
+#include <algorithm>
+
+// LazyAccel::state 的取值, 大于 READY 的部分是钉住它的光线数
+enum { LAZY_BUSY = -1, LAZY_UNREFINED = 0, LAZY_READY = 1 };
+
+// 常驻细分结果的登记表, 只在细分和丢弃时加锁.
+// 时钟每细分一次走一格, 按它近似 LRU
+class RefineCache {
+   public:
+    static RefineCache& Get() {
+        static RefineCache cache;
+        return cache;
+    }
+    int32_t Now() const { return clock; }
+    void Add(const LazyAccel* lazy);
+    void Remove(const LazyAccel* lazy);
+    void SetBudget(size_t b);
+    size_t Bytes() const { return bytes; }
+
+   private:
+    RefineCache() : budget(0), bytes(0), mutex(Mutex::Create()) { clock = 0; }
+    ~RefineCache() { Mutex::Destroy(mutex); }
+    void evictLRU(vector<Reference<Shape>>* dropped);
+
+    size_t budget, bytes;
+    AtomicInt32 clock;
+    vector<const LazyAccel*> resident;
+    Mutex* mutex;
+};
+
+void RefineCache::Add(const LazyAccel* lazy) {
+    // 被丢掉的几何在锁外释放, 它里面可能还有 LazyAccel 要回来注销
+    vector<Reference<Shape>> dropped;
+    MutexLock lock(*mutex);
+    AtomicAdd(&clock, 1);
+    resident.push_back(lazy);
+    bytes += lazy->refinedBytes;
+    if (budget && bytes > budget)
+        evictLRU(&dropped);
+}
+
+void RefineCache::Remove(const LazyAccel* lazy) {
+    MutexLock lock(*mutex);
+    for (uint32_t i = 0; i < resident.size(); ++i)
+        if (resident[i] == lazy) {
+            bytes -= lazy->refinedBytes;
+            resident[i] = resident.back();
+            resident.pop_back();
+            return;
+        }
+}
+
+void RefineCache::SetBudget(size_t b) {
+    vector<Reference<Shape>> dropped;
+    MutexLock lock(*mutex);
+    budget = b;
+    if (budget && bytes > budget)
+        evictLRU(&dropped);
+}
+
+void RefineCache::evictLRU(vector<Reference<Shape>>* dropped) {
+    // lastUsed 会被渲染线程随时改写, 先拍个快照再排序
+    vector<std::pair<int32_t, const LazyAccel*>> order;
+    order.reserve(resident.size());
+    for (uint32_t i = 0; i < resident.size(); ++i)
+        order.push_back(std::make_pair(resident[i]->lastUsed, resident[i]));
+    std::sort(order.begin(), order.end());
+
+    // 从最久没用的开始丢, 正被光线钉住的跳过
+    resident.clear();
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        const LazyAccel* lazy = order[i].second;
+        size_t b = lazy->refinedBytes;
+        Reference<Shape> r;
+        if (bytes > budget && lazy->evict(&r)) {
+            PBRT_LAZY_EVICTED(const_cast<LazyAccel*>(lazy), b);
+            bytes -= b;
+            dropped->push_back(r);
+        } else
+            resident.push_back(lazy);
+    }
+}
+
+void SetLazyRefineBudget(size_t bytes) {
+    RefineCache::Get().SetBudget(bytes);
+}
+
+size_t LazyRefineMemoryUsage() {
+    return RefineCache::Get().Bytes();
+}
+
+// LazyAccel Method Definitions
+LazyAccel::LazyAccel(const Reference<Shape>& s)
+    : shape(s),
+      worldBound(s->WorldBound()),
+      mutex(RWMutex::Create()),
+      refinedBytes(0),
+      lastUsed(0) {
+    state = LAZY_UNREFINED;
+}
+
+LazyAccel::~LazyAccel() {
+    if (state != LAZY_UNREFINED)
+        RefineCache::Get().Remove(this);
+    RWMutex::Destroy(mutex);
+}
+
+Reference<Shape> LazyAccel::Wrap(const Reference<Shape>& shape) {
+    if (shape->CanIntersect())
+        return shape;
+    return new LazyAccel(shape);
+}
+
+BBox LazyAccel::objectBound() const {
+    return worldBound;
+}
+
+size_t LazyAccel::MemoryUsage() const {
+    return sizeof(*this) + refinedBytes;
+}
+
+void LazyAccel::refine() const {
+    vector<Reference<Shape>> p;
+    shape->FullyRefine(p);
+    // 细分出多个时用网格组织: 建网格不发任务, 在渲染线程里建不会
+    // 卡在 WaitForAllTasks 上
+    if (p.size() == 1)
+        refined = p[0];
+    else if (p.size() > 1)
+        refined = new GridAccel(p, false);
+    refinedBytes = refined ? refined->MemoryUsage() : 0;
+    PBRT_LAZY_REFINED(const_cast<LazyAccel*>(this), refinedBytes);
+    // 发布结果, 同时替调用者钉住它
+    AtomicCompareAndSwap(&state, LAZY_READY + 1, LAZY_BUSY);
+    RefineCache::Get().Add(this);
+}
+
+// 已经细分好的只用原子操作钉住, 不碰锁. 没细分的先拿读锁, 再用
+// UpgradeToWrite 升级成写锁去细分; 其他线程在读锁上睡着等它细分完,
+// 不会一直占着核. 丢弃不拿锁, 它的 BUSY 只有几条指令长, 忙等就行
+const Shape* LazyAccel::acquire() const {
+    while (true) {
+        int32_t s = state;
+        if (s >= LAZY_READY) {
+            if (AtomicCompareAndSwap(&state, s + 1, s) == s)
+                break;
+        } else if (s == LAZY_UNREFINED) {
+            RWMutexLock lock(*mutex, READ);
+            if (state != LAZY_UNREFINED)
+                continue;
+            lock.UpgradeToWrite();
+            // 升级时锁放开过, 别的线程可能已经细分完了. 只有把状态从
+            // UNREFINED 换成 BUSY 的线程去细分, 持有写锁直到发布结果
+            if (AtomicCompareAndSwap(&state, LAZY_BUSY, LAZY_UNREFINED) ==
+                LAZY_UNREFINED) {
+                refine();
+                break;
+            }
+        } else {
+            // 别的线程正在细分 (持有写锁) 或丢弃它
+            RWMutexLock lock(*mutex, READ);
+#if (defined(__i386__) || defined(__amd64__))
+            __asm__ __volatile__("pause\n");
+#endif
+        }
+    }
+    int32_t now = RefineCache::Get().Now();
+    if (lastUsed != now)
+        lastUsed = now;
+    return refined.GetPtr();
+}
+
+void LazyAccel::release() const {
+    AtomicAdd(&state, -1);
+}
+
+bool LazyAccel::evict(Reference<Shape>* dropped) const {
+    if (AtomicCompareAndSwap(&state, LAZY_BUSY, LAZY_READY) != LAZY_READY)
+        return false;
+    *dropped = refined;
+    refined = NULL;
+    refinedBytes = 0;
+    AtomicCompareAndSwap(&state, LAZY_UNREFINED, LAZY_BUSY);
+    return true;
+}
+
+bool LazyAccel::Intersect(const Ray& ray,
+                          float* tHit,
+                          float* rayEpsilon,
+                          DifferentialGeometry* dg) const {
+    // 没碰到包围盒的光线不触发细分
+    if (!worldBound.IntersectP(ray))
+        return false;
+    const Shape* s = acquire();
+    bool hit = s && s->Intersect(ray, tHit, rayEpsilon, dg);
+    release();
+    return hit;
+}
+
+bool LazyAccel::IntersectP(const Ray& ray) const {
+    if (!worldBound.IntersectP(ray))
+        return false;
+    const Shape* s = acquire();
+    bool hit = s && s->IntersectP(ray);
+    release();
+    return hit;
+}
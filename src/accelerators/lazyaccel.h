@@ -0,0 +1,55 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/shape.h"
+#include "core/parallel.h"
+
+// 延迟细分: 包住一个不能直接求交的形状, 第一条碰到它世界包围盒的
+// 光线才细分它. 细分只做一次, 在 RWMutex 的写锁下进行, 并发时其他
+// 线程在读锁上等结果, 结果被所有引用它的体素 / 叶子共用. 超出内存
+// 预算时, 最久没用过的细分结果会被丢掉, 下次命中时再重新细分
+class LazyAccel : public Shape {
+   public:
+    LazyAccel(const Reference<Shape>& shape);
+    ~LazyAccel();
+
+    // 能直接求交的形状原样返回, 否则包一层 LazyAccel
+    static Reference<Shape> Wrap(const Reference<Shape>& shape);
+
+    BBox objectBound() const;
+    BBox WorldBound() const { return worldBound; }
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+    // 只算常驻的细分结果
+    size_t MemoryUsage() const;
+
+   private:
+    friend class RefineCache;
+    // 拿到细分结果并钉住它, 用完要 release()
+    const Shape* acquire() const;
+    void release() const;
+    void refine() const;
+    // 没人在用时把细分结果交给 dropped, 成功返回 true.
+    // 持有 RefineCache 的锁时调用, 真正的释放由调用者放到锁外
+    bool evict(Reference<Shape>* dropped) const;
+
+    Reference<Shape> shape;
+    BBox worldBound;
+    // UNREFINED, BUSY (细分或丢弃中), 或 READY + 正在用它的光线数
+    mutable AtomicInt32 state;
+    // 细分时持有写锁, 等细分的线程拿读锁
+    RWMutex* mutex;
+    mutable Reference<Shape> refined;
+    mutable size_t refinedBytes;
+    // 最近一次使用时的 RefineCache 时钟. 时钟只在细分时走, 所以这是
+    // 近似的 LRU: 两次细分之间用过的节点时间戳相同, 丢弃时它们之间
+    // 的先后是任意的
+    mutable int32_t lastUsed;
+};
+
+// 所有 LazyAccel 细分结果的内存上限, 单位字节. 0 表示不限 (默认)
+void SetLazyRefineBudget(size_t bytes);
+size_t LazyRefineMemoryUsage();
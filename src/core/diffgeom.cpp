@@ -0,0 +1,17 @@
+#include "diffgeom.h"
+#include "shape.h"
+
+DifferentialGeometry::DifferentialGeometry(const Point &P, const Vector &DPDU,
+                                           const Vector &DPDV,
+                                           const Normal &DNDU,
+                                           const Normal &DNDV, float uu,
+                                           float vv, const Shape *sh)
+    : p(P), dpdu(DPDU), dpdv(DPDV), dndu(DNDU), dndv(DNDV) {
+    nn = Normal(Normalize(Cross(dpdu, dpdv)));
+    u = uu;
+    v = vv;
+    shape = sh;
+    // 反转朝向和左右手互换各翻转一次法线
+    if (shape && (shape->ReverseOrientation ^ shape->TransformSwapsHandedness))
+        nn *= -1.f;
+}
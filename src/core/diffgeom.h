@@ -1,14 +1,26 @@
+#pragma once
+
 #include "pbrt.h"
 #include "geometry.h"
 
+class Shape;
+
 struct DifferentialGeometry
 {
     DifferentialGeometry(){
-
+        u = v = 0.f;
+        shape = NULL;
     }
+    // nn 由 dpdu x dpdv 算出, 再按形状的朝向翻转
+    DifferentialGeometry(const Point &P, const Vector &DPDU,
+                         const Vector &DPDV, const Normal &DNDU,
+                         const Normal &DNDV, float uu, float vv,
+                         const Shape *sh);
 
     Point p;
     Normal nn;
     float u,v;
+    const Shape *shape;
+    Vector dpdu, dpdv;
+    Normal dndu, dndv;
 };
-
@@ -0,0 +1,15 @@
+#include "pbrt.h"
+#include <stdarg.h>
+#include <stdlib.h>
+
+void Severe(const char* format, ...) {
+    fflush(stdout);
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Fatal error: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    // 可能在工作线程里, exit 会在别的线程还在跑时析构静态对象
+    abort();
+}
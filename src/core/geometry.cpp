@@ -1,4 +1,9 @@
 #include "geometry.h"
+#if defined(PBRT_HAS_AVX)
+#include <immintrin.h>
+#elif defined(PBRT_HAS_SSE)
+#include <emmintrin.h>
+#endif
 
 BBox Union(const BBox& b, const Point& p) {
     BBox ret = b;
@@ -47,4 +52,81 @@ bool BBox::IntersectP(const Ray& ray, float* hitt0, float* hitt1) const {
     if (hitt1)
         *hitt1 = t1;
     return true;
-}
\ No newline at end of file
+}
+
+#ifdef PBRT_HAS_SSE
+// 4 个盒子的 slab 测试. b 指向 [2][3][stride] 布局里这 4 个盒子的起点
+static inline int IntersectP4(const float* b,
+                              int stride,
+                              const TraversalRay& ray,
+                              float tNear[4]) {
+    const int nx = ray.dirIsNeg[0], ny = ray.dirIsNeg[1], nz = ray.dirIsNeg[2];
+    __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y),
+           oz = _mm_set1_ps(ray.o.z);
+    __m128 idx = _mm_set1_ps(ray.invDir.x), idy = _mm_set1_ps(ray.invDir.y),
+           idz = _mm_set1_ps(ray.invDir.z);
+#define SLAB(neg, axis) _mm_load_ps(b + ((neg)*3 + (axis)) * stride)
+    __m128 txMin = _mm_mul_ps(_mm_sub_ps(SLAB(nx, 0), ox), idx);
+    __m128 txMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - nx, 0), ox), idx);
+    __m128 tyMin = _mm_mul_ps(_mm_sub_ps(SLAB(ny, 1), oy), idy);
+    __m128 tyMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - ny, 1), oy), idy);
+    __m128 tzMin = _mm_mul_ps(_mm_sub_ps(SLAB(nz, 2), oz), idz);
+    __m128 tzMax = _mm_mul_ps(_mm_sub_ps(SLAB(1 - nz, 2), oz), idz);
+#undef SLAB
+
+    __m128 t0 = _mm_max_ps(_mm_max_ps(txMin, tyMin),
+                           _mm_max_ps(tzMin, _mm_set1_ps(ray.mint)));
+    __m128 t1 = _mm_min_ps(
+        _mm_mul_ps(_mm_min_ps(_mm_min_ps(txMax, tyMax), tzMax),
+                   _mm_set1_ps(BBOX_TMAX_SCALE)),
+        _mm_set1_ps(ray.maxt));
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+template <>
+int BBoxSoA<4>::IntersectP(const TraversalRay& ray, float tNear[4]) const {
+    return IntersectP4(&b[0][0][0], 4, ray, tNear);
+}
+#endif  // PBRT_HAS_SSE
+
+#ifdef PBRT_HAS_AVX
+template <>
+int BBoxSoA<8>::IntersectP(const TraversalRay& ray, float tNear[8]) const {
+    const int nx = ray.dirIsNeg[0], ny = ray.dirIsNeg[1], nz = ray.dirIsNeg[2];
+    __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y),
+           oz = _mm256_set1_ps(ray.o.z);
+    __m256 idx = _mm256_set1_ps(ray.invDir.x),
+           idy = _mm256_set1_ps(ray.invDir.y),
+           idz = _mm256_set1_ps(ray.invDir.z);
+
+    __m256 txMin =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[nx][0]), ox), idx);
+    __m256 txMax =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[1 - nx][0]), ox), idx);
+    __m256 tyMin =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[ny][1]), oy), idy);
+    __m256 tyMax =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[1 - ny][1]), oy), idy);
+    __m256 tzMin =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[nz][2]), oz), idz);
+    __m256 tzMax =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b[1 - nz][2]), oz), idz);
+
+    __m256 t0 = _mm256_max_ps(_mm256_max_ps(txMin, tyMin),
+                              _mm256_max_ps(tzMin, _mm256_set1_ps(ray.mint)));
+    __m256 t1 = _mm256_min_ps(
+        _mm256_mul_ps(_mm256_min_ps(_mm256_min_ps(txMax, tyMax), tzMax),
+                      _mm256_set1_ps(BBOX_TMAX_SCALE)),
+        _mm256_set1_ps(ray.maxt));
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#elif defined(PBRT_HAS_SSE)
+// 没有 AVX 时分两半用 SSE 测
+template <>
+int BBoxSoA<8>::IntersectP(const TraversalRay& ray, float tNear[8]) const {
+    return IntersectP4(&b[0][0][0], 8, ray, tNear) |
+           (IntersectP4(&b[0][0][4], 8, ray, tNear + 4) << 4);
+}
+#endif  // PBRT_HAS_AVX
@@ -271,9 +271,14 @@ class Ray {
         float end = INFINITY,
         float t = 0.f,
         int d = 0)
-        : o(origin), d(direction), mint(start), maxt(end), depth(d) {}
+        : o(origin),
+          d(direction),
+          time(t),
+          depth(d),
+          mint(start),
+          maxt(end) {}
 
-    Point operator()(float t) { return o + d * t; }
+    Point operator()(float t) const { return o + d * t; }
 
     Point o;
     Vector d;
@@ -312,13 +317,60 @@ class RayDifferential : public Ray {
     Vector rxDirection, ryDirection;
 };
 
+template <int N>
+struct RayPacket;
+
+// 遍历加速结构和做图元测试时用的紧凑光线, 刚好占一个缓存行.
+// 方向的倒数和符号给包围盒测试用, 轴的重排和剪切系数给不漏缝的
+// 三角形测试用, 都只在构造时算一次
+struct alignas(PBRT_L1_CACHE_LINE_SIZE) TraversalRay {
+    TraversalRay() {}
+    explicit TraversalRay(const Ray& r)
+        : o(r.o),
+          invDir(1.f / r.d.x, 1.f / r.d.y, 1.f / r.d.z),
+          time(r.time),
+          mint(r.mint),
+          maxt(r.maxt) {
+        dirIsNeg[0] = invDir.x < 0.f;
+        dirIsNeg[1] = invDir.y < 0.f;
+        dirIsNeg[2] = invDir.z < 0.f;
+
+        // 方向分量绝对值最大的轴作为 z, 其余两个轴循环排在前面;
+        // z 方向为负时交换 x, y 以保持三角形的绕向
+        float ax = fabsf(r.d.x), ay = fabsf(r.d.y), az = fabsf(r.d.z);
+        kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (r.d[kz] < 0.f)
+            swap(kx, ky);
+        Sx = r.d[kx] / r.d[kz];
+        Sy = r.d[ky] / r.d[kz];
+        Sz = 1.f / r.d[kz];
+    }
+
+    Point o;
+    Vector invDir;
+    float Sx, Sy, Sz;
+    float time;
+    mutable float mint, maxt;
+    uint8_t dirIsNeg[3];
+    uint8_t kx, ky, kz;
+};
+
+// slab 测试的远端距离乘上 1 + 2 * gamma(3), 抵消舍入误差. 否则光线
+// 正好擦过扁平包围盒的边角时, 会漏掉里面本来能命中的三角形
+static const float BBOX_TMAX_SCALE = 1.f + 2.f * 1.7881397e-07f;
+
 class BBox {
    public:
+    // 默认是空盒子, 和任何东西 Union 都得到那个东西本身
     BBox() {
-        pMax = Point(INFINITY, INFINITY, INFINITY);
-        pMin = Point(-INFINITY, -INFINITY, -INFINITY);
+        pMin = Point(INFINITY, INFINITY, INFINITY);
+        pMax = Point(-INFINITY, -INFINITY, -INFINITY);
     };
 
+    BBox(const Point& p) : pMin(p), pMax(p) {}
+
     BBox(const Point& p1, const Point& p2) {
         pMin = Point(min(p1.x, p2.x), min(p1.y, p2.y), min(p1.z, p2.z));
         pMax = Point(max(p1.x, p2.x), max(p1.y, p2.y), max(p1.z, p2.z));
@@ -384,6 +436,12 @@ class BBox {
     bool IntersectP(const Ray& ray,
                     float* hitt0 = NULL,
                     float* hitt1 = NULL) const;
+    inline bool IntersectP(const TraversalRay& ray,
+                           float* hitt0 = NULL,
+                           float* hitt1 = NULL) const;
+    // 光线包版本, 定义在 raypacket.h
+    template <int N>
+    int IntersectP(const RayPacket<N>& rays, float tNear[N]) const;
 
     bool operator==(const BBox& b) const {
         return b.pMin == pMin && b.pMax == pMax;
@@ -432,6 +490,18 @@ inline Vector Normalize(const Vector& v) {
     return v / v.Length();
 }
 
+// 由 v1 (已归一化) 构造一组正交基
+inline void CoordinateSystem(const Vector& v1, Vector* v2, Vector* v3) {
+    if (fabsf(v1.x) > fabsf(v1.y)) {
+        float invLen = 1.f / sqrtf(v1.x * v1.x + v1.z * v1.z);
+        *v2 = Vector(-v1.z * invLen, 0.f, v1.x * invLen);
+    } else {
+        float invLen = 1.f / sqrtf(v1.y * v1.y + v1.z * v1.z);
+        *v2 = Vector(0.f, v1.z * invLen, -v1.y * invLen);
+    }
+    *v3 = Cross(v1, *v2);
+}
+
 inline float Distance(const Point& p1, const Point& p2) {
     return (p1 - p2).Length();
 }
@@ -500,6 +570,94 @@ inline Point& BBox::operator[](int i) {
     return (&pMin)[i];
 }
 
+// 不分支的 slab 测试: 用 dirIsNeg 直接选出每个轴的近平面和远平面
+inline bool BBox::IntersectP(const TraversalRay& ray,
+                             float* hitt0,
+                             float* hitt1) const {
+    const BBox& b = *this;
+    float txMin = (b[ray.dirIsNeg[0]].x - ray.o.x) * ray.invDir.x;
+    float txMax = (b[1 - ray.dirIsNeg[0]].x - ray.o.x) * ray.invDir.x;
+    float tyMin = (b[ray.dirIsNeg[1]].y - ray.o.y) * ray.invDir.y;
+    float tyMax = (b[1 - ray.dirIsNeg[1]].y - ray.o.y) * ray.invDir.y;
+    float tzMin = (b[ray.dirIsNeg[2]].z - ray.o.z) * ray.invDir.z;
+    float tzMax = (b[1 - ray.dirIsNeg[2]].z - ray.o.z) * ray.invDir.z;
+    float t0 = max(max(txMin, tyMin), max(tzMin, ray.mint));
+    float t1 = min(min(min(txMax, tyMax), tzMax) * BBOX_TMAX_SCALE, ray.maxt);
+    if (hitt0)
+        *hitt0 = t0;
+    if (hitt1)
+        *hitt1 = t1;
+    return t0 <= t1;
+}
+
+// N 个包围盒的 SoA 布局, 一次测试一条光线和 N 个盒子.
+// b[0] 是 pMin, b[1] 是 pMax, 再按轴和 lane 展开
+template <int N>
+struct BBoxSoA {
+    BBoxSoA() {
+        for (int i = 0; i < N; ++i)
+            Clear(i);
+    }
+
+    void Set(int i, const BBox& box) {
+        for (int axis = 0; axis < 3; ++axis) {
+            b[0][axis][i] = box.pMin[axis];
+            b[1][axis][i] = box.pMax[axis];
+        }
+    }
+
+    // 空盒子 pMin > pMax, 任何光线都不会命中
+    void Clear(int i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            b[0][axis][i] = INFINITY;
+            b[1][axis][i] = -INFINITY;
+        }
+    }
+
+    BBox Get(int i) const {
+        BBox ret;
+        ret.pMin = Point(b[0][0][i], b[0][1][i], b[0][2][i]);
+        ret.pMax = Point(b[1][0][i], b[1][1][i], b[1][2][i]);
+        return ret;
+    }
+
+    // 返回命中掩码, 第 i 位对应第 i 个盒子; tNear 写入每个盒子的入点距离
+    int IntersectP(const TraversalRay& ray, float tNear[N]) const;
+
+    alignas(32) float b[2][3][N];
+};
+
+typedef BBoxSoA<4> BBox4;
+typedef BBoxSoA<8> BBox8;
+
+// 标量版本, 没有 SIMD 时使用
+template <int N>
+int BBoxSoA<N>::IntersectP(const TraversalRay& ray, float tNear[N]) const {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = ray.mint, t1 = ray.maxt;
+        for (int axis = 0; axis < 3; ++axis) {
+            int neg = ray.dirIsNeg[axis];
+            float tMin = (b[neg][axis][i] - ray.o[axis]) * ray.invDir[axis];
+            float tMax = (b[1 - neg][axis][i] - ray.o[axis]) * ray.invDir[axis];
+            t0 = max(t0, tMin);
+            t1 = min(t1, tMax * BBOX_TMAX_SCALE);
+        }
+        tNear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_HAS_SSE
+template <>
+int BBoxSoA<4>::IntersectP(const TraversalRay& ray, float tNear[4]) const;
+#endif
+#ifdef PBRT_HAS_SSE
+template <>
+int BBoxSoA<8>::IntersectP(const TraversalRay& ray, float tNear[8]) const;
+#endif
+
 // x = sin(o1) * cos(o2)  y = sin(o1) sin(o2)  z = cos(o1)
 inline Vector SphericalDirection(float sintheta, float costheta, float phi) {
     return Vector(sintheta * cosf(phi), sintheta * sinf(phi), costheta);
@@ -523,4 +681,25 @@ inline float SphericalTheta(const Vector& v) {
 inline float SphericalPhi(const Vector& v) {
     float p = atan2f(v.y, v.x);
     return (p < 0.f) ? p + 2.f * M_PI : p;
-}
\ No newline at end of file
+}
+
+// 把 10 位整数的每一位隔开两位, 给另外两个轴留出位置
+inline uint32_t LeftShift3(uint32_t x) {
+    if (x == (1 << 10))
+        --x;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// 30 位的 Morton 码, v 的每个分量在 [0, 1] 里 (比如 BBox::Offset 的
+// 结果). 第 b 位属于第 b % 3 个轴
+inline uint32_t EncodeMorton3(const Vector& v) {
+    const float scale = 1 << 10;
+    uint32_t x = (uint32_t)clamp(v.x * scale, 0.f, scale - 1.f);
+    uint32_t y = (uint32_t)clamp(v.y * scale, 0.f, scale - 1.f);
+    uint32_t z = (uint32_t)clamp(v.z * scale, 0.f, scale - 1.f);
+    return (LeftShift3(z) << 2) | (LeftShift3(y) << 1) | LeftShift3(x);
+}
@@ -0,0 +1,88 @@
+#include "instance.h"
+
+// 把原型空间里的 dg 变换到世界空间
+template <typename T>
+static void TransformDifferentialGeometry(const T& toWorld,
+                                          DifferentialGeometry* dg) {
+    dg->p = toWorld(dg->p);
+    dg->nn = Normalize(toWorld(dg->nn));
+    dg->dpdu = toWorld(dg->dpdu);
+    dg->dpdv = toWorld(dg->dpdv);
+    dg->dndu = toWorld(dg->dndu);
+    dg->dndv = toWorld(dg->dndv);
+}
+
+// Instance Method Definitions
+Instance::Instance(const Reference<Shape>& p,
+                   const AffineTransform* o2w,
+                   const AffineTransform* w2o)
+    : Shape(o2w, w2o, false), prototype(p), worldToInstance(NULL) {
+    UpdateBound();
+}
+
+Instance::Instance(const Reference<Shape>& p, const AnimatedTransform* w2i)
+    : Shape(), prototype(p), worldToInstance(w2i) {
+    UpdateBound();
+}
+
+void Instance::SetTransform(const AffineTransform* o2w,
+                            const AffineTransform* w2o) {
+    ObjectToWorld = o2w;
+    WorldToObject = w2o;
+    worldToInstance = NULL;
+    UpdateBound();
+}
+
+void Instance::SetTransform(const AnimatedTransform* w2i) {
+    worldToInstance = w2i;
+    UpdateBound();
+}
+
+void Instance::UpdateBound() {
+    // 运动实例算整个快门区间的包围盒, 顶层 BVH 只用它
+    if (worldToInstance)
+        worldBound =
+            worldToInstance->MotionBounds(prototype->WorldBound(), true);
+    else
+        worldBound = (*ObjectToWorld)(prototype->WorldBound());
+}
+
+BBox Instance::objectBound() const {
+    return prototype->WorldBound();
+}
+
+bool Instance::Intersect(const Ray& r,
+                         float* tHit,
+                         float* rayEpsilon,
+                         DifferentialGeometry* dg) const {
+    // 仿射变换不改变光线的参数化, 原型空间里的 t 就是世界里的 t
+    if (!worldToInstance) {
+        Ray ray;
+        (*WorldToObject)(r, &ray);
+        if (!prototype->Intersect(ray, tHit, rayEpsilon, dg))
+            return false;
+        r.maxt = *tHit;
+        TransformDifferentialGeometry(*ObjectToWorld, dg);
+        return true;
+    }
+
+    Transform w2i;
+    worldToInstance->Interpolate(r.time, &w2i);
+    Ray ray = w2i(r);
+    if (!prototype->Intersect(ray, tHit, rayEpsilon, dg))
+        return false;
+    r.maxt = *tHit;
+    TransformDifferentialGeometry(Inverse(w2i), dg);
+    return true;
+}
+
+bool Instance::IntersectP(const Ray& r) const {
+    if (!worldToInstance) {
+        Ray ray;
+        (*WorldToObject)(r, &ray);
+        return prototype->IntersectP(ray);
+    }
+    Transform w2i;
+    worldToInstance->Interpolate(r.time, &w2i);
+    return prototype->IntersectP(w2i(r));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "pbrt.h"
+#include "shape.h"
+#include "transform.h"
+
+// 实例: 原型 (通常是建好的聚合体) 在它自己的空间里只存一份, 每个
+// 实例只多一个变换和缓存的世界包围盒, 内存随不同的几何增长而不是随
+// 实例数增长. 光线进入时变换到原型空间, 命中后再把 dg 变换回世界.
+// dg.shape 仍然指向原型里被命中的形状
+class Instance : public Shape {
+   public:
+    // 静态实例. 变换一般来自 TransformCache, 相同的摆放共用一份
+    Instance(const Reference<Shape>& prototype,
+             const AffineTransform* o2w,
+             const AffineTransform* w2o);
+    // 运动实例, 按光线的时间插值 worldToInstance
+    Instance(const Reference<Shape>& prototype,
+             const AnimatedTransform* worldToInstance);
+
+    // 动画里换一帧的摆放. 之后要让引用它的聚合体重新拟合
+    void SetTransform(const AffineTransform* o2w, const AffineTransform* w2o);
+    void SetTransform(const AnimatedTransform* worldToInstance);
+    // 原型的几何变了 (比如网格换了顶点) 以后重新计算世界包围盒
+    void UpdateBound();
+
+    BBox objectBound() const;
+    BBox WorldBound() const { return worldBound; }
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+
+   private:
+    Reference<Shape> prototype;
+    // 静态实例为 NULL, 用 Shape 的 WorldToObject
+    const AnimatedTransform* worldToInstance;
+    BBox worldBound;
+};
@@ -0,0 +1,132 @@
+#include "memory.h"
+#include <stdlib.h>
+
+static AtomicInt32 nAlignedAllocs = 0;
+
+void* AllocAligned(size_t size) {
+    AtomicAdd(&nAlignedAllocs, 1);
+    void* ptr;
+    if (posix_memalign(&ptr, PBRT_L1_CACHE_LINE_SIZE, size) != 0)
+        ptr = NULL;
+    return ptr;
+}
+
+void FreeAligned(void* ptr) {
+    free(ptr);
+}
+
+int32_t AlignedAllocCount() {
+    return nAlignedAllocs;
+}
+
+#ifdef PBRT_COUNT_HEAP_ALLOCS
+static AtomicInt32 nHeapAllocs = 0;
+
+int32_t HeapAllocCount() {
+    return nHeapAllocs;
+}
+
+// new[] 和 nothrow 版本默认都转到这几个上, 只替换这些就够了
+void* operator new(size_t size) {
+    AtomicAdd(&nHeapAllocs, 1);
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, std::align_val_t align) {
+    AtomicAdd(&nHeapAllocs, 1);
+    void* ptr;
+    if (posix_memalign(&ptr, max(size_t(align), sizeof(void*)),
+                       size ? size : 1) != 0)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+#endif  // __cpp_aligned_new
+#endif  // PBRT_COUNT_HEAP_ALLOCS
+
+// MemoryArena Method Definitions
+MemoryArena::MemoryArena(uint32_t bs)
+    : curBlock(0), curBlockPos(0), blockSize(bs), nBlockAllocations(0) {
+    nextBlock(blockSize);
+}
+
+MemoryArena::~MemoryArena() {
+    for (uint32_t i = 0; i < blocks.size(); ++i)
+        FreeAligned(blocks[i].data);
+}
+
+void* MemoryArena::Alloc(size_t size, size_t align) {
+    if (align == 0 || (align & (align - 1)) != 0)
+        Severe("MemoryArena: alignment %llu is not a power of two",
+               (unsigned long long)align);
+    // 按地址对齐, 不只是块内的偏移. 块的起点只按缓存行对齐, 要求更大
+    // 的对齐时新块得多留出对齐到 align 的余量
+    uintptr_t mask = align - 1;
+    Block& b = blocks[curBlock];
+    size_t pos = ((uintptr_t(b.data) + curBlockPos + mask) & ~mask) -
+                 uintptr_t(b.data);
+    if (pos + size > b.size) {
+        size_t slack = align > PBRT_L1_CACHE_LINE_SIZE
+                           ? align - PBRT_L1_CACHE_LINE_SIZE
+                           : 0;
+        nextBlock(size + slack);
+        Block& nb = blocks[curBlock];
+        pos = ((uintptr_t(nb.data) + mask) & ~mask) - uintptr_t(nb.data);
+    }
+    curBlockPos = pos + size;
+    return blocks[curBlock].data + pos;
+}
+
+void MemoryArena::nextBlock(size_t size) {
+    // 第一次调用时还没有块, 否则从当前块往后找
+    uint32_t next = blocks.empty() ? 0 : curBlock + 1;
+    // 往后找一块放得下的挪到 next, 上一轮的分配序列在这里就会命中
+    for (uint32_t i = next; i < blocks.size(); ++i)
+        if (blocks[i].size >= size) {
+            swap(blocks[i], blocks[next]);
+            curBlock = next;
+            return;
+        }
+    // 都放不下就新要一块, 插在 next 上, 原来的那块挪到最后
+    Block b;
+    b.size = max(size, blockSize);
+    b.data = (char*)AllocAligned(b.size);
+    if (!b.data)
+        Severe("MemoryArena: unable to allocate %llu bytes",
+               (unsigned long long)b.size);
+    ++nBlockAllocations;
+    blocks.push_back(b);
+    swap(blocks[next], blocks.back());
+    curBlock = next;
+}
+
+size_t MemoryArena::TotalAllocated() const {
+    size_t total = 0;
+    for (uint32_t i = 0; i < blocks.size(); ++i)
+        total += blocks[i].size;
+    return total;
+}
+
+MemoryArena& ThreadArena() {
+    static thread_local MemoryArena arena;
+    return arena;
+}
@@ -1,4 +1,8 @@
+#pragma once
+
 #include "pbrt.h"
+#include "parallel.h"
+#include <new>
 
 class ReferenceCounted {
    private:
@@ -6,12 +10,117 @@ class ReferenceCounted {
     ReferenceCounted& operator=(const ReferenceCounted&);
     /* data */
    public:
-    int nReferences;
+    AtomicInt32 nReferences;
     ReferenceCounted() { nReferences = 0; };
 };
 
+// 引用计数的智能指针, 计数为 0 时删除对象
 template <typename T>
 class Reference {
    public:
-    Reference(T* p = NULL){};
-};
\ No newline at end of file
+    Reference(T* p = NULL) {
+        ptr = p;
+        if (ptr)
+            AtomicAdd(&ptr->nReferences, 1);
+    }
+    Reference(const Reference<T>& r) {
+        ptr = r.ptr;
+        if (ptr)
+            AtomicAdd(&ptr->nReferences, 1);
+    }
+    Reference& operator=(const Reference<T>& r) {
+        if (r.ptr)
+            AtomicAdd(&r.ptr->nReferences, 1);
+        if (ptr && AtomicAdd(&ptr->nReferences, -1) == 0)
+            delete ptr;
+        ptr = r.ptr;
+        return *this;
+    }
+    Reference& operator=(T* p) {
+        if (p)
+            AtomicAdd(&p->nReferences, 1);
+        if (ptr && AtomicAdd(&ptr->nReferences, -1) == 0)
+            delete ptr;
+        ptr = p;
+        return *this;
+    }
+    ~Reference() {
+        if (ptr && AtomicAdd(&ptr->nReferences, -1) == 0)
+            delete ptr;
+    }
+    T* operator->() { return ptr; }
+    const T* operator->() const { return ptr; }
+    operator bool() const { return ptr != NULL; }
+    const T* GetPtr() const { return ptr; }
+
+   private:
+    T* ptr;
+};
+
+// 按缓存行对齐的分配, 要用 FreeAligned 释放
+void* AllocAligned(size_t size);
+template <typename T>
+T* AllocAligned(uint32_t count) {
+    return (T*)AllocAligned(count * sizeof(T));
+}
+void FreeAligned(void* ptr);
+// 到目前为止 AllocAligned 被调用的次数. 渲染循环前后各取一次,
+// 相等说明循环里内存池没有新要块. 只数 AllocAligned
+int32_t AlignedAllocCount();
+#ifdef PBRT_COUNT_HEAP_ALLOCS
+// 到目前为止全局 operator new (包括 new[] 和对齐的版本) 被调用的次数,
+// vector 之类 STL 容器的分配也走这里. 定义了 PBRT_COUNT_HEAP_ALLOCS
+// 时 memory.cpp 替换全局的 operator new/delete, 每次分配多一次原子
+// 加法, 所以默认不打开. 直接调用 malloc 的看不到
+int32_t HeapAllocCount();
+#endif
+
+// 按块分配的内存池. 分配只是把当前块里的位置往后挪, FreeAll 把位置
+// 拨回第一块, 块本身留着给下一个样本用. 第一个样本过后, 同样的分配
+// 序列不会再向全局堆要内存.
+// 不调用析构函数, 只放不需要析构的对象. 不是线程安全的, 每个线程
+// 用自己的, 见 ThreadArena()
+class MemoryArena {
+   public:
+    MemoryArena(uint32_t blockSize = 32768);
+    ~MemoryArena();
+
+    // align 须是 2 的幂, 不是时报 Severe. 可以大于缓存行
+    void* Alloc(size_t size, size_t align = 16);
+    template <typename T>
+    T* Alloc(uint32_t count = 1) {
+        T* ret = (T*)Alloc(count * sizeof(T), alignof(T));
+        for (uint32_t i = 0; i < count; ++i)
+            new (&ret[i]) T();
+        return ret;
+    }
+    // 之前分配的都作废, O(1)
+    void FreeAll() {
+        curBlock = 0;
+        curBlockPos = 0;
+    }
+
+    // 持有的块的总字节数
+    size_t TotalAllocated() const;
+    // 向全局堆要过的块数, 稳定以后不再增长
+    uint32_t BlockAllocations() const { return nBlockAllocations; }
+
+   private:
+    MemoryArena(const MemoryArena&);
+    MemoryArena& operator=(const MemoryArena&);
+    // 换到能放下 size 字节的下一块
+    void nextBlock(size_t size);
+
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    // 按使用的顺序排列, curBlock 之前的本轮已经用过
+    vector<Block> blocks;
+    uint32_t curBlock;
+    size_t curBlockPos, blockSize;
+    uint32_t nBlockAllocations;
+};
+
+// 当前线程的内存池. 每个渲染线程在一个样本结束后调用它的 FreeAll
+MemoryArena& ThreadArena();
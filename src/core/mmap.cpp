@@ -0,0 +1,40 @@
+#include "mmap.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile* MappedFile::Open(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    // 映射建好以后就不再需要文件描述符
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    return new MappedFile(data, st.st_size);
+}
+
+void MappedFile::Advise(size_t offset,
+                        size_t length,
+                        MappedFileAccess access) const {
+    static const int advice[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM,
+                                 MADV_WILLNEED, MADV_DONTNEED};
+    if (offset >= size || length == 0)
+        return;
+    length = min(length, size - offset);
+    // madvise 要求起点按页对齐
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = offset / pageSize * pageSize;
+    madvise((char*)data + start, offset + length - start, advice[access]);
+}
+
+MappedFile::~MappedFile() {
+    munmap(data, size);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "pbrt.h"
+#include "memory.h"
+
+// 告诉内核一段映射接下来怎么访问, 对应 madvise 的几种建议
+enum MappedFileAccess {
+    MAPPED_NORMAL,
+    // 从前往后读, 多预读, 读过的页面可以早点换出
+    MAPPED_SEQUENTIAL,
+    // 随机访问, 不预读
+    MAPPED_RANDOM,
+    // 马上要用, 现在就开始读
+    MAPPED_WILLNEED,
+    // 暂时不用, 页面可以换出, 再访问时从文件重新读
+    MAPPED_DONTNEED
+};
+
+// 只读映射的整个文件. 页面由内核按需读入, 同一个文件的映射在各个
+// 进程之间共用页缓存. 被引用期间映射一直有效
+class MappedFile : public ReferenceCounted {
+   public:
+    // 打不开或者是空文件时返回 NULL
+    static MappedFile* Open(const std::string& filename);
+    ~MappedFile();
+
+    const void* Data() const { return data; }
+    size_t Size() const { return size; }
+    bool Contains(const void* p) const {
+        return (const char*)p >= (const char*)data &&
+               (const char*)p < (const char*)data + size;
+    }
+    // [offset, offset + length) 所在的页面. 只是提示, 失败也不影响正确性
+    void Advise(size_t offset, size_t length, MappedFileAccess access) const;
+
+   private:
+    MappedFile(void* d, size_t s) : data(d), size(s) {}
+
+    void* data;
+    size_t size;
+};
@@ -0,0 +1,597 @@
+/*
+    pbrt source code Copyright(c) 1998-2012 Matt Pharr and Greg Humphreys.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/parallel.cpp*
+#include "parallel.h"
+#include "memory.h"
+#include <errno.h>
+#include <stdlib.h>
+#if !defined(PBRT_IS_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Parallel Local Declarations
+static Mutex* taskQueueMutex = Mutex::Create();
+static vector<Task*> taskQueue;
+// 信号量和条件变量放在堆上, 不析构: 没调用 TasksCleanup 就退出时,
+// 静态析构不会拆掉还在等待的工作线程正在用的对象
+static Semaphore* workerSemaphore = NULL;
+static ConditionVariable* tasksRunningCondition = NULL;
+static uint32_t numUnfinishedTasks = 0;
+static int nThreads = 0;
+#if defined(PBRT_IS_WINDOWS)
+static HANDLE* threads = NULL;
+static DWORD WINAPI taskEntry(LPVOID arg);
+#else
+static pthread_t* threads = NULL;
+static void* taskEntry(void* arg);
+#endif
+
+// Mutex Method Definitions
+Mutex* Mutex::Create() {
+    // 按缓存行对齐, 两个锁不会落在同一行里互相干扰
+    int sz = sizeof(Mutex);
+    sz = (sz + (PBRT_L1_CACHE_LINE_SIZE - 1)) & ~(PBRT_L1_CACHE_LINE_SIZE - 1);
+    return new (AllocAligned(sz)) Mutex;
+}
+
+void Mutex::Destroy(Mutex* m) {
+    m->~Mutex();
+    FreeAligned(m);
+}
+
+#if defined(PBRT_IS_WINDOWS)
+Mutex::Mutex() {
+    InitializeCriticalSection(&criticalSection);
+}
+
+Mutex::~Mutex() {
+    DeleteCriticalSection(&criticalSection);
+}
+
+MutexLock::MutexLock(Mutex& m) : mutex(m) {
+    EnterCriticalSection(&mutex.criticalSection);
+}
+
+MutexLock::~MutexLock() {
+    LeaveCriticalSection(&mutex.criticalSection);
+}
+#else
+Mutex::Mutex() {
+    int err;
+    if ((err = pthread_mutex_init(&mutex, NULL)) != 0)
+        Severe("Error from pthread_mutex_init: %s", strerror(err));
+}
+
+Mutex::~Mutex() {
+    int err;
+    if ((err = pthread_mutex_destroy(&mutex)) != 0)
+        Severe("Error from pthread_mutex_destroy: %s", strerror(err));
+}
+
+MutexLock::MutexLock(Mutex& m) : mutex(m) {
+    int err;
+    if ((err = pthread_mutex_lock(&m.mutex)) != 0)
+        Severe("Error from pthread_mutex_lock: %s", strerror(err));
+}
+
+MutexLock::~MutexLock() {
+    int err;
+    if ((err = pthread_mutex_unlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_mutex_unlock: %s", strerror(err));
+}
+#endif  // !PBRT_IS_WINDOWS
+
+// RWMutex Method Definitions
+RWMutex* RWMutex::Create() {
+    int sz = sizeof(RWMutex);
+    sz = (sz + (PBRT_L1_CACHE_LINE_SIZE - 1)) & ~(PBRT_L1_CACHE_LINE_SIZE - 1);
+    return new (AllocAligned(sz)) RWMutex;
+}
+
+void RWMutex::Destroy(RWMutex* m) {
+    m->~RWMutex();
+    FreeAligned(m);
+}
+
+#if defined(PBRT_IS_WINDOWS)
+// 写者优先: 有写者在等时新来的读者也要等.
+// activeWriterReaders 的高 16 位是有没有写者, 低 16 位是读者数
+RWMutex::RWMutex()
+    : numWritersWaiting(0), numReadersWaiting(0), activeWriterReaders(0) {
+    InitializeCriticalSection(&cs);
+    // 读者用手动复位的事件, 一次放行所有等着的读者
+    hReadyToRead = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (hReadyToRead == NULL)
+        Severe("Error creating event for RWMutex: %d", GetLastError());
+    // 写者用信号量, 一次只放一个
+    hReadyToWrite = CreateSemaphore(NULL, 0, 1, NULL);
+    if (hReadyToWrite == NULL) {
+        DWORD lastError = GetLastError();
+        CloseHandle(hReadyToRead);
+        Severe("Error creating semaphore for RWMutex: %d", lastError);
+    }
+}
+
+RWMutex::~RWMutex() {
+    if (hReadyToRead)
+        CloseHandle(hReadyToRead);
+    if (hReadyToWrite != NULL)
+        CloseHandle(hReadyToWrite);
+    DeleteCriticalSection(&cs);
+}
+
+void RWMutex::AcquireRead() {
+    EnterCriticalSection(&cs);
+    // 条件不满足时在锁里复位事件再等, 写者释放时在锁外置位,
+    // 所以被唤醒以后要重新检查
+    while (numWritersWaiting > 0 || HIWORD(activeWriterReaders) > 0) {
+        ++numReadersWaiting;
+        ResetEvent(hReadyToRead);
+        LeaveCriticalSection(&cs);
+        WaitForSingleObject(hReadyToRead, INFINITE);
+        EnterCriticalSection(&cs);
+        --numReadersWaiting;
+    }
+    ++activeWriterReaders;
+    LeaveCriticalSection(&cs);
+}
+
+void RWMutex::ReleaseRead() {
+    bool notifyWriter = false;
+    EnterCriticalSection(&cs);
+    --activeWriterReaders;
+    // 最后一个读者把锁直接交给一个等着的写者
+    if (activeWriterReaders == 0 && numWritersWaiting > 0) {
+        --numWritersWaiting;
+        activeWriterReaders = MAKELONG(0, 1);
+        notifyWriter = true;
+    }
+    LeaveCriticalSection(&cs);
+    if (notifyWriter)
+        ReleaseSemaphore(hReadyToWrite, 1, NULL);
+}
+
+void RWMutex::AcquireWrite() {
+    EnterCriticalSection(&cs);
+    if (activeWriterReaders == 0) {
+        activeWriterReaders = MAKELONG(0, 1);
+        LeaveCriticalSection(&cs);
+        return;
+    }
+    // 释放的一方会替我们把写者标志置上
+    ++numWritersWaiting;
+    LeaveCriticalSection(&cs);
+    WaitForSingleObject(hReadyToWrite, INFINITE);
+}
+
+void RWMutex::ReleaseWrite() {
+    bool notifyWriter = false, notifyReaders = false;
+    EnterCriticalSection(&cs);
+    if (numWritersWaiting > 0) {
+        // 写者标志留着, 直接交给下一个写者
+        --numWritersWaiting;
+        notifyWriter = true;
+    } else {
+        activeWriterReaders = 0;
+        notifyReaders = numReadersWaiting > 0;
+    }
+    LeaveCriticalSection(&cs);
+    if (notifyWriter)
+        ReleaseSemaphore(hReadyToWrite, 1, NULL);
+    else if (notifyReaders)
+        SetEvent(hReadyToRead);
+}
+
+RWMutexLock::RWMutexLock(RWMutex& m, RWMutexLockType t) : type(t), mutex(m) {
+    if (type == READ)
+        mutex.AcquireRead();
+    else
+        mutex.AcquireWrite();
+}
+
+RWMutexLock::~RWMutexLock() {
+    if (type == READ)
+        mutex.ReleaseRead();
+    else
+        mutex.ReleaseWrite();
+}
+
+// 升级和降级都是先放再拿, 中间别的线程可能改了数据, 调用者要重新检查
+void RWMutexLock::UpgradeToWrite() {
+    if (type == WRITE)
+        return;
+    mutex.ReleaseRead();
+    mutex.AcquireWrite();
+    type = WRITE;
+}
+
+void RWMutexLock::DowngradeToRead() {
+    if (type == READ)
+        return;
+    mutex.ReleaseWrite();
+    mutex.AcquireRead();
+    type = READ;
+}
+#else
+RWMutex::RWMutex() {
+    int err;
+    if ((err = pthread_rwlock_init(&mutex, NULL)) != 0)
+        Severe("Error from pthread_rwlock_init: %s", strerror(err));
+}
+
+RWMutex::~RWMutex() {
+    int err;
+    if ((err = pthread_rwlock_destroy(&mutex)) != 0)
+        Severe("Error from pthread_rwlock_destroy: %s", strerror(err));
+}
+
+RWMutexLock::RWMutexLock(RWMutex& m, RWMutexLockType t) : type(t), mutex(m) {
+    int err;
+    if (type == READ)
+        err = pthread_rwlock_rdlock(&mutex.mutex);
+    else
+        err = pthread_rwlock_wrlock(&mutex.mutex);
+    if (err != 0)
+        Severe("Error from pthread_rwlock_%slock: %s",
+               type == READ ? "rd" : "wr", strerror(err));
+}
+
+RWMutexLock::~RWMutexLock() {
+    int err;
+    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
+}
+
+// 升级和降级都是先放再拿, 中间别的线程可能改了数据, 调用者要重新检查
+void RWMutexLock::UpgradeToWrite() {
+    if (type == WRITE)
+        return;
+    int err;
+    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
+    if ((err = pthread_rwlock_wrlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_rwlock_wrlock: %s", strerror(err));
+    type = WRITE;
+}
+
+void RWMutexLock::DowngradeToRead() {
+    if (type == READ)
+        return;
+    int err;
+    if ((err = pthread_rwlock_unlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_rwlock_unlock: %s", strerror(err));
+    if ((err = pthread_rwlock_rdlock(&mutex.mutex)) != 0)
+        Severe("Error from pthread_rwlock_rdlock: %s", strerror(err));
+    type = READ;
+}
+#endif  // !PBRT_IS_WINDOWS
+
+// Semaphore Method Definitions
+#if defined(PBRT_IS_WINDOWS)
+Semaphore::Semaphore() {
+    handle = CreateSemaphore(NULL, 0, 65535, NULL);
+    if (!handle)
+        Severe("Error from CreateSemaphore: %d", GetLastError());
+}
+
+Semaphore::~Semaphore() {
+    CloseHandle(handle);
+}
+
+void Semaphore::Post(int count) {
+    if (!ReleaseSemaphore(handle, count, NULL))
+        Severe("Error from ReleaseSemaphore: %d", GetLastError());
+}
+
+void Semaphore::Wait() {
+    if (WaitForSingleObject(handle, INFINITE) == WAIT_FAILED)
+        Severe("Error from WaitForSingleObject: %d", GetLastError());
+}
+
+bool Semaphore::TryWait() {
+    return WaitForSingleObject(handle, 0L) == WAIT_OBJECT_0;
+}
+#else
+int Semaphore::count = 0;
+
+Semaphore::Semaphore() {
+#if defined(PBRT_IS_APPLE)
+    // OS X 没有匿名信号量, 建一个有名字的再马上删掉名字
+    char name[32];
+    sprintf(name, "pbrt.%d-%d", (int)getpid(), count++);
+    sem = sem_open(name, O_CREAT, S_IRUSR | S_IWUSR, 0);
+    if (sem == SEM_FAILED)
+        Severe("Error from sem_open: %s", strerror(errno));
+    sem_unlink(name);
+#else
+    sem = new sem_t;
+    if (sem_init(sem, 0, 0) != 0)
+        Severe("Error from sem_init: %s", strerror(errno));
+#endif
+}
+
+Semaphore::~Semaphore() {
+#if defined(PBRT_IS_APPLE)
+    if (sem_close(sem) != 0)
+        Severe("Error from sem_close: %s", strerror(errno));
+#else
+    if (sem_destroy(sem) != 0)
+        Severe("Error from sem_destroy: %s", strerror(errno));
+    delete sem;
+#endif
+}
+
+void Semaphore::Post(int count) {
+    for (int i = 0; i < count; ++i)
+        if (sem_post(sem) != 0)
+            Severe("Error from sem_post: %s", strerror(errno));
+}
+
+void Semaphore::Wait() {
+    // 被信号打断时重新等
+    while (sem_wait(sem) != 0)
+        if (errno != EINTR)
+            Severe("Error from sem_wait: %s", strerror(errno));
+}
+
+bool Semaphore::TryWait() {
+    return sem_trywait(sem) == 0;
+}
+#endif  // !PBRT_IS_WINDOWS
+
+// ConditionVariable Method Definitions
+#if defined(PBRT_IS_WINDOWS)
+ConditionVariable::ConditionVariable() {
+    waitersCount = 0;
+    InitializeCriticalSection(&waitersCountMutex);
+    InitializeCriticalSection(&conditionMutex);
+    // SIGNAL 自动复位, 只放一个; BROADCAST 手动复位, 由最后一个
+    // 醒来的等待者复位
+    events[SIGNAL] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    events[BROADCAST] = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+ConditionVariable::~ConditionVariable() {
+    CloseHandle(events[SIGNAL]);
+    CloseHandle(events[BROADCAST]);
+    DeleteCriticalSection(&waitersCountMutex);
+    DeleteCriticalSection(&conditionMutex);
+}
+
+void ConditionVariable::Lock() {
+    EnterCriticalSection(&conditionMutex);
+}
+
+void ConditionVariable::Unlock() {
+    LeaveCriticalSection(&conditionMutex);
+}
+
+void ConditionVariable::Wait() {
+    EnterCriticalSection(&waitersCountMutex);
+    ++waitersCount;
+    LeaveCriticalSection(&waitersCountMutex);
+
+    // 放开 conditionMutex 以后才等, 别的线程才能改条件并通知
+    LeaveCriticalSection(&conditionMutex);
+    int result = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+    EnterCriticalSection(&waitersCountMutex);
+    --waitersCount;
+    bool lastWaiter =
+        result == WAIT_OBJECT_0 + BROADCAST && waitersCount == 0;
+    LeaveCriticalSection(&waitersCountMutex);
+    if (lastWaiter)
+        ResetEvent(events[BROADCAST]);
+
+    EnterCriticalSection(&conditionMutex);
+}
+
+void ConditionVariable::Signal() {
+    EnterCriticalSection(&waitersCountMutex);
+    bool haveWaiters = waitersCount > 0;
+    LeaveCriticalSection(&waitersCountMutex);
+    if (haveWaiters)
+        SetEvent(events[SIGNAL]);
+}
+#else
+ConditionVariable::ConditionVariable() {
+    int err;
+    if ((err = pthread_cond_init(&cond, NULL)) != 0)
+        Severe("Error from pthread_cond_init: %s", strerror(err));
+    if ((err = pthread_mutex_init(&mutex, NULL)) != 0)
+        Severe("Error from pthread_mutex_init: %s", strerror(err));
+}
+
+ConditionVariable::~ConditionVariable() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void ConditionVariable::Lock() {
+    int err;
+    if ((err = pthread_mutex_lock(&mutex)) != 0)
+        Severe("Error from pthread_mutex_lock: %s", strerror(err));
+}
+
+void ConditionVariable::Unlock() {
+    int err;
+    if ((err = pthread_mutex_unlock(&mutex)) != 0)
+        Severe("Error from pthread_mutex_unlock: %s", strerror(err));
+}
+
+void ConditionVariable::Wait() {
+    int err;
+    if ((err = pthread_cond_wait(&cond, &mutex)) != 0)
+        Severe("Error from pthread_cond_wait: %s", strerror(err));
+}
+
+void ConditionVariable::Signal() {
+    int err;
+    if ((err = pthread_cond_signal(&cond)) != 0)
+        Severe("Error from pthread_cond_signal: %s", strerror(err));
+}
+#endif  // !PBRT_IS_WINDOWS
+
+// Task Method Definitions
+Task::~Task() {}
+
+void TasksInit() {
+    MutexLock lock(*taskQueueMutex);
+    if (threads)
+        return;
+    if (!workerSemaphore) {
+        workerSemaphore = new Semaphore;
+        tasksRunningCondition = new ConditionVariable;
+    }
+    nThreads = NumSystemCores();
+#if defined(PBRT_IS_WINDOWS)
+    threads = new HANDLE[nThreads];
+    for (int i = 0; i < nThreads; ++i) {
+        threads[i] = CreateThread(NULL, 0, taskEntry, NULL, 0, NULL);
+        if (threads[i] == NULL)
+            Severe("Error from CreateThread: %d", GetLastError());
+    }
+#else
+    threads = new pthread_t[nThreads];
+    for (int i = 0; i < nThreads; ++i) {
+        int err = pthread_create(&threads[i], NULL, &taskEntry, NULL);
+        if (err != 0)
+            Severe("Error from pthread_create: %s", strerror(err));
+    }
+#endif
+}
+
+void TasksCleanup() {
+    {
+        MutexLock lock(*taskQueueMutex);
+        if (!threads)
+            return;
+        if (taskQueue.size() != 0)
+            Severe("%d tasks still queued at TasksCleanup",
+                   (int)taskQueue.size());
+    }
+    // 队列是空的, 每个线程取到一个信号就退出
+    workerSemaphore->Post(nThreads);
+#if defined(PBRT_IS_WINDOWS)
+    for (int i = 0; i < nThreads; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    for (int i = 0; i < nThreads; ++i) {
+        int err = pthread_join(threads[i], NULL);
+        if (err != 0)
+            Severe("Error from pthread_join: %s", strerror(err));
+    }
+#endif
+    delete[] threads;
+    threads = NULL;
+}
+
+#if defined(PBRT_IS_WINDOWS)
+static DWORD WINAPI taskEntry(LPVOID) {
+#else
+static void* taskEntry(void*) {
+#endif
+    while (true) {
+        workerSemaphore->Wait();
+        // 取一个任务. 信号和任务一一对应, 队列空说明是 TasksCleanup
+        // 让线程退出
+        Task* myTask = NULL;
+        {
+            MutexLock lock(*taskQueueMutex);
+            if (taskQueue.size() == 0)
+                break;
+            myTask = taskQueue.back();
+            taskQueue.pop_back();
+        }
+        myTask->Run();
+        tasksRunningCondition->Lock();
+        int unfinished = --numUnfinishedTasks;
+        if (unfinished == 0)
+            tasksRunningCondition->Signal();
+        tasksRunningCondition->Unlock();
+    }
+    return 0;
+}
+
+void EnqueueTasks(const vector<Task*>& tasks) {
+    if (NumSystemCores() == 1) {
+        for (uint32_t i = 0; i < tasks.size(); ++i)
+            tasks[i]->Run();
+        return;
+    }
+    TasksInit();
+    // 先记数再入队: 手里有上一批信号的线程可能马上取走新任务
+    tasksRunningCondition->Lock();
+    numUnfinishedTasks += (uint32_t)tasks.size();
+    tasksRunningCondition->Unlock();
+    {
+        // 从队尾取, 倒着放使先发的任务先跑
+        MutexLock lock(*taskQueueMutex);
+        for (int i = (int)tasks.size() - 1; i >= 0; --i)
+            taskQueue.push_back(tasks[i]);
+    }
+    workerSemaphore->Post((int)tasks.size());
+}
+
+void WaitForAllTasks() {
+    if (!tasksRunningCondition)
+        return;
+    tasksRunningCondition->Lock();
+    while (numUnfinishedTasks > 0)
+        tasksRunningCondition->Wait();
+    // 可能不止一个线程在等, 把通知传给下一个
+    tasksRunningCondition->Signal();
+    tasksRunningCondition->Unlock();
+}
+
+int NumSystemCores() {
+    static int nCores = 0;
+    if (nCores > 0)
+        return nCores;
+    int n = 0;
+    const char* env = getenv("PBRT_NCORES");
+    if (env)
+        n = atoi(env);
+    if (n <= 0) {
+#if defined(PBRT_IS_WINDOWS)
+        SYSTEM_INFO sysinfo;
+        GetSystemInfo(&sysinfo);
+        n = (int)sysinfo.dwNumberOfProcessors;
+#else
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    nCores = max(n, 1);
+    return nCores;
+}
@@ -339,8 +339,13 @@ public:
 };
 
 
+// 任务由 TasksInit 建的工作线程执行, 第一次 EnqueueTasks 时会自动
+// 调用它. WaitForAllTasks 等的是所有已经发出去的任务, 所以任务自己
+// 不能再调用它, 否则会等到自己
 void EnqueueTasks(const vector<Task *> &tasks);
 void WaitForAllTasks();
+// 工作线程数. 环境变量 PBRT_NCORES 可以覆盖探测到的核数,
+// 为 1 时 EnqueueTasks 直接在调用者的线程里串行执行
 int NumSystemCores();
 
 #endif // PBRT_CORE_PARALLEL_H
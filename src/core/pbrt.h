@@ -3,6 +3,7 @@
 #define M_PI 3.14159265358979323846f
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
@@ -14,8 +15,47 @@ using std::max;
 using std::min;
 using std::swap;
 
+// 平台
+#if defined(_WIN32) || defined(_WIN64)
+#define PBRT_IS_WINDOWS
+#elif defined(__linux__)
+#define PBRT_IS_LINUX
+#elif defined(__APPLE__)
+#define PBRT_IS_APPLE
+#endif
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__)
+#define PBRT_POINTER_SIZE 8
+#else
+#define PBRT_POINTER_SIZE 4
+#endif
+
+// SIMD 支持, 没有时走标量路径
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define PBRT_HAS_SSE
+#endif
+#if defined(__AVX__)
+#define PBRT_HAS_AVX
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+#define PBRT_HAS_64_BIT_ATOMICS
+#endif
+
+#ifndef PBRT_L1_CACHE_LINE_SIZE
+#define PBRT_L1_CACHE_LINE_SIZE 64
+#endif
+
 class Transform;
 
+#ifdef __GNUG__
+#define PRINTF_FUNC __attribute__((__format__(__printf__, 1, 2)))
+#else
+#define PRINTF_FUNC
+#endif
+
+// 报告没法恢复的错误 (比如内存耗尽) 并终止程序, 参数同 printf
+void Severe(const char* format, ...) PRINTF_FUNC;
+
 // 插值
 inline float Lerp(float t, float v1, float v2) {
     return (1.f - t) * v1 + t * v2;
@@ -0,0 +1,322 @@
+#include "probes.h"
+#include "parallel.h"
+
+#ifdef PBRT_PROBES_COUNTERS
+
+// 计数器每个线程一份, 遍历里每个节点都要加一, 不能用原子操作.
+// 第一次用到时挂到全局链表上, ProbesPrint 在渲染结束后把各线程的加起来
+enum ProbeCounter {
+    SHAPES_CREATED,
+    TRIANGLES_CREATED,
+    MESH_TRIANGLES,
+    MESH_BYTES,
+    CAMERA_RAYS,
+    KDTREE_INTERIOR_NODES,
+    KDTREE_LEAVES,
+    GRIDS_CREATED,
+    GRID_BYTES,
+    LAZY_REFINES,
+    LAZY_REFINED_BYTES,
+    LAZY_EVICTIONS,
+    LAZY_EVICTED_BYTES,
+    TRIANGLE_TESTS,
+    TRIANGLE_HITS,
+    TRIANGLE_TESTSP,
+    TRIANGLE_HITSP,
+    RAYS,
+    RAY_HITS,
+    SHADOW_RAYS,
+    SHADOW_RAY_HITS,
+    SPECULAR_REFLECTION_RAYS,
+    SPECULAR_REFRACTION_RAYS,
+    BVH_INTERIOR_NODES,
+    BVH_LEAF_NODES,
+    BVH_INTERIOR_NODESP,
+    BVH_LEAF_NODESP,
+    // 光线队列的批次, 排序和不排序分开记
+    UNSORTED_BATCH_RAYS,
+    UNSORTED_BATCH_NODES,
+    SORTED_BATCH_RAYS,
+    SORTED_BATCH_NODES,
+    // 每个窗口里不同的节点缓存行数, 只算满的窗口
+    UNSORTED_WINDOWS,
+    UNSORTED_WINDOW_LINES,
+    SORTED_WINDOWS,
+    SORTED_WINDOW_LINES,
+    N_PROBE_COUNTERS
+};
+
+// 节点访问的局部性: 队列里每 LOCALITY_WINDOW 条相邻的光线算一个窗口,
+// 统计窗口里访问过多少个不同的 64 字节缓存行. 排好序的光线走同一片
+// 节点, 这个数应该明显比不排序时小. 去重用线程自己的开放寻址哈希表,
+// 表项记着所属的窗口号, 换窗口时不用清空
+static const uint32_t LOCALITY_WINDOW = 32;
+static const uint32_t LOCALITY_TABLE_SIZE = 8192;
+
+struct ThreadProbeCounters {
+    uint64_t count[N_PROBE_COUNTERS];
+    // 当前批次里访问的节点数, STARTED_BATCH 时清零
+    uint64_t batchNodes;
+    bool batchSorted;
+    // 局部性统计, 只在 STARTED_BATCH 和 FINISHED_BATCH 之间打开.
+    // window 从 1 开始, lineWindow 为 0 的表项是空的
+    bool inBatch;
+    uint32_t window, windowRays;
+    uint64_t windowLines;
+    uint64_t lines[LOCALITY_TABLE_SIZE];
+    uint32_t lineWindow[LOCALITY_TABLE_SIZE];
+    ThreadProbeCounters* next;
+};
+
+static ThreadProbeCounters* allCounters = NULL;
+static thread_local ThreadProbeCounters* threadCounters = NULL;
+
+static ThreadProbeCounters* counters() {
+    if (!threadCounters) {
+        ThreadProbeCounters* c = new ThreadProbeCounters();
+        do {
+            c->next = allCounters;
+        } while (AtomicCompareAndSwapPointer(&allCounters, c, c->next) !=
+                 c->next);
+        threadCounters = c;
+    }
+    return threadCounters;
+}
+
+static inline void countProbe(ProbeCounter c) {
+    ++counters()->count[c];
+}
+
+static void countLine(ThreadProbeCounters* tc, const void* node) {
+    uint64_t line = uint64_t(uintptr_t(node)) / 64;
+    uint32_t mask = LOCALITY_TABLE_SIZE - 1;
+    uint32_t h = uint32_t((line * 0x9e3779b97f4a7c15ull) >> 40) & mask;
+    for (; tc->lineWindow[h] == tc->window; h = (h + 1) & mask)
+        if (tc->lines[h] == line)
+            return;
+    // 表最多填一半, 再多的行照样计数但不再记下来, 可能重复计数
+    if (tc->windowLines < LOCALITY_TABLE_SIZE / 2) {
+        tc->lines[h] = line;
+        tc->lineWindow[h] = tc->window;
+    }
+    ++tc->windowLines;
+}
+
+static void startWindow(ThreadProbeCounters* tc) {
+    if (tc->windowRays == LOCALITY_WINDOW) {
+        ProbeCounter w = tc->batchSorted ? SORTED_WINDOWS : UNSORTED_WINDOWS;
+        ProbeCounter l =
+            tc->batchSorted ? SORTED_WINDOW_LINES : UNSORTED_WINDOW_LINES;
+        ++tc->count[w];
+        tc->count[l] += tc->windowLines;
+    }
+    tc->windowRays = 0;
+    tc->windowLines = 0;
+    if (++tc->window == 0) {
+        memset(tc->lineWindow, 0, sizeof(tc->lineWindow));
+        tc->window = 1;
+    }
+}
+
+static inline void countNode(ProbeCounter c, const void* node) {
+    ThreadProbeCounters* tc = counters();
+    ++tc->count[c];
+    ++tc->batchNodes;
+    if (tc->inBatch)
+        countLine(tc, node);
+}
+
+static void printCount(FILE* dest, const char* name, uint64_t n) {
+    if (n > 0)
+        fprintf(dest, "    %-42s %12llu\n", name, (unsigned long long)n);
+}
+
+static void printRatio(FILE* dest, const char* name, uint64_t a, uint64_t b) {
+    if (b > 0)
+        fprintf(dest, "    %-42s %12.3f (%llu / %llu)\n", name,
+                double(a) / double(b), (unsigned long long)a,
+                (unsigned long long)b);
+}
+
+void ProbesPrint(FILE* dest) {
+    uint64_t c[N_PROBE_COUNTERS] = {0};
+    for (ThreadProbeCounters* tc = allCounters; tc; tc = tc->next)
+        for (int i = 0; i < N_PROBE_COUNTERS; ++i)
+            c[i] += tc->count[i];
+    fprintf(dest, "Statistics:\n");
+    printCount(dest, "Shapes created", c[SHAPES_CREATED]);
+    printCount(dest, "Triangles created", c[TRIANGLES_CREATED]);
+    printRatio(dest, "Triangle mesh bytes / triangle", c[MESH_BYTES],
+               c[MESH_TRIANGLES]);
+    printCount(dest, "Camera rays generated", c[CAMERA_RAYS]);
+    printCount(dest, "Specular reflection rays", c[SPECULAR_REFLECTION_RAYS]);
+    printCount(dest, "Specular refraction rays", c[SPECULAR_REFRACTION_RAYS]);
+    printCount(dest, "kd-tree interior nodes", c[KDTREE_INTERIOR_NODES]);
+    printCount(dest, "kd-tree leaves", c[KDTREE_LEAVES]);
+    printCount(dest, "Grids created", c[GRIDS_CREATED]);
+    printCount(dest, "Grid voxel bytes allocated", c[GRID_BYTES]);
+    printCount(dest, "Lazy refinements", c[LAZY_REFINES]);
+    printCount(dest, "Lazy refined bytes", c[LAZY_REFINED_BYTES]);
+    printCount(dest, "Lazy evictions", c[LAZY_EVICTIONS]);
+    printCount(dest, "Lazy evicted bytes", c[LAZY_EVICTED_BYTES]);
+    printRatio(dest, "Ray hits", c[RAY_HITS], c[RAYS]);
+    printRatio(dest, "Shadow ray hits", c[SHADOW_RAY_HITS], c[SHADOW_RAYS]);
+    printRatio(dest, "Triangle hits", c[TRIANGLE_HITS], c[TRIANGLE_TESTS]);
+    printRatio(dest, "Triangle shadow hits", c[TRIANGLE_HITSP],
+               c[TRIANGLE_TESTSP]);
+    printCount(dest, "BVH interior nodes visited", c[BVH_INTERIOR_NODES]);
+    printCount(dest, "BVH leaves visited", c[BVH_LEAF_NODES]);
+    printCount(dest, "BVH shadow interior nodes visited",
+               c[BVH_INTERIOR_NODESP]);
+    printCount(dest, "BVH shadow leaves visited", c[BVH_LEAF_NODESP]);
+    printRatio(dest, "Ray queue nodes / ray, unsorted",
+               c[UNSORTED_BATCH_NODES], c[UNSORTED_BATCH_RAYS]);
+    printRatio(dest, "Ray queue nodes / ray, sorted", c[SORTED_BATCH_NODES],
+               c[SORTED_BATCH_RAYS]);
+    // 窗口大小是 LOCALITY_WINDOW
+    printRatio(dest, "Node cache lines / 32-ray window, unsorted",
+               c[UNSORTED_WINDOW_LINES], c[UNSORTED_WINDOWS]);
+    printRatio(dest, "Node cache lines / 32-ray window, sorted",
+               c[SORTED_WINDOW_LINES], c[SORTED_WINDOWS]);
+}
+
+// 只能在所有线程都结束以后调用
+void ProbesCleanup() {
+    ThreadProbeCounters* tc = allCounters;
+    allCounters = NULL;
+    while (tc) {
+        ThreadProbeCounters* next = tc->next;
+        delete tc;
+        tc = next;
+    }
+    threadCounters = NULL;
+}
+
+void PBRT_CREATED_SHAPE(Shape*) {
+    countProbe(SHAPES_CREATED);
+}
+
+void PBRT_CREATED_TRIANGLE(Triangle*) {
+    countProbe(TRIANGLES_CREATED);
+}
+
+void PBRT_CREATED_TRIANGLE_MESH(TriangleMesh*, int ntris, uint64_t bytes) {
+    ThreadProbeCounters* tc = counters();
+    tc->count[MESH_TRIANGLES] += ntris;
+    tc->count[MESH_BYTES] += bytes;
+}
+
+void PBRT_STARTED_GENERATING_CAMERA_RAY(const CameraSample*) {
+    countProbe(CAMERA_RAYS);
+}
+
+void PBRT_KDTREE_CREATED_INTERIOR_NODE(int, float) {
+    countProbe(KDTREE_INTERIOR_NODES);
+}
+
+void PBRT_KDTREE_CREATED_LEAF(int, int) {
+    countProbe(KDTREE_LEAVES);
+}
+
+void PBRT_GRID_MEMORY_ALLOCATED(size_t bytes) {
+    ThreadProbeCounters* tc = counters();
+    ++tc->count[GRIDS_CREATED];
+    tc->count[GRID_BYTES] += bytes;
+}
+
+void PBRT_LAZY_REFINED(LazyAccel*, size_t bytes) {
+    ThreadProbeCounters* tc = counters();
+    ++tc->count[LAZY_REFINES];
+    tc->count[LAZY_REFINED_BYTES] += bytes;
+}
+
+void PBRT_LAZY_EVICTED(LazyAccel*, size_t bytes) {
+    ThreadProbeCounters* tc = counters();
+    ++tc->count[LAZY_EVICTIONS];
+    tc->count[LAZY_EVICTED_BYTES] += bytes;
+}
+
+void PBRT_RAY_TRIANGLE_INTERSECTION_TEST(const Ray*, const Triangle*) {
+    countProbe(TRIANGLE_TESTS);
+}
+
+void PBRT_RAY_TRIANGLE_INTERSECTIONP_TEST(const Ray*, const Triangle*) {
+    countProbe(TRIANGLE_TESTSP);
+}
+
+void PBRT_RAY_TRIANGLE_INTERSECTION_HIT(const Ray*, float) {
+    countProbe(TRIANGLE_HITS);
+}
+
+void PBRT_RAY_TRIANGLE_INTERSECTIONP_HIT(const Ray*, float) {
+    countProbe(TRIANGLE_HITSP);
+}
+
+void PBRT_FINISHED_RAY_INTERSECTION(const Ray*, const Intersection*, int hit) {
+    countProbe(RAYS);
+    if (hit)
+        countProbe(RAY_HITS);
+}
+
+void PBRT_FINISHED_RAY_INTERSECTIONP(const Ray*, int hit) {
+    countProbe(SHADOW_RAYS);
+    if (hit)
+        countProbe(SHADOW_RAY_HITS);
+}
+
+void PBRT_STARTED_SPECULAR_REFLECTION_RAY(const RayDifferential*) {
+    countProbe(SPECULAR_REFLECTION_RAYS);
+}
+
+void PBRT_STARTED_SPECULAR_REFRACTION_RAY(const RayDifferential*) {
+    countProbe(SPECULAR_REFRACTION_RAYS);
+}
+
+// 一个队列的一批光线在同一个线程里追踪完, 所以用线程自己的计数就
+// 不会混进别的线程同时访问的节点
+void PBRT_RAY_QUEUE_STARTED_BATCH(RayQueue*, int, bool sorted) {
+    ThreadProbeCounters* tc = counters();
+    tc->batchNodes = 0;
+    tc->batchSorted = sorted;
+    tc->inBatch = true;
+    tc->windowRays = 0;
+    startWindow(tc);
+}
+
+void PBRT_RAY_QUEUE_FINISHED_BATCH(RayQueue*, int nRays) {
+    ThreadProbeCounters* tc = counters();
+    if (tc->batchSorted) {
+        tc->count[SORTED_BATCH_RAYS] += nRays;
+        tc->count[SORTED_BATCH_NODES] += tc->batchNodes;
+    } else {
+        tc->count[UNSORTED_BATCH_RAYS] += nRays;
+        tc->count[UNSORTED_BATCH_NODES] += tc->batchNodes;
+    }
+    startWindow(tc);
+    tc->inBatch = false;
+}
+
+void PBRT_RAY_QUEUE_STARTED_RAY(RayQueue*, uint32_t) {
+    ThreadProbeCounters* tc = counters();
+    if (tc->windowRays == LOCALITY_WINDOW)
+        startWindow(tc);
+    ++tc->windowRays;
+}
+
+void PBRT_BVH_INTERSECTION_TRAVERSED_INTERIOR_NODE(void* node) {
+    countNode(BVH_INTERIOR_NODES, node);
+}
+
+void PBRT_BVH_INTERSECTION_TRAVERSED_LEAF_NODE(void* node) {
+    countNode(BVH_LEAF_NODES, node);
+}
+
+void PBRT_BVH_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(void* node) {
+    countNode(BVH_INTERIOR_NODESP, node);
+}
+
+void PBRT_BVH_INTERSECTIONP_TRAVERSED_LEAF_NODE(void* node) {
+    countNode(BVH_LEAF_NODESP, node);
+}
+
+#endif  // PBRT_PROBES_COUNTERS
@@ -77,6 +77,7 @@ inline void ProbesPrint(FILE *) { }
 #define PBRT_BVH_INTERSECTIONP_FINISHED()
 #define PBRT_CREATED_SHAPE(shape)
 #define PBRT_CREATED_TRIANGLE(tri)
+#define PBRT_CREATED_TRIANGLE_MESH(mesh, ntris, bytes)
 #define PBRT_FINISHED_GENERATING_CAMERA_RAY(arg0, arg1, arg2)
 #define PBRT_FINISHED_PARSING()
 #define PBRT_FINISHED_PREPROCESSING()
@@ -95,6 +96,7 @@ inline void ProbesPrint(FILE *) { }
 #define PBRT_GRID_FINISHED_CONSTRUCTION(arg0)
 #define PBRT_GRID_INTERSECTIONP_TEST(arg0, arg1)
 #define PBRT_GRID_INTERSECTION_TEST(arg0, arg1)
+#define PBRT_GRID_MEMORY_ALLOCATED(arg0)
 #define PBRT_GRID_RAY_MISSED_BOUNDS()
 #define PBRT_GRID_RAY_PRIMITIVE_HIT(arg0)
 #define PBRT_GRID_RAY_PRIMITIVE_INTERSECTIONP_TEST(arg0)
@@ -127,6 +129,8 @@ inline void ProbesPrint(FILE *) { }
 #define PBRT_KDTREE_INTERSECTION_TRAVERSED_LEAF_NODE(arg0, arg1)
 #define PBRT_KDTREE_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(arg0)
 #define PBRT_KDTREE_INTERSECTIONP_TRAVERSED_LEAF_NODE(arg0, arg1)
+#define PBRT_LAZY_EVICTED(arg0, arg1)
+#define PBRT_LAZY_REFINED(arg0, arg1)
 #define PBRT_LOADED_IMAGE_MAP(arg0, arg1, arg2, arg3, arg4)
 #define PBRT_MIPMAP_EWA_FILTER(arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10)
 #define PBRT_MIPMAP_TRILINEAR_FILTER(arg0, arg1, arg2, arg3, arg4, arg5)
@@ -167,6 +171,9 @@ inline void ProbesPrint(FILE *) { }
 #define PBRT_PHOTON_MAP_STARTED_GATHER_RAY(arg0)
 #define PBRT_PHOTON_MAP_STARTED_LOOKUP(arg0)
 #define PBRT_PHOTON_MAP_STARTED_RAY_PATH(arg0, arg1)
+#define PBRT_RAY_QUEUE_STARTED_BATCH(arg0, arg1, arg2)
+#define PBRT_RAY_QUEUE_FINISHED_BATCH(arg0, arg1)
+#define PBRT_RAY_QUEUE_STARTED_RAY(arg0, arg1)
 #define PBRT_RAY_TRIANGLE_INTERSECTIONP_HIT(arg0, arg1)
 #define PBRT_RAY_TRIANGLE_INTERSECTIONP_TEST(arg0, arg1)
 #define PBRT_RAY_TRIANGLE_INTERSECTION_HIT(arg0, arg1)
@@ -221,9 +228,17 @@ inline void ProbesPrint(FILE *) { }
 // Statistics Counters Declarations
 void ProbesPrint(FILE *dest);
 void ProbesCleanup();
+class Shape;
+class Ray;
+class RayDifferential;
+class Intersection;
 class Triangle;
 extern void PBRT_CREATED_SHAPE(Shape *);
 extern void PBRT_CREATED_TRIANGLE(Triangle *);
+// 网格建好或从缓存载入以后报告一次, bytes 是 TriangleMesh::MemoryUsage
+class TriangleMesh;
+extern void PBRT_CREATED_TRIANGLE_MESH(TriangleMesh *, int ntris,
+                                       uint64_t bytes);
 extern void PBRT_STARTED_GENERATING_CAMERA_RAY(const struct CameraSample *);
 extern void PBRT_KDTREE_CREATED_INTERIOR_NODE(int axis, float split);
 extern void PBRT_KDTREE_CREATED_LEAF(int nprims, int depth);
@@ -242,6 +257,23 @@ extern void PBRT_FINISHED_RAY_INTERSECTION(const Ray *, const Intersection *, in
 extern void PBRT_FINISHED_RAY_INTERSECTIONP(const Ray *, int hit);
 extern void PBRT_STARTED_SPECULAR_REFLECTION_RAY(const RayDifferential *);
 extern void PBRT_STARTED_SPECULAR_REFRACTION_RAY(const RayDifferential *);
+// STARTED_BATCH 把当前线程这一批的节点数清零, FINISHED_BATCH 把
+// 这一批访问的节点数累计起来, 排序和不排序分开算. STARTED_RAY 在
+// 这一批里追踪每条光线之前调用, 用来按窗口统计节点缓存行 (见 probes.cpp)
+class RayQueue;
+extern void PBRT_RAY_QUEUE_STARTED_BATCH(RayQueue *, int nRays, bool sorted);
+extern void PBRT_RAY_QUEUE_FINISHED_BATCH(RayQueue *, int nRays);
+extern void PBRT_RAY_QUEUE_STARTED_RAY(RayQueue *, uint32_t i);
+extern void PBRT_BVH_INTERSECTION_TRAVERSED_INTERIOR_NODE(void *node);
+extern void PBRT_BVH_INTERSECTION_TRAVERSED_LEAF_NODE(void *node);
+extern void PBRT_BVH_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(void *node);
+extern void PBRT_BVH_INTERSECTIONP_TRAVERSED_LEAF_NODE(void *node);
+// 网格建好时报告一次体素占用的字节数
+extern void PBRT_GRID_MEMORY_ALLOCATED(size_t bytes);
+// 延迟细分的形状每细分或丢弃一次报告一次, bytes 是细分结果的大小
+class LazyAccel;
+extern void PBRT_LAZY_REFINED(LazyAccel *, size_t bytes);
+extern void PBRT_LAZY_EVICTED(LazyAccel *, size_t bytes);
 #define PBRT_ACCESSED_TEXEL(arg0, arg1, arg2, arg3)
 #define PBRT_ALLOCATED_CACHED_TRANSFORM()
 #define PBRT_FOUND_CACHED_TRANSFORM()
@@ -249,15 +281,11 @@ extern void PBRT_STARTED_SPECULAR_REFRACTION_RAY(const RayDifferential *);
 #define PBRT_BVH_STARTED_CONSTRUCTION(arg0, arg1)
 #define PBRT_BVH_FINISHED_CONSTRUCTION(arg0)
 #define PBRT_BVH_INTERSECTION_STARTED(arg0, arg1)
-#define PBRT_BVH_INTERSECTION_TRAVERSED_INTERIOR_NODE(arg0)
-#define PBRT_BVH_INTERSECTION_TRAVERSED_LEAF_NODE(arg0)
 #define PBRT_BVH_INTERSECTION_PRIMITIVE_TEST(arg0)
 #define PBRT_BVH_INTERSECTION_PRIMITIVE_HIT(arg0)
 #define PBRT_BVH_INTERSECTION_PRIMITIVE_MISSED(arg0)
 #define PBRT_BVH_INTERSECTION_FINISHED()
 #define PBRT_BVH_INTERSECTIONP_STARTED(arg0, arg1)
-#define PBRT_BVH_INTERSECTIONP_TRAVERSED_INTERIOR_NODE(arg0)
-#define PBRT_BVH_INTERSECTIONP_TRAVERSED_LEAF_NODE(arg0)
 #define PBRT_BVH_INTERSECTIONP_PRIMITIVE_TEST(arg0)
 #define PBRT_BVH_INTERSECTIONP_PRIMITIVE_HIT(arg0)
 #define PBRT_BVH_INTERSECTIONP_PRIMITIVE_MISSED(arg0)
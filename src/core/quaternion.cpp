@@ -1,21 +1,227 @@
 #include "quaternion.h"
 #include "transform.h"
+#ifdef PBRT_HAS_SSE
+#include <xmmintrin.h>
+#endif
 
-Transform Quaternion::ToTransform() const {
+Matrix4x4 Quaternion::ToMatrix() const {
     float xx = v.x * v.x, yy = v.y * v.y, zz = v.z * v.z;
     float xy = v.x * v.y, xz = v.x * v.z, yz = v.y * v.z;
     float wx = w * v.x, wy = w * v.y, wz = w * v.z;
 
     Matrix4x4 m;
     m.m[0][0] = 1.f - 2.f * (yy + zz);
-    m.m[0][1] = 2.f * (xy + wz);
-    m.m[0][2] = 2.f * (xz - wy);
-    m.m[1][0] = 2.f * (xy - wz);
+    m.m[0][1] = 2.f * (xy - wz);
+    m.m[0][2] = 2.f * (xz + wy);
+    m.m[1][0] = 2.f * (xy + wz);
     m.m[1][1] = 1.f - 2.f * (xx + zz);
-    m.m[1][2] = 2.f * (yz + wx);
-    m.m[2][0] = 2.f * (xz + wy);
-    m.m[2][1] = 2.f * (yz - wx);
+    m.m[1][2] = 2.f * (yz - wx);
+    m.m[2][0] = 2.f * (xz - wy);
+    m.m[2][1] = 2.f * (yz + wx);
     m.m[2][2] = 1.f - 2.f * (xx + yy);
+    return m;
+}
 
+// 旋转矩阵的逆就是它的转置
+Transform Quaternion::ToTransform() const {
+    Matrix4x4 m = ToMatrix();
     return Transform(m, Transpose(m));
-}
\ No newline at end of file
+}
+
+Quaternion::Quaternion(const Transform& t) {
+    const Matrix4x4& m = t.GetMatrix();
+    float trace = m.m[0][0] + m.m[1][1] + m.m[2][2];
+    if (trace > 0.f) {
+        // 由迹直接算出 w, 数值上最稳定
+        float s = sqrtf(trace + 1.f);
+        w = s / 2.f;
+        s = 0.5f / s;
+        v.x = (m.m[2][1] - m.m[1][2]) * s;
+        v.y = (m.m[0][2] - m.m[2][0]) * s;
+        v.z = (m.m[1][0] - m.m[0][1]) * s;
+    } else {
+        // 从对角线上最大的分量开始算
+        const int nxt[3] = {1, 2, 0};
+        float q[3];
+        int i = 0;
+        if (m.m[1][1] > m.m[0][0])
+            i = 1;
+        if (m.m[2][2] > m.m[i][i])
+            i = 2;
+        int j = nxt[i];
+        int k = nxt[j];
+        float s = sqrtf((m.m[i][i] - (m.m[j][j] + m.m[k][k])) + 1.f);
+        q[i] = s * 0.5f;
+        if (s != 0.f)
+            s = 0.5f / s;
+        w = (m.m[k][j] - m.m[j][k]) * s;
+        q[j] = (m.m[j][i] + m.m[i][j]) * s;
+        q[k] = (m.m[k][i] + m.m[i][k]) * s;
+        v.x = q[0];
+        v.y = q[1];
+        v.z = q[2];
+    }
+}
+
+Quaternion Slerp(float t, const Quaternion& q1, const Quaternion& q2) {
+    float cosTheta = Dot(q1, q2);
+    // q 和 -q 是同一个旋转, 取夹角小于 90 度的那个
+    Quaternion q2s = q2;
+    if (cosTheta < 0.f) {
+        q2s = -1.f * q2;
+        cosTheta = -cosTheta;
+    }
+    if (cosTheta > .9995f)
+        return Normalize((1.f - t) * q1 + t * q2s);
+    float theta = acosf(clamp(cosTheta, -1.f, 1.f));
+    float thetap = theta * t;
+    Quaternion qperp = Normalize(q2s - q1 * cosTheta);
+    return q1 * cosf(thetap) + qperp * sinf(thetap);
+}
+
+// 批量版本
+#ifdef PBRT_HAS_SSE
+// acos(c), c 在 [0, 1]. Abramowitz & Stegun 4.4.46, 误差 2e-8
+static inline __m128 AcosPositive(__m128 c) {
+    __m128 p = _mm_set1_ps(-0.0012624911f);
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(0.0066700901f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(-0.0170881256f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(0.0308918810f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(-0.0501743046f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(0.0889789874f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(-0.2145988016f));
+    p = _mm_add_ps(_mm_mul_ps(p, c), _mm_set1_ps(1.5707963050f));
+    __m128 s = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.f), c),
+                                      _mm_setzero_ps()));
+    return _mm_mul_ps(s, p);
+}
+
+// x 在 [0, pi/2] 时的 sin 和 cos, Taylor 展开到 x^11 / x^12
+static inline void SinCosQuarter(__m128 x, __m128* sinx, __m128* cosx) {
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 s = _mm_set1_ps(-1.f / 39916800.f);
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(1.f / 362880.f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(-1.f / 5040.f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(1.f / 120.f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(-1.f / 6.f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(1.f));
+    *sinx = _mm_mul_ps(s, x);
+    __m128 c = _mm_set1_ps(1.f / 479001600.f);
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-1.f / 3628800.f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.f / 40320.f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-1.f / 720.f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.f / 24.f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-1.f / 2.f));
+    *cosx = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.f));
+}
+
+static inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 Dot4(__m128 ax, __m128 ay, __m128 az, __m128 aw,
+                          __m128 bx, __m128 by, __m128 bz, __m128 bw) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                      _mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(aw, bw)));
+}
+#endif  // PBRT_HAS_SSE
+
+template <int N>
+void Slerp(const float t[N],
+           const QuaternionSoA<N>& q1,
+           const QuaternionSoA<N>& q2,
+           QuaternionSoA<N>* out) {
+    int i = 0;
+#ifdef PBRT_HAS_SSE
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 signBit = _mm_set1_ps(-0.f);
+    for (; i + 4 <= N; i += 4) {
+        __m128 tt = _mm_loadu_ps(t + i);
+        __m128 ax = _mm_load_ps(q1.x + i), ay = _mm_load_ps(q1.y + i),
+               az = _mm_load_ps(q1.z + i), aw = _mm_load_ps(q1.w + i);
+        __m128 bx = _mm_load_ps(q2.x + i), by = _mm_load_ps(q2.y + i),
+               bz = _mm_load_ps(q2.z + i), bw = _mm_load_ps(q2.w + i);
+
+        // 走最短的弧: 点积为负时把 q2 取反
+        __m128 cosTheta = Dot4(ax, ay, az, aw, bx, by, bz, bw);
+        __m128 flip = _mm_and_ps(cosTheta, signBit);
+        bx = _mm_xor_ps(bx, flip);
+        by = _mm_xor_ps(by, flip);
+        bz = _mm_xor_ps(bz, flip);
+        bw = _mm_xor_ps(bw, flip);
+        cosTheta = _mm_min_ps(_mm_xor_ps(cosTheta, flip), one);
+
+        // nlerp, 角度很小时用
+        __m128 s1 = _mm_sub_ps(one, tt);
+        __m128 lx = _mm_add_ps(_mm_mul_ps(s1, ax), _mm_mul_ps(tt, bx));
+        __m128 ly = _mm_add_ps(_mm_mul_ps(s1, ay), _mm_mul_ps(tt, by));
+        __m128 lz = _mm_add_ps(_mm_mul_ps(s1, az), _mm_mul_ps(tt, bz));
+        __m128 lw = _mm_add_ps(_mm_mul_ps(s1, aw), _mm_mul_ps(tt, bw));
+        __m128 linv = _mm_div_ps(
+            one, _mm_sqrt_ps(Dot4(lx, ly, lz, lw, lx, ly, lz, lw)));
+
+        // slerp: q1 cos(t theta) + qperp sin(t theta)
+        __m128 px = _mm_sub_ps(bx, _mm_mul_ps(ax, cosTheta));
+        __m128 py = _mm_sub_ps(by, _mm_mul_ps(ay, cosTheta));
+        __m128 pz = _mm_sub_ps(bz, _mm_mul_ps(az, cosTheta));
+        __m128 pw = _mm_sub_ps(bw, _mm_mul_ps(aw, cosTheta));
+        __m128 plen2 = Dot4(px, py, pz, pw, px, py, pz, pw);
+        __m128 pinv = _mm_div_ps(
+            one, _mm_sqrt_ps(_mm_max_ps(plen2, _mm_set1_ps(1e-20f))));
+        __m128 sinp, cosp;
+        SinCosQuarter(_mm_mul_ps(AcosPositive(cosTheta), tt), &sinp, &cosp);
+        sinp = _mm_mul_ps(sinp, pinv);
+
+        __m128 useLerp = _mm_cmpgt_ps(cosTheta, _mm_set1_ps(.9995f));
+        _mm_store_ps(out->x + i,
+                     Select(useLerp, _mm_mul_ps(lx, linv),
+                            _mm_add_ps(_mm_mul_ps(ax, cosp),
+                                       _mm_mul_ps(px, sinp))));
+        _mm_store_ps(out->y + i,
+                     Select(useLerp, _mm_mul_ps(ly, linv),
+                            _mm_add_ps(_mm_mul_ps(ay, cosp),
+                                       _mm_mul_ps(py, sinp))));
+        _mm_store_ps(out->z + i,
+                     Select(useLerp, _mm_mul_ps(lz, linv),
+                            _mm_add_ps(_mm_mul_ps(az, cosp),
+                                       _mm_mul_ps(pz, sinp))));
+        _mm_store_ps(out->w + i,
+                     Select(useLerp, _mm_mul_ps(lw, linv),
+                            _mm_add_ps(_mm_mul_ps(aw, cosp),
+                                       _mm_mul_ps(pw, sinp))));
+    }
+#endif
+    for (; i < N; ++i)
+        out->Set(i, Slerp(t[i], q1.Get(i), q2.Get(i)));
+}
+
+template <int N>
+void ToMatrices(const QuaternionSoA<N>& q, float r[3][3][N]) {
+    // 和 Quaternion::ToMatrix 一样的公式, 按 lane 展开, 编译器可以直接向量化
+    for (int i = 0; i < N; ++i) {
+        float x = q.x[i], y = q.y[i], z = q.z[i], w = q.w[i];
+        float xx = x * x, yy = y * y, zz = z * z;
+        float xy = x * y, xz = x * z, yz = y * z;
+        float wx = w * x, wy = w * y, wz = w * z;
+        r[0][0][i] = 1.f - 2.f * (yy + zz);
+        r[0][1][i] = 2.f * (xy - wz);
+        r[0][2][i] = 2.f * (xz + wy);
+        r[1][0][i] = 2.f * (xy + wz);
+        r[1][1][i] = 1.f - 2.f * (xx + zz);
+        r[1][2][i] = 2.f * (yz - wx);
+        r[2][0][i] = 2.f * (xz - wy);
+        r[2][1][i] = 2.f * (yz + wx);
+        r[2][2][i] = 1.f - 2.f * (xx + yy);
+    }
+}
+
+template void Slerp<4>(const float t[4],
+                       const QuaternionSoA<4>& q1,
+                       const QuaternionSoA<4>& q2,
+                       QuaternionSoA<4>* out);
+template void Slerp<8>(const float t[8],
+                       const QuaternionSoA<8>& q1,
+                       const QuaternionSoA<8>& q2,
+                       QuaternionSoA<8>* out);
+template void ToMatrices<4>(const QuaternionSoA<4>& q, float r[3][3][4]);
+template void ToMatrices<8>(const QuaternionSoA<8>& q, float r[3][3][8]);
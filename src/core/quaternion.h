@@ -3,6 +3,8 @@
 #include "geometry.h"
 #include "pbrt.h"
 
+struct Matrix4x4;
+
 struct Quaternion {
     Quaternion() {
         v = Vector(0., 0., 0.);
@@ -10,7 +12,7 @@ struct Quaternion {
     }
     Quaternion& operator+=(const Quaternion& q) {
         v += q.v;
-        w += w;
+        w += q.w;
         return (*this);
     }
     friend Quaternion operator+(const Quaternion& q1, const Quaternion& q2) {
@@ -49,6 +51,8 @@ struct Quaternion {
         return ret;
     }
 
+    // 旋转矩阵, 只填左上 3x3, 其余是单位阵
+    Matrix4x4 ToMatrix() const;
     Transform ToTransform() const;
     Quaternion(const Transform& t);
 
@@ -56,7 +60,43 @@ struct Quaternion {
     float w;
 };
 
-Quaternion Slerp(float t, const Quaternion& q1, const Quaternion& t2);
+// 球面插值. 总是走最短的弧, 两个旋转很接近时退化成归一化的线性插值
+Quaternion Slerp(float t, const Quaternion& q1, const Quaternion& q2);
+
+// N 个四元数的 SoA 布局, 给大量运动模糊实例批量插值用
+template <int N>
+struct QuaternionSoA {
+    void Set(int i, const Quaternion& q) {
+        x[i] = q.v.x;
+        y[i] = q.v.y;
+        z[i] = q.v.z;
+        w[i] = q.w;
+    }
+    Quaternion Get(int i) const {
+        Quaternion q;
+        q.v = Vector(x[i], y[i], z[i]);
+        q.w = w[i];
+        return q;
+    }
+
+    alignas(32) float x[N];
+    alignas(32) float y[N];
+    alignas(32) float z[N];
+    alignas(32) float w[N];
+};
+
+typedef QuaternionSoA<4> Quaternion4;
+typedef QuaternionSoA<8> Quaternion8;
+
+// 每个 lane 用自己的 t 插值, 结果写到 out (可以和输入相同)
+template <int N>
+void Slerp(const float t[N],
+           const QuaternionSoA<N>& q1,
+           const QuaternionSoA<N>& q2,
+           QuaternionSoA<N>* out);
+// 每个 lane 的旋转矩阵, r[i][j] 是第 i 行第 j 列的 N 个值
+template <int N>
+void ToMatrices(const QuaternionSoA<N>& q, float r[3][3][N]);
 
 inline Quaternion operator*(float f, const Quaternion& q) {
     return q * f;
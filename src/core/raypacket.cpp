@@ -0,0 +1,121 @@
+#include "raypacket.h"
+
+// RayStream Method Definitions
+void RayStream::Clear() {
+    ox.clear();
+    oy.clear();
+    oz.clear();
+    dx.clear();
+    dy.clear();
+    dz.clear();
+    mint.clear();
+    maxt.clear();
+    time.clear();
+    depth.clear();
+    active.clear();
+    hasDifferentials.clear();
+    for (int axis = 0; axis < 3; ++axis) {
+        rxOrigin[axis].clear();
+        ryOrigin[axis].clear();
+        rxDirection[axis].clear();
+        ryDirection[axis].clear();
+    }
+}
+
+void RayStream::Reserve(int n) {
+    ox.reserve(n);
+    oy.reserve(n);
+    oz.reserve(n);
+    dx.reserve(n);
+    dy.reserve(n);
+    dz.reserve(n);
+    mint.reserve(n);
+    maxt.reserve(n);
+    time.reserve(n);
+    depth.reserve(n);
+    active.reserve(n);
+    hasDifferentials.reserve(n);
+    for (int axis = 0; axis < 3; ++axis) {
+        rxOrigin[axis].reserve(n);
+        ryOrigin[axis].reserve(n);
+        rxDirection[axis].reserve(n);
+        ryDirection[axis].reserve(n);
+    }
+}
+
+int RayStream::Add(const Ray& r) {
+    ox.push_back(r.o.x);
+    oy.push_back(r.o.y);
+    oz.push_back(r.o.z);
+    dx.push_back(r.d.x);
+    dy.push_back(r.d.y);
+    dz.push_back(r.d.z);
+    mint.push_back(r.mint);
+    maxt.push_back(r.maxt);
+    time.push_back(r.time);
+    depth.push_back(r.depth);
+    active.push_back(1);
+    // 微分数组和其他数组一样长, 没有微分的光线填 0
+    hasDifferentials.push_back(0);
+    for (int axis = 0; axis < 3; ++axis) {
+        rxOrigin[axis].push_back(0.f);
+        ryOrigin[axis].push_back(0.f);
+        rxDirection[axis].push_back(0.f);
+        ryDirection[axis].push_back(0.f);
+    }
+    return Size() - 1;
+}
+
+int RayStream::Add(const RayDifferential& r) {
+    int i = Add((const Ray&)r);
+    if (r.hasDifferentials)
+        Set(i, r);
+    return i;
+}
+
+void RayStream::Get(int i, RayDifferential* r) const {
+    *r = RayDifferential(Get(i));
+    r->hasDifferentials = hasDifferentials[i] != 0;
+    if (r->hasDifferentials) {
+        r->rxOrigin = Point(rxOrigin[0][i], rxOrigin[1][i], rxOrigin[2][i]);
+        r->ryOrigin = Point(ryOrigin[0][i], ryOrigin[1][i], ryOrigin[2][i]);
+        r->rxDirection =
+            Vector(rxDirection[0][i], rxDirection[1][i], rxDirection[2][i]);
+        r->ryDirection =
+            Vector(ryDirection[0][i], ryDirection[1][i], ryDirection[2][i]);
+    }
+}
+
+void RayStream::Set(int i, const Ray& r) {
+    ox[i] = r.o.x;
+    oy[i] = r.o.y;
+    oz[i] = r.o.z;
+    dx[i] = r.d.x;
+    dy[i] = r.d.y;
+    dz[i] = r.d.z;
+    mint[i] = r.mint;
+    maxt[i] = r.maxt;
+    time[i] = r.time;
+    depth[i] = r.depth;
+    hasDifferentials[i] = 0;
+}
+
+void RayStream::Set(int i, const RayDifferential& r) {
+    Set(i, (const Ray&)r);
+    hasDifferentials[i] = r.hasDifferentials;
+    if (r.hasDifferentials) {
+        for (int axis = 0; axis < 3; ++axis) {
+            rxOrigin[axis][i] = r.rxOrigin[axis];
+            ryOrigin[axis][i] = r.ryOrigin[axis];
+            rxDirection[axis][i] = r.rxDirection[axis];
+            ryDirection[axis][i] = r.ryDirection[axis];
+        }
+    }
+}
+
+int RayStream::NumActive() const {
+    int n = 0;
+    for (uint32_t i = 0; i < active.size(); ++i)
+        n += active[i] != 0;
+    return n;
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "geometry.h"
+#include "pbrt.h"
+#include "transform.h"
+#ifdef PBRT_HAS_SSE
+#include <xmmintrin.h>
+#endif
+
+// N 条光线的 SoA 光线包. 主光线和阴影光线高度相干, 一个包可以一起遍历.
+// active 的第 i 位表示第 i 条光线是否还在参与计算
+template <int N>
+struct RayPacket {
+    RayPacket() : active(0), hasDifferentials(0) {}
+
+    static int Size() { return N; }
+    static int AllLanes() { return N == 32 ? ~0 : (1 << N) - 1; }
+
+    void Set(int i, const Ray& r) {
+        ox[i] = r.o.x;
+        oy[i] = r.o.y;
+        oz[i] = r.o.z;
+        dx[i] = r.d.x;
+        dy[i] = r.d.y;
+        dz[i] = r.d.z;
+        mint[i] = r.mint;
+        maxt[i] = r.maxt;
+        time[i] = r.time;
+        depth[i] = r.depth;
+        UpdateInverseDirection(i);
+        active |= 1 << i;
+        hasDifferentials &= ~(1 << i);
+    }
+
+    void Set(int i, const RayDifferential& r) {
+        Set(i, (const Ray&)r);
+        if (r.hasDifferentials) {
+            hasDifferentials |= 1 << i;
+            rxOrigin[0][i] = r.rxOrigin.x;
+            rxOrigin[1][i] = r.rxOrigin.y;
+            rxOrigin[2][i] = r.rxOrigin.z;
+            ryOrigin[0][i] = r.ryOrigin.x;
+            ryOrigin[1][i] = r.ryOrigin.y;
+            ryOrigin[2][i] = r.ryOrigin.z;
+            rxDirection[0][i] = r.rxDirection.x;
+            rxDirection[1][i] = r.rxDirection.y;
+            rxDirection[2][i] = r.rxDirection.z;
+            ryDirection[0][i] = r.ryDirection.x;
+            ryDirection[1][i] = r.ryDirection.y;
+            ryDirection[2][i] = r.ryDirection.z;
+        }
+    }
+
+    Ray Get(int i) const {
+        return Ray(Point(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]),
+                   mint[i], maxt[i], time[i], depth[i]);
+    }
+
+    void Get(int i, RayDifferential* r) const {
+        *r = RayDifferential(Get(i));
+        r->hasDifferentials = (hasDifferentials & (1 << i)) != 0;
+        if (r->hasDifferentials) {
+            r->rxOrigin = Point(rxOrigin[0][i], rxOrigin[1][i], rxOrigin[2][i]);
+            r->ryOrigin = Point(ryOrigin[0][i], ryOrigin[1][i], ryOrigin[2][i]);
+            r->rxDirection =
+                Vector(rxDirection[0][i], rxDirection[1][i], rxDirection[2][i]);
+            r->ryDirection =
+                Vector(ryDirection[0][i], ryDirection[1][i], ryDirection[2][i]);
+        }
+    }
+
+    void UpdateInverseDirection(int i) {
+        invDx[i] = 1.f / dx[i];
+        invDy[i] = 1.f / dy[i];
+        invDz[i] = 1.f / dz[i];
+    }
+
+    bool IsActive(int i) const { return (active & (1 << i)) != 0; }
+    bool AnyActive() const { return active != 0; }
+
+    alignas(32) float ox[N];
+    alignas(32) float oy[N];
+    alignas(32) float oz[N];
+    alignas(32) float dx[N];
+    alignas(32) float dy[N];
+    alignas(32) float dz[N];
+    // 方向的倒数, Set() 和变换时更新, 包围盒测试不再做除法
+    alignas(32) float invDx[N];
+    alignas(32) float invDy[N];
+    alignas(32) float invDz[N];
+    alignas(32) float mint[N];
+    alignas(32) float maxt[N];
+    alignas(32) float time[N];
+    alignas(32) int depth[N];
+    int active;
+    // 微分光线, 只有 hasDifferentials 对应位为 1 的 lane 有效
+    int hasDifferentials;
+    alignas(32) float rxOrigin[3][N];
+    alignas(32) float ryOrigin[3][N];
+    alignas(32) float rxDirection[3][N];
+    alignas(32) float ryDirection[3][N];
+};
+
+typedef RayPacket<8> RayPacket8;
+typedef RayPacket<16> RayPacket16;
+
+// 不限长度的 SoA 光线流, 用来收集一批光线再按包取出来
+class RayStream {
+   public:
+    int Size() const { return (int)ox.size(); }
+    void Clear();
+    void Reserve(int n);
+    int Add(const Ray& r);
+    // 带微分的光线, 没有微分时和 Add(const Ray&) 一样
+    int Add(const RayDifferential& r);
+    Ray Get(int i) const {
+        return Ray(Point(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]),
+                   mint[i], maxt[i], time[i], depth[i]);
+    }
+    void Get(int i, RayDifferential* r) const;
+    void Set(int i, const Ray& r);
+    void Set(int i, const RayDifferential& r);
+    bool HasDifferentials(int i) const { return hasDifferentials[i] != 0; }
+    bool IsActive(int i) const { return active[i] != 0; }
+    void SetActive(int i, bool a) { active[i] = a; }
+    int NumActive() const;
+
+    // 从 start 开始取最多 N 条光线组成一个包, 返回取到的条数.
+    // 不活跃的光线在包里也标成不活跃, 微分跟着光线一起进包
+    template <int N>
+    int GetPacket(int start, RayPacket<N>* packet) const {
+        int count = min(N, Size() - start);
+        packet->active = 0;
+        packet->hasDifferentials = 0;
+        for (int i = 0; i < count; ++i) {
+            RayDifferential r;
+            Get(start + i, &r);
+            packet->Set(i, r);
+            if (!active[start + i])
+                packet->active &= ~(1 << i);
+        }
+        return count;
+    }
+
+    // 把包的结果写回流里, 比如求交后更新的 maxt 和活跃状态
+    template <int N>
+    void SetPacket(int start, const RayPacket<N>& packet) {
+        int count = min(N, Size() - start);
+        for (int i = 0; i < count; ++i) {
+            RayDifferential r;
+            packet.Get(i, &r);
+            Set(start + i, r);
+            active[start + i] = packet.IsActive(i);
+        }
+    }
+
+   private:
+    vector<float> ox, oy, oz;
+    vector<float> dx, dy, dz;
+    vector<float> mint, maxt, time;
+    vector<int> depth;
+    vector<char> active;
+    // 微分光线, 只有 hasDifferentials[i] 不为 0 的光线有效
+    vector<char> hasDifferentials;
+    vector<float> rxOrigin[3], ryOrigin[3];
+    vector<float> rxDirection[3], ryDirection[3];
+};
+
+// 一个包围盒对 N 条光线的 slab 测试, 返回命中掩码 (已经和 active 相与)
+template <int N>
+int BBox::IntersectP(const RayPacket<N>& rays, float tNear[N]) const {
+    int mask = 0;
+    int i = 0;
+#ifdef PBRT_HAS_SSE
+    const __m128 minX = _mm_set1_ps(pMin.x), minY = _mm_set1_ps(pMin.y),
+                 minZ = _mm_set1_ps(pMin.z);
+    const __m128 maxX = _mm_set1_ps(pMax.x), maxY = _mm_set1_ps(pMax.y),
+                 maxZ = _mm_set1_ps(pMax.z);
+    const __m128 tMaxScale = _mm_set1_ps(BBOX_TMAX_SCALE);
+    for (; i + 4 <= N; i += 4) {
+        __m128 ox = _mm_load_ps(rays.ox + i), oy = _mm_load_ps(rays.oy + i),
+               oz = _mm_load_ps(rays.oz + i);
+        __m128 ix = _mm_load_ps(rays.invDx + i),
+               iy = _mm_load_ps(rays.invDy + i),
+               iz = _mm_load_ps(rays.invDz + i);
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(minX, ox), ix);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(maxX, ox), ix);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(minY, oy), iy);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(maxY, oy), iy);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(minZ, oz), iz);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz);
+        // 每条光线方向不同, 用 min/max 代替按符号选平面
+        __m128 t0 = _mm_max_ps(
+            _mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+            _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_load_ps(rays.mint + i)));
+        // 远端距离和 TraversalRay 的测试一样放大 BBOX_TMAX_SCALE
+        __m128 tFar =
+            _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                       _mm_max_ps(tz0, tz1));
+        __m128 t1 = _mm_min_ps(_mm_mul_ps(tFar, tMaxScale),
+                               _mm_load_ps(rays.maxt + i));
+        _mm_storeu_ps(tNear + i, t0);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+    }
+#endif
+    for (; i < N; ++i) {
+        float tx0 = (pMin.x - rays.ox[i]) * rays.invDx[i];
+        float tx1 = (pMax.x - rays.ox[i]) * rays.invDx[i];
+        float ty0 = (pMin.y - rays.oy[i]) * rays.invDy[i];
+        float ty1 = (pMax.y - rays.oy[i]) * rays.invDy[i];
+        float tz0 = (pMin.z - rays.oz[i]) * rays.invDz[i];
+        float tz1 = (pMax.z - rays.oz[i]) * rays.invDz[i];
+        float t0 = max(max(min(tx0, tx1), min(ty0, ty1)),
+                       max(min(tz0, tz1), rays.mint[i]));
+        float tFar = min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1));
+        float t1 = min(tFar * BBOX_TMAX_SCALE, rays.maxt[i]);
+        tNear[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+    return mask & rays.active;
+}
+
+// 光线包的变换, 对所有 lane 做, 不管是否活跃
+template <typename XForm, int N>
+inline void TransformRayPacket(const XForm& t,
+                               const RayPacket<N>& r,
+                               RayPacket<N>* rt) {
+    for (int i = 0; i < N; ++i) {
+        Point o;
+        Vector d;
+        t(Point(r.ox[i], r.oy[i], r.oz[i]), &o);
+        t(Vector(r.dx[i], r.dy[i], r.dz[i]), &d);
+        rt->ox[i] = o.x;
+        rt->oy[i] = o.y;
+        rt->oz[i] = o.z;
+        rt->dx[i] = d.x;
+        rt->dy[i] = d.y;
+        rt->dz[i] = d.z;
+        rt->UpdateInverseDirection(i);
+        if (r.hasDifferentials & (1 << i)) {
+            for (int k = 0; k < 2; ++k) {
+                const float(*so)[N] = k == 0 ? r.rxOrigin : r.ryOrigin;
+                const float(*sd)[N] = k == 0 ? r.rxDirection : r.ryDirection;
+                float(*doo)[N] = k == 0 ? rt->rxOrigin : rt->ryOrigin;
+                float(*dd)[N] = k == 0 ? rt->rxDirection : rt->ryDirection;
+                Point po = t(Point(so[0][i], so[1][i], so[2][i]));
+                Vector pd = t(Vector(sd[0][i], sd[1][i], sd[2][i]));
+                doo[0][i] = po.x;
+                doo[1][i] = po.y;
+                doo[2][i] = po.z;
+                dd[0][i] = pd.x;
+                dd[1][i] = pd.y;
+                dd[2][i] = pd.z;
+            }
+        }
+    }
+    if (rt != &r) {
+        for (int i = 0; i < N; ++i) {
+            rt->mint[i] = r.mint[i];
+            rt->maxt[i] = r.maxt[i];
+            rt->time[i] = r.time[i];
+            rt->depth[i] = r.depth[i];
+        }
+        rt->active = r.active;
+        rt->hasDifferentials = r.hasDifferentials;
+    }
+}
+
+template <int N>
+void Transform::operator()(const RayPacket<N>& r, RayPacket<N>* rt) const {
+    TransformRayPacket(*this, r, rt);
+}
+
+template <int N>
+void AffineTransform::operator()(const RayPacket<N>& r,
+                                 RayPacket<N>* rt) const {
+    TransformRayPacket(*this, r, rt);
+}
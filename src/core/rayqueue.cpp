@@ -0,0 +1,77 @@
+#include "rayqueue.h"
+#include "probes.h"
+#include <algorithm>
+
+// 排序键: 最高 3 位是方向的卦限, 然后是起点的 30 位 Morton 码,
+// 最低 31 位是光线的下标, 键相同时保持加入的顺序
+static const int rayIndexBits = 31;
+
+RayQueue::RayQueue(const Shape* s, uint32_t n, bool sort)
+    : scene(s), sortRays(sort) {
+    sceneBound = scene->WorldBound();
+    // 扁平的轴撑开一点, 免得 Offset 除以零
+    for (int axis = 0; axis < 3; ++axis)
+        if (!(sceneBound.pMax[axis] > sceneBound.pMin[axis]))
+            sceneBound.pMax[axis] = sceneBound.pMin[axis] + 1.f;
+    SetBatchSize(min(n, 1u << rayIndexBits));
+    rays.Reserve(batchSize);
+}
+
+void RayQueue::sort() {
+    uint32_t n = Size();
+    order.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t key = 0;
+        if (sortRays) {
+            Ray r = rays.Get(i);
+            uint32_t octant = (r.d.x < 0.f) | ((r.d.y < 0.f) << 1) |
+                              ((r.d.z < 0.f) << 2);
+            // 包围盒外面的起点夹到边上
+            uint32_t code = EncodeMorton3(sceneBound.Offset(r.o));
+            key = (uint64_t(octant) << 30) | code;
+        }
+        order[i] = (key << rayIndexBits) | i;
+    }
+    if (sortRays)
+        std::sort(order.begin(), order.end());
+}
+
+void RayQueue::Intersect(vector<RayQueueHit>* hits,
+                         vector<RayDifferential>* traced) {
+    uint32_t n = Size();
+    hits->resize(n);
+    if (traced)
+        traced->resize(n);
+    sort();
+    PBRT_RAY_QUEUE_STARTED_BATCH(this, n, sortRays);
+    const uint64_t indexMask = (uint64_t(1) << rayIndexBits) - 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t index = uint32_t(order[i] & indexMask);
+        PBRT_RAY_QUEUE_STARTED_RAY(this, i);
+        RayQueueHit& h = (*hits)[index];
+        if (traced) {
+            RayDifferential& r = (*traced)[index];
+            rays.Get(index, &r);
+            h.hit = scene->Intersect(r, &h.tHit, &h.rayEpsilon, &h.dg);
+        } else
+            h.hit = scene->Intersect(rays.Get(index), &h.tHit, &h.rayEpsilon,
+                                     &h.dg);
+    }
+    PBRT_RAY_QUEUE_FINISHED_BATCH(this, n);
+    rays.Clear();
+}
+
+void RayQueue::IntersectP(vector<char>* occluded) {
+    uint32_t n = Size();
+    occluded->resize(n);
+    sort();
+    PBRT_RAY_QUEUE_STARTED_BATCH(this, n, sortRays);
+    const uint64_t indexMask = (uint64_t(1) << rayIndexBits) - 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t index = uint32_t(order[i] & indexMask);
+        PBRT_RAY_QUEUE_STARTED_RAY(this, i);
+        (*occluded)[index] = scene->IntersectP(rays.Get(index));
+    }
+    PBRT_RAY_QUEUE_FINISHED_BATCH(this, n);
+    rays.Clear();
+}
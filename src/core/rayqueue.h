@@ -0,0 +1,61 @@
+#pragma once
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "diffgeom.h"
+#include "raypacket.h"
+#include "shape.h"
+
+// 一批光线里默认的条数
+static const uint32_t RAY_QUEUE_DEFAULT_BATCH_SIZE = 64 * 1024;
+
+// 一条光线的最近命中
+struct RayQueueHit {
+    bool hit;
+    float tHit, rayEpsilon;
+    DifferentialGeometry dg;
+};
+
+// 次级光线的重排队列. 弹射出去的光线方向杂乱, 逐条追踪时相邻两条
+// 走的是场景里完全不同的节点, 缓存总是失效. 队列先攒一大批光线,
+// 按方向所在的卦限和起点在场景包围盒里的 Morton 码排序, 按排好的
+// 顺序追踪, 结果再按加入的顺序 (像素顺序) 交回.
+// 追踪在调用者的线程里进行, 不发任务, 每个渲染线程用自己的队列
+class RayQueue {
+   public:
+    // sortRays 为 false 时按加入的顺序追踪, 用来和排序后比较
+    RayQueue(const Shape* scene,
+             uint32_t batchSize = RAY_QUEUE_DEFAULT_BATCH_SIZE,
+             bool sortRays = true);
+
+    uint32_t BatchSize() const { return batchSize; }
+    void SetBatchSize(uint32_t n) { batchSize = max(n, 1u); }
+    uint32_t Size() const { return (uint32_t)rays.Size(); }
+    bool Full() const { return Size() >= batchSize; }
+
+    // 返回光线在这一批里的下标, 结果按它存放
+    uint32_t Add(const Ray& ray) { return (uint32_t)rays.Add(ray); }
+    // 微分和光线一起存在队列里
+    uint32_t Add(const RayDifferential& ray) {
+        return (uint32_t)rays.Add(ray);
+    }
+    // 追踪队列里所有的光线, (*hits)[i] 是第 i 条加入的光线的结果.
+    // traced 不为 NULL 时 (*traced)[i] 是追踪过的第 i 条光线, 带着
+    // 加入时的微分和缩短后的 maxt, 给算纹理微分用. 追踪完清空队列
+    void Intersect(vector<RayQueueHit>* hits,
+                   vector<RayDifferential>* traced = NULL);
+    // 阴影光线只问有没有遮挡, (*occluded)[i] 对应第 i 条
+    void IntersectP(vector<char>* occluded);
+
+   private:
+    // 把 order 排成追踪的顺序
+    void sort();
+
+    const Shape* scene;
+    BBox sceneBound;
+    uint32_t batchSize;
+    bool sortRays;
+    RayStream rays;
+    // 追踪顺序, 每一项的低 31 位是光线的下标, 上面是排序键
+    vector<uint64_t> order;
+};
@@ -0,0 +1,59 @@
+#include "shape.h"
+
+Shape::Shape(const AffineTransform* o2w, const AffineTransform* w2o, bool ro)
+    : ObjectToWorld(o2w),
+      WorldToObject(w2o),
+      ReverseOrientation(ro),
+      TransformSwapsHandedness(o2w->SwapsHandedness()) {}
+
+static const AffineTransform identityTransform;
+
+Shape::Shape()
+    : ObjectToWorld(&identityTransform),
+      WorldToObject(&identityTransform),
+      ReverseOrientation(false),
+      TransformSwapsHandedness(false) {}
+
+Shape::~Shape() {}
+
+BBox Shape::WorldBound() const {
+    return (*ObjectToWorld)(objectBound());
+}
+
+bool Shape::CanIntersect() const {
+    return true;
+}
+
+void Shape::Refine(vector<Reference<Shape>>& refined) const {
+    fprintf(stderr, "Unimplemented Shape::Refine() method called\n");
+}
+
+void Shape::FullyRefine(vector<Reference<Shape>>& refined) const {
+    vector<Reference<Shape>> todo;
+    todo.push_back(const_cast<Shape*>(this));
+    while (todo.size()) {
+        Reference<Shape> shape = todo.back();
+        todo.pop_back();
+        if (shape->CanIntersect())
+            refined.push_back(shape);
+        else
+            shape->Refine(todo);
+    }
+}
+
+bool Shape::Intersect(const Ray& ray,
+                      float* tHit,
+                      float* rayEpsilon,
+                      DifferentialGeometry* dg) const {
+    fprintf(stderr, "Unimplemented Shape::Intersect() method called\n");
+    return false;
+}
+
+bool Shape::IntersectP(const Ray& ray) const {
+    fprintf(stderr, "Unimplemented Shape::IntersectP() method called\n");
+    return false;
+}
+
+size_t Shape::MemoryUsage() const {
+    return sizeof(Shape);
+}
@@ -1,21 +1,35 @@
 #pragma once
 
 #include "memory.h"
-#include "Shape.h"
 #include "transform.h"
 #include "geometry.h"
+#include "diffgeom.h"
 #include "pbrt.h"
-class Shape : ReferenceCounted {
+class Shape : public ReferenceCounted {
    private:
     /* data */
    public:
-    Shape(const Transform* o2w, const Transform* w2o, bool ro);
+    // 形状的变换总是仿射的, 用紧凑的 AffineTransform 存
+    Shape(const AffineTransform* o2w, const AffineTransform* w2o, bool ro);
+    // 聚合体这类本身就在世界空间的形状, 变换是单位变换
+    Shape();
     virtual ~Shape();
     // 纯虚函数 真正没有被调用
     virtual BBox objectBound() const = 0;
     // 虚函数 但是可以调用子类的方法
     virtual BBox WorldBound() const;
     virtual bool CanIntersect() const;
-    virtual void Refine(Shape &refined) const;
-    virtual bool Intersect () const;
+    // 不能直接求交的形状把自己细分成一组新的形状
+    virtual void Refine(vector<Reference<Shape>> &refined) const;
+    // 反复细分, 直到每个形状都能求交
+    void FullyRefine(vector<Reference<Shape>> &refined) const;
+    // ray 在世界空间; 命中时写入 tHit, 自相交用的 rayEpsilon 和 *dg
+    virtual bool Intersect(const Ray &ray, float *tHit, float *rayEpsilon,
+                           DifferentialGeometry *dg) const;
+    virtual bool IntersectP(const Ray &ray) const;
+    // 粗略的内存占用, 延迟细分的内存预算按它算
+    virtual size_t MemoryUsage() const;
+
+    const AffineTransform *ObjectToWorld, *WorldToObject;
+    const bool ReverseOrientation, TransformSwapsHandedness;
 };
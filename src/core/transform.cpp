@@ -1,4 +1,9 @@
 #include "transform.h"
+#include "parallel.h"
+#include "memory.h"
+#ifdef PBRT_HAS_SSE
+#include <xmmintrin.h>
+#endif
 
 Matrix4x4::Matrix4x4(float mat[4][4]) {
     memcpy(m, mat, 16 * sizeof(float));
@@ -39,68 +44,975 @@ Matrix4x4::Matrix4x4(float t00,
 }
 
 Matrix4x4 Transpose(const Matrix4x4& m) {
+#ifdef PBRT_HAS_SSE
+    Matrix4x4 r;
+    __m128 r0 = _mm_load_ps(m.m[0]), r1 = _mm_load_ps(m.m[1]);
+    __m128 r2 = _mm_load_ps(m.m[2]), r3 = _mm_load_ps(m.m[3]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_store_ps(r.m[0], r0);
+    _mm_store_ps(r.m[1], r1);
+    _mm_store_ps(r.m[2], r2);
+    _mm_store_ps(r.m[3], r3);
+    return r;
+#else
     return Matrix4x4(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0], m.m[0][1],
                      m.m[1][1], m.m[2][1], m.m[3][1], m.m[0][2], m.m[1][2],
                      m.m[2][2], m.m[3][2], m.m[0][3], m.m[1][3], m.m[2][3],
                      m.m[3][3]);
+#endif
+}
+
+Matrix4x4 Matrix4x4::Mul(const Matrix4x4& m1, const Matrix4x4& m2) {
+    Matrix4x4 r;
+#ifdef PBRT_HAS_SSE
+    // r 的第 i 行 = sum_k m1[i][k] * (m2 的第 k 行)
+    __m128 b0 = _mm_load_ps(m2.m[0]), b1 = _mm_load_ps(m2.m[1]);
+    __m128 b2 = _mm_load_ps(m2.m[2]), b3 = _mm_load_ps(m2.m[3]);
+    for (int i = 0; i < 4; ++i) {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(m1.m[i][0]), b0);
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m1.m[i][1]), b1));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m1.m[i][2]), b2));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m1.m[i][3]), b3));
+        _mm_store_ps(r.m[i], row);
+    }
+#else
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            r.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][1] * m2.m[1][j] +
+                        m1.m[i][2] * m2.m[2][j] + m1.m[i][3] * m2.m[3][j];
+#endif
+    return r;
+}
+
+#ifdef PBRT_HAS_SSE
+// a x b 的前三个分量, 第四个 lane 没有意义
+static inline __m128 cross3(__m128 a, __m128 b) {
+    __m128 a1 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b1 = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 a2 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 b2 = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    return _mm_sub_ps(_mm_mul_ps(a1, b2), _mm_mul_ps(a2, b1));
+}
+#endif
+
+bool InverseAffine(const Matrix4x4& m, Matrix4x4* inv) {
+#ifdef PBRT_HAS_SSE
+    // 3x3 部分的行是 r0..r2, 它的逆的第 j 列是 c_j / det,
+    // 其中 c0 = r1 x r2, c1 = r2 x r0, c2 = r0 x r1.
+    // 第四个 lane 装的是平移, 算完只落到第四行, 而第四行最后直接写 0 0 0 1.
+    // 所有输入都先读进寄存器, inv 和 m 是同一个矩阵也没关系
+    __m128 r0 = _mm_load_ps(m.m[0]), r1 = _mm_load_ps(m.m[1]);
+    __m128 r2 = _mm_load_ps(m.m[2]);
+    __m128 t0 = _mm_shuffle_ps(r0, r0, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 t1 = _mm_shuffle_ps(r1, r1, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 t2 = _mm_shuffle_ps(r2, r2, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 c0 = cross3(r1, r2), c1 = cross3(r2, r0), c2 = cross3(r0, r1);
+    alignas(16) float cofactor[4];
+    _mm_store_ps(cofactor, c0);
+    float det = m.m[0][0] * cofactor[0] + m.m[0][1] * cofactor[1] +
+                m.m[0][2] * cofactor[2];
+    if (det == 0.f || isnan(det))
+        return false;
+    __m128 invDet = _mm_set1_ps(1.f / det);
+
+    // 平移部分: t' = -R^-1 * t = -(c0 t0 + c1 t1 + c2 t2) / det.
+    // 转置后 c_j 成为列, -T 成为第四列
+    __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, t0), _mm_mul_ps(c1, t1)),
+                          _mm_mul_ps(c2, t2));
+    __m128 c3 = _mm_sub_ps(_mm_setzero_ps(), t);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    _mm_store_ps(inv->m[0], _mm_mul_ps(c0, invDet));
+    _mm_store_ps(inv->m[1], _mm_mul_ps(c1, invDet));
+    _mm_store_ps(inv->m[2], _mm_mul_ps(c2, invDet));
+    _mm_store_ps(inv->m[3], _mm_set_ps(1.f, 0.f, 0.f, 0.f));
+    return true;
+#else
+    // 3x3 部分的余子式
+    float c00 = m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1];
+    float c01 = m.m[1][2] * m.m[2][0] - m.m[1][0] * m.m[2][2];
+    float c02 = m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0];
+    float det = m.m[0][0] * c00 + m.m[0][1] * c01 + m.m[0][2] * c02;
+    if (det == 0.f || isnan(det))
+        return false;
+    float invDet = 1.f / det;
+
+    Matrix4x4 r;
+    r.m[0][0] = c00 * invDet;
+    r.m[1][0] = c01 * invDet;
+    r.m[2][0] = c02 * invDet;
+    r.m[0][1] = (m.m[0][2] * m.m[2][1] - m.m[0][1] * m.m[2][2]) * invDet;
+    r.m[1][1] = (m.m[0][0] * m.m[2][2] - m.m[0][2] * m.m[2][0]) * invDet;
+    r.m[2][1] = (m.m[0][1] * m.m[2][0] - m.m[0][0] * m.m[2][1]) * invDet;
+    r.m[0][2] = (m.m[0][1] * m.m[1][2] - m.m[0][2] * m.m[1][1]) * invDet;
+    r.m[1][2] = (m.m[0][2] * m.m[1][0] - m.m[0][0] * m.m[1][2]) * invDet;
+    r.m[2][2] = (m.m[0][0] * m.m[1][1] - m.m[0][1] * m.m[1][0]) * invDet;
+
+    // 平移部分: t' = -R^-1 * t
+    for (int i = 0; i < 3; ++i)
+        r.m[i][3] = -(r.m[i][0] * m.m[0][3] + r.m[i][1] * m.m[1][3] +
+                      r.m[i][2] * m.m[2][3]);
+    *inv = r;
+    return true;
+#endif
+}
+
+bool Inverse(const Matrix4x4& mat, Matrix4x4* inv) {
+    if (mat.IsAffine())
+        return InverseAffine(mat, inv);
+#ifdef PBRT_HAS_SSE
+    // 余子式法 (Cramer's rule), 按 Intel AP-928 的 SSE 排布
+    const float* src = &mat.m[0][0];
+    __m128 minor0, minor1, minor2, minor3;
+    __m128 row0, row1, row2, row3, det, tmp1;
+
+    // 先转置: row0..row3 是原矩阵的列
+    tmp1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src)),
+                        (const __m64*)(src + 4));
+    row1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 8)),
+                        (const __m64*)(src + 12));
+    row0 = _mm_shuffle_ps(tmp1, row1, 0x88);
+    row1 = _mm_shuffle_ps(row1, tmp1, 0xDD);
+    tmp1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 2)),
+                        (const __m64*)(src + 6));
+    row3 = _mm_loadh_pi(
+        _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(src + 10)),
+        (const __m64*)(src + 14));
+    row2 = _mm_shuffle_ps(tmp1, row3, 0x88);
+    row3 = _mm_shuffle_ps(row3, tmp1, 0xDD);
+
+    tmp1 = _mm_mul_ps(row2, row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor0 = _mm_mul_ps(row1, tmp1);
+    minor1 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(_mm_mul_ps(row1, tmp1), minor0);
+    minor1 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor1);
+    minor1 = _mm_shuffle_ps(minor1, minor1, 0x4E);
+
+    tmp1 = _mm_mul_ps(row1, row2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor0 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor0);
+    minor3 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row3, tmp1));
+    minor3 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor3);
+    minor3 = _mm_shuffle_ps(minor3, minor3, 0x4E);
+
+    tmp1 = _mm_mul_ps(_mm_shuffle_ps(row1, row1, 0x4E), row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    row2 = _mm_shuffle_ps(row2, row2, 0x4E);
+    minor0 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor0);
+    minor2 = _mm_mul_ps(row0, tmp1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row2, tmp1));
+    minor2 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor2);
+    minor2 = _mm_shuffle_ps(minor2, minor2, 0x4E);
+
+    tmp1 = _mm_mul_ps(row0, row1);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor2 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor2);
+    minor3 = _mm_sub_ps(_mm_mul_ps(row2, tmp1), minor3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor2 = _mm_sub_ps(_mm_mul_ps(row3, tmp1), minor2);
+    minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row2, tmp1));
+
+    tmp1 = _mm_mul_ps(row0, row3);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row2, tmp1));
+    minor2 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor1 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor1);
+    minor2 = _mm_sub_ps(minor2, _mm_mul_ps(row1, tmp1));
+
+    tmp1 = _mm_mul_ps(row0, row2);
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+    minor1 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor1);
+    minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row1, tmp1));
+    tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+    minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row3, tmp1));
+    minor3 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor3);
+
+    // 行列式 = row0 . minor0
+    det = _mm_mul_ps(row0, minor0);
+    det = _mm_add_ps(_mm_shuffle_ps(det, det, 0x4E), det);
+    det = _mm_add_ss(_mm_shuffle_ps(det, det, 0xB1), det);
+    float d = _mm_cvtss_f32(det);
+    if (d == 0.f || isnan(d))
+        return false;
+    det = _mm_set1_ps(1.f / d);
+
+    _mm_store_ps(inv->m[0], _mm_mul_ps(det, minor0));
+    _mm_store_ps(inv->m[1], _mm_mul_ps(det, minor1));
+    _mm_store_ps(inv->m[2], _mm_mul_ps(det, minor2));
+    _mm_store_ps(inv->m[3], _mm_mul_ps(det, minor3));
+    return true;
+#else
+    // 用 2x2 子行列式展开的余子式法, 没有主元搜索和分支
+    const float(*a)[4] = mat.m;
+    float s0 = a[0][0] * a[1][1] - a[1][0] * a[0][1];
+    float s1 = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+    float s2 = a[0][0] * a[1][3] - a[1][0] * a[0][3];
+    float s3 = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+    float s4 = a[0][1] * a[1][3] - a[1][1] * a[0][3];
+    float s5 = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+    float c5 = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+    float c4 = a[2][1] * a[3][3] - a[3][1] * a[2][3];
+    float c3 = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+    float c2 = a[2][0] * a[3][3] - a[3][0] * a[2][3];
+    float c1 = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+    float c0 = a[2][0] * a[3][1] - a[3][0] * a[2][1];
+    float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+    if (det == 0.f || isnan(det))
+        return false;
+    float invDet = 1.f / det;
+
+    Matrix4x4 ret;
+    float(*r)[4] = ret.m;
+    r[0][0] = (a[1][1] * c5 - a[1][2] * c4 + a[1][3] * c3) * invDet;
+    r[0][1] = (-a[0][1] * c5 + a[0][2] * c4 - a[0][3] * c3) * invDet;
+    r[0][2] = (a[3][1] * s5 - a[3][2] * s4 + a[3][3] * s3) * invDet;
+    r[0][3] = (-a[2][1] * s5 + a[2][2] * s4 - a[2][3] * s3) * invDet;
+    r[1][0] = (-a[1][0] * c5 + a[1][2] * c2 - a[1][3] * c1) * invDet;
+    r[1][1] = (a[0][0] * c5 - a[0][2] * c2 + a[0][3] * c1) * invDet;
+    r[1][2] = (-a[3][0] * s5 + a[3][2] * s2 - a[3][3] * s1) * invDet;
+    r[1][3] = (a[2][0] * s5 - a[2][2] * s2 + a[2][3] * s1) * invDet;
+    r[2][0] = (a[1][0] * c4 - a[1][1] * c2 + a[1][3] * c0) * invDet;
+    r[2][1] = (-a[0][0] * c4 + a[0][1] * c2 - a[0][3] * c0) * invDet;
+    r[2][2] = (a[3][0] * s4 - a[3][1] * s2 + a[3][3] * s0) * invDet;
+    r[2][3] = (-a[2][0] * s4 + a[2][1] * s2 - a[2][3] * s0) * invDet;
+    r[3][0] = (-a[1][0] * c3 + a[1][1] * c1 - a[1][2] * c0) * invDet;
+    r[3][1] = (a[0][0] * c3 - a[0][1] * c1 + a[0][2] * c0) * invDet;
+    r[3][2] = (-a[3][0] * s3 + a[3][1] * s1 - a[3][2] * s0) * invDet;
+    r[3][3] = (a[2][0] * s3 - a[2][1] * s1 + a[2][2] * s0) * invDet;
+    *inv = ret;
+    return true;
+#endif
 }
 
 Matrix4x4 Inverse(const Matrix4x4& m) {
-    int indxc[4], indxr[4];
-    int ipiv[4] = {0, 0, 0, 0};
-    float minv[4][4];
-    memcpy(minv, m.m, 4 * 4 * sizeof(float));
-    for (int i = 0; i < 4; i++) {
-        int irow = -1, icol = -1;
-        float big = 0.;
-        // Choose pivot
-        for (int j = 0; j < 4; j++) {
-            if (ipiv[j] != 1) {
-                for (int k = 0; k < 4; k++) {
-                    if (ipiv[k] == 0) {
-                        if (fabsf(minv[j][k]) >= big) {
-                            big = float(fabsf(minv[j][k]));
-                            irow = j;
-                            icol = k;
-                        }
-                    } else if (ipiv[k] > 1)
-                        printf("Singular matrix in MatrixInvert");
-                }
-            }
+    Matrix4x4 r;
+    if (!Inverse(m, &r))
+        fprintf(stderr, "Singular matrix in MatrixInvert\n");
+    return r;
+}
+
+// 批量变换
+// 少于这个数量时直接在调用线程里做, 不值得开任务
+static const int TRANSFORM_PARALLEL_THRESHOLD = 64 * 1024;
+static const int TRANSFORM_CHUNK_SIZE = 16 * 1024;
+
+// 一次批量变换的所有块. 调用者和任务从同一个计数器上领块, 调用者
+// 自己也领, 所以它只等别的线程上正在做的块, 不等排在后面的任务,
+// 在任务里调用也不会等到自己. 任务可能在调用返回以后才轮到, 那时
+// 已经领不到块, 直接返回; 这个对象靠引用计数活到最后一个任务结束
+template <typename Func>
+class TransformChunks : public ReferenceCounted {
+   public:
+    TransformChunks(const Func& f, int n)
+        : func(f),
+          n(n),
+          nChunks((n + TRANSFORM_CHUNK_SIZE - 1) / TRANSFORM_CHUNK_SIZE) {
+        nextChunk = 0;
+        nFinished = 0;
+    }
+    int32_t NumChunks() const { return nChunks; }
+    // 领一块做掉, 已经领完时返回 false
+    bool RunChunk() {
+        int32_t c = AtomicAdd(&nextChunk, 1) - 1;
+        if (c >= nChunks)
+            return false;
+        int start = c * TRANSFORM_CHUNK_SIZE;
+        func(start, min(start + TRANSFORM_CHUNK_SIZE, n));
+        AtomicAdd(&nFinished, 1);
+        return true;
+    }
+    bool Finished() const { return nFinished == nChunks; }
+
+   private:
+    Func func;
+    int n;
+    int32_t nChunks;
+    AtomicInt32 nextChunk, nFinished;
+};
+
+// 调用者不等任务, 所以任务做完自己删除自己
+template <typename Func>
+class TransformChunkTask : public Task {
+   public:
+    TransformChunkTask(TransformChunks<Func>* c) : chunks(c) {}
+    void Run() {
+        while (chunks->RunChunk())
+            ;
+        delete this;
+    }
+
+   private:
+    Reference<TransformChunks<Func>> chunks;
+};
+
+template <typename Func>
+static void TransformChunked(int n, const Func& func) {
+    if (n < TRANSFORM_PARALLEL_THRESHOLD) {
+        func(0, n);
+        return;
+    }
+    TransformChunks<Func>* chunks = new TransformChunks<Func>(func, n);
+    // 调用者和每个任务各持一个引用
+    Reference<TransformChunks<Func>> ref(chunks);
+    // 调用者自己也做, 少开一个任务
+    int nTasks = min(chunks->NumChunks(), NumSystemCores()) - 1;
+    vector<Task*> tasks;
+    for (int i = 0; i < nTasks; ++i)
+        tasks.push_back(new TransformChunkTask<Func>(chunks));
+    if (!tasks.empty())
+        EnqueueTasks(tasks);
+    while (chunks->RunChunk())
+        ;
+    while (!chunks->Finished()) {
+#if (defined(__i386__) || defined(__amd64__))
+        __asm__ __volatile__("pause\n");
+#endif
+    }
+}
+
+// 矩阵 m 的 3x4 部分作用在 SoA 数组上. w 是平移的权重:
+// 点为 1, 向量和法线为 0. 调用者保证 m 是仿射的
+static void AffineSoA(const Matrix4x4& m,
+                      float w,
+                      int start,
+                      int end,
+                      const float* x,
+                      const float* y,
+                      const float* z,
+                      float* xt,
+                      float* yt,
+                      float* zt) {
+    int i = start;
+#ifdef PBRT_HAS_SSE
+    __m128 m00 = _mm_set1_ps(m.m[0][0]), m01 = _mm_set1_ps(m.m[0][1]),
+           m02 = _mm_set1_ps(m.m[0][2]), m03 = _mm_set1_ps(m.m[0][3] * w);
+    __m128 m10 = _mm_set1_ps(m.m[1][0]), m11 = _mm_set1_ps(m.m[1][1]),
+           m12 = _mm_set1_ps(m.m[1][2]), m13 = _mm_set1_ps(m.m[1][3] * w);
+    __m128 m20 = _mm_set1_ps(m.m[2][0]), m21 = _mm_set1_ps(m.m[2][1]),
+           m22 = _mm_set1_ps(m.m[2][2]), m23 = _mm_set1_ps(m.m[2][3] * w);
+    for (; i + 4 <= end; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i),
+               vz = _mm_loadu_ps(z + i);
+        __m128 rx = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(m00, vx), _mm_mul_ps(m01, vy)),
+            _mm_add_ps(_mm_mul_ps(m02, vz), m03));
+        __m128 ry = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(m10, vx), _mm_mul_ps(m11, vy)),
+            _mm_add_ps(_mm_mul_ps(m12, vz), m13));
+        __m128 rz = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(m20, vx), _mm_mul_ps(m21, vy)),
+            _mm_add_ps(_mm_mul_ps(m22, vz), m23));
+        _mm_storeu_ps(xt + i, rx);
+        _mm_storeu_ps(yt + i, ry);
+        _mm_storeu_ps(zt + i, rz);
+    }
+#endif
+    for (; i < end; ++i) {
+        float px = x[i], py = y[i], pz = z[i];
+        xt[i] = m.m[0][0] * px + m.m[0][1] * py + m.m[0][2] * pz + m.m[0][3] * w;
+        yt[i] = m.m[1][0] * px + m.m[1][1] * py + m.m[1][2] * pz + m.m[1][3] * w;
+        zt[i] = m.m[2][0] * px + m.m[2][1] * py + m.m[2][2] * pz + m.m[2][3] * w;
+    }
+}
+
+// AoS 版本: 矩阵按列放进寄存器, 每个元素是三列的线性组合.
+// 构造时广播一次, 之后逐个元素套用
+struct AffineColumns {
+    AffineColumns(const Matrix4x4& m, float w) {
+#ifdef PBRT_HAS_SSE
+        c0 = _mm_setr_ps(m.m[0][0], m.m[1][0], m.m[2][0], 0.f);
+        c1 = _mm_setr_ps(m.m[0][1], m.m[1][1], m.m[2][1], 0.f);
+        c2 = _mm_setr_ps(m.m[0][2], m.m[1][2], m.m[2][2], 0.f);
+        c3 = _mm_setr_ps(m.m[0][3] * w, m.m[1][3] * w, m.m[2][3] * w, 0.f);
+#else
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j)
+                c[i][j] = m.m[i][j];
+            c[i][3] = m.m[i][3] * w;
         }
-        ++ipiv[icol];
-        // Swap rows _irow_ and _icol_ for pivot
-        if (irow != icol) {
-            for (int k = 0; k < 4; ++k)
-                swap(minv[irow][k], minv[icol][k]);
+#endif
+    }
+    template <typename T>
+    void operator()(const T& v, T* vt) const {
+#ifdef PBRT_HAS_SSE
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(v.x)),
+                                         _mm_mul_ps(c1, _mm_set1_ps(v.y))),
+                              _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(v.z)), c3));
+        // 只写 x, y, z 三个分量, 不能碰到下一个元素
+        _mm_storel_pi((__m64*)&vt->x, r);
+        _mm_store_ss(&vt->z, _mm_movehl_ps(r, r));
+#else
+        float x = v.x, y = v.y, z = v.z;
+        vt->x = c[0][0] * x + c[0][1] * y + c[0][2] * z + c[0][3];
+        vt->y = c[1][0] * x + c[1][1] * y + c[1][2] * z + c[1][3];
+        vt->z = c[2][0] * x + c[2][1] * y + c[2][2] * z + c[2][3];
+#endif
+    }
+
+#ifdef PBRT_HAS_SSE
+    __m128 c0, c1, c2, c3;
+#else
+    float c[3][4];
+#endif
+};
+
+template <typename T>
+static void AffineAoS(const Matrix4x4& m,
+                      float w,
+                      int start,
+                      int end,
+                      const T* v,
+                      T* vt) {
+    AffineColumns cols(m, w);
+    for (int i = start; i < end; ++i)
+        cols(v[i], &vt[i]);
+}
+
+void Transform::operator()(const Point* p, Point* pt, int n) const {
+    const Transform& t = *this;
+    if (m.IsAffine())
+        TransformChunked(n, [&](int start, int end) {
+            AffineAoS(t.m, 1.f, start, end, p, pt);
+        });
+    else
+        TransformChunked(n, [&](int start, int end) {
+            for (int i = start; i < end; ++i)
+                t(p[i], &pt[i]);
+        });
+}
+
+void Transform::operator()(const Vector* v, Vector* vt, int n) const {
+    const Transform& t = *this;
+    TransformChunked(n, [&](int start, int end) {
+        AffineAoS(t.m, 0.f, start, end, v, vt);
+    });
+}
+
+void Transform::operator()(const Normal* nrm, Normal* nt, int n) const {
+    // 法线用 (mInv)^T, 只有 3x3 部分参与
+    Matrix4x4 mInvT = Transpose(mInv);
+    TransformChunked(n, [&](int start, int end) {
+        AffineAoS(mInvT, 0.f, start, end, nrm, nt);
+    });
+}
+
+void Transform::operator()(const Ray* r, Ray* rt, int n) const {
+    const Transform& t = *this;
+    bool affine = m.IsAffine();
+    TransformChunked(n, [&](int start, int end) {
+        AffineColumns toPoint(t.m, 1.f), toVector(t.m, 0.f);
+        for (int i = start; i < end; ++i) {
+            if (affine)
+                toPoint(r[i].o, &rt[i].o);
+            else
+                t(r[i].o, &rt[i].o);
+            toVector(r[i].d, &rt[i].d);
+            if (&rt[i] != &r[i]) {
+                rt[i].mint = r[i].mint;
+                rt[i].maxt = r[i].maxt;
+                rt[i].time = r[i].time;
+                rt[i].depth = r[i].depth;
+            }
         }
-        indxr[i] = irow;
-        indxc[i] = icol;
-        if (minv[icol][icol] == 0.)
-            printf("Singular matrix in MatrixInvert");
-
-        // Set $m[icol][icol]$ to one by scaling row _icol_ appropriately
-        float pivinv = 1.f / minv[icol][icol];
-        minv[icol][icol] = 1.f;
-        for (int j = 0; j < 4; j++)
-            minv[icol][j] *= pivinv;
-
-        // Subtract this row from others to zero out their columns
-        for (int j = 0; j < 4; j++) {
-            if (j != icol) {
-                float save = minv[j][icol];
-                minv[j][icol] = 0;
-                for (int k = 0; k < 4; k++)
-                    minv[j][k] -= minv[icol][k] * save;
+    });
+}
+
+void Transform::TransformPoints(int n,
+                                const float* x,
+                                const float* y,
+                                const float* z,
+                                float* xt,
+                                float* yt,
+                                float* zt) const {
+    const Transform& t = *this;
+    if (m.IsAffine())
+        TransformChunked(n, [&](int start, int end) {
+            AffineSoA(t.m, 1.f, start, end, x, y, z, xt, yt, zt);
+        });
+    else
+        TransformChunked(n, [&](int start, int end) {
+            for (int i = start; i < end; ++i) {
+                Point p = t(Point(x[i], y[i], z[i]));
+                xt[i] = p.x;
+                yt[i] = p.y;
+                zt[i] = p.z;
             }
+        });
+}
+
+void Transform::TransformVectors(int n,
+                                 const float* x,
+                                 const float* y,
+                                 const float* z,
+                                 float* xt,
+                                 float* yt,
+                                 float* zt) const {
+    const Transform& t = *this;
+    TransformChunked(n, [&](int start, int end) {
+        AffineSoA(t.m, 0.f, start, end, x, y, z, xt, yt, zt);
+    });
+}
+
+void Transform::TransformNormals(int n,
+                                 const float* x,
+                                 const float* y,
+                                 const float* z,
+                                 float* xt,
+                                 float* yt,
+                                 float* zt) const {
+    Matrix4x4 mInvT = Transpose(mInv);
+    TransformChunked(n, [&](int start, int end) {
+        AffineSoA(mInvT, 0.f, start, end, x, y, z, xt, yt, zt);
+    });
+}
+
+// Arvo 的方法: 变换后每个轴的范围等于平移加上每一列贡献的最小/最大值,
+// 不需要变换 8 个角点. 只对仿射矩阵成立
+static BBox ArvoBound(const float (*m)[4], const BBox& b) {
+    // 空盒子变换后还是空的, 避免 0 * inf 产生 NaN
+    if (b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z)
+        return BBox();
+    BBox ret;
+    for (int i = 0; i < 3; ++i) {
+        float lo = m[i][3], hi = m[i][3];
+        for (int j = 0; j < 3; ++j) {
+            float e = m[i][j] * b.pMin[j];
+            float f = m[i][j] * b.pMax[j];
+            lo += min(e, f);
+            hi += max(e, f);
+        }
+        ret.pMin[i] = lo;
+        ret.pMax[i] = hi;
+    }
+    return ret;
+}
+
+BBox Transform::operator()(const BBox& b) const {
+    if (m.IsAffine())
+        return ArvoBound(m.m, b);
+    // 投影矩阵只能老老实实变换 8 个角点
+    const Transform& M = *this;
+    BBox ret;
+    for (int c = 0; c < 8; ++c)
+        ret = Union(ret, M(Point(b[c & 1].x, b[(c >> 1) & 1].y,
+                                 b[(c >> 2) & 1].z)));
+    return ret;
+}
+
+void Transform::operator()(const BBox* b, BBox* bt, int n) const {
+    const Transform& t = *this;
+    TransformChunked(n, [&](int start, int end) {
+        for (int i = start; i < end; ++i)
+            bt[i] = t(b[i]);
+    });
+}
+
+// AnimatedTransform Method Definitions
+void AnimatedTransform::Decompose(const Matrix4x4& m,
+                                  Vector* T,
+                                  Quaternion* Rquat,
+                                  Matrix4x4* S) {
+    // 平移就是最后一列
+    T->x = m.m[0][3];
+    T->y = m.m[1][3];
+    T->z = m.m[2][3];
+
+    // 去掉平移, 剩下 M = R S
+    Matrix4x4 M = m;
+    for (int i = 0; i < 3; ++i)
+        M.m[i][3] = M.m[3][i] = 0.f;
+    M.m[3][3] = 1.f;
+
+    // 极分解: 反复取 R 和 R 的逆转置的平均, 收敛到旋转部分
+    float norm;
+    int count = 0;
+    Matrix4x4 R = M;
+    do {
+        Matrix4x4 Rnext, Rit;
+        if (!Inverse(Transpose(R), &Rit))
+            break;
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                Rnext.m[i][j] = 0.5f * (R.m[i][j] + Rit.m[i][j]);
+
+        norm = 0.f;
+        for (int i = 0; i < 3; ++i) {
+            float n = fabsf(R.m[i][0] - Rnext.m[i][0]) +
+                      fabsf(R.m[i][1] - Rnext.m[i][1]) +
+                      fabsf(R.m[i][2] - Rnext.m[i][2]);
+            norm = max(norm, n);
+        }
+        R = Rnext;
+    } while (++count < 100 && norm > .0001f);
+    *Rquat = Quaternion(Transform(R, Transpose(R)));
+
+    // S = R^-1 M, R 是正交的所以 R^-1 = R^T
+    *S = Matrix4x4::Mul(Transpose(R), M);
+}
+
+void AnimatedTransform::InterpolateMatrix(float time, Matrix4x4* m) const {
+    if (!actuallyAnimated || time <= startTime) {
+        *m = startTransform->GetMatrix();
+        return;
+    }
+    if (time >= endTime) {
+        *m = endTransform->GetMatrix();
+        return;
+    }
+    float dt = (time - startTime) / (endTime - startTime);
+    Matrix4x4 rot = Slerp(dt, R[0], R[1]).ToMatrix();
+
+    // M = T * R * S, 直接写出 3x4 部分
+    float scale[3][3];
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            scale[i][j] = Lerp(dt, S[0].m[i][j], S[1].m[i][j]);
+    Matrix4x4 r;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j)
+            r.m[i][j] = rot.m[i][0] * scale[0][j] + rot.m[i][1] * scale[1][j] +
+                        rot.m[i][2] * scale[2][j];
+        r.m[i][3] = Lerp(dt, T[0][i], T[1][i]);
+    }
+    *m = r;
+}
+
+void AnimatedTransform::Interpolate(float time, Transform* t) const {
+    // 静止的变换和区间外的时间直接返回关键帧, 不做插值
+    if (!actuallyAnimated || time <= startTime) {
+        *t = *startTransform;
+        return;
+    }
+    if (time >= endTime) {
+        *t = *endTransform;
+        return;
+    }
+    Matrix4x4 m, mInv;
+    InterpolateMatrix(time, &m);
+    if (!InverseAffine(m, &mInv)) {
+        // 缩放插值到零时没有逆, 退回离得近的关键帧
+        fprintf(stderr, "Singular matrix in AnimatedTransform::Interpolate\n");
+        *t = (time - startTime < endTime - time) ? *startTransform
+                                                  : *endTransform;
+        return;
+    }
+    *t = Transform(m, mInv);
+}
+
+// 插值得到的矩阵总是仿射的, 点不需要除以 w
+static inline Point ApplyAffine(const Matrix4x4& m, const Point& p) {
+    return Point(m.m[0][0] * p.x + m.m[0][1] * p.y + m.m[0][2] * p.z + m.m[0][3],
+                 m.m[1][0] * p.x + m.m[1][1] * p.y + m.m[1][2] * p.z + m.m[1][3],
+                 m.m[2][0] * p.x + m.m[2][1] * p.y + m.m[2][2] * p.z + m.m[2][3]);
+}
+
+static inline Vector ApplyAffine(const Matrix4x4& m, const Vector& v) {
+    return Vector(m.m[0][0] * v.x + m.m[0][1] * v.y + m.m[0][2] * v.z,
+                  m.m[1][0] * v.x + m.m[1][1] * v.y + m.m[1][2] * v.z,
+                  m.m[2][0] * v.x + m.m[2][1] * v.y + m.m[2][2] * v.z);
+}
+
+void AnimatedTransform::operator()(const Ray& r, Ray* tr) const {
+    if (!actuallyAnimated || r.time <= startTime)
+        (*startTransform)(r, tr);
+    else if (r.time >= endTime)
+        (*endTransform)(r, tr);
+    else {
+        Matrix4x4 m;
+        InterpolateMatrix(r.time, &m);
+        tr->o = ApplyAffine(m, r.o);
+        tr->d = ApplyAffine(m, r.d);
+        if (tr != &r) {
+            tr->mint = r.mint;
+            tr->maxt = r.maxt;
+            tr->time = r.time;
+            tr->depth = r.depth;
         }
     }
-    // Swap columns to reflect permutation
-    for (int j = 3; j >= 0; j--) {
-        if (indxr[j] != indxc[j]) {
-            for (int k = 0; k < 4; k++)
-                swap(minv[k][indxr[j]], minv[k][indxc[j]]);
+}
+
+void AnimatedTransform::operator()(const RayDifferential& r,
+                                   RayDifferential* tr) const {
+    if (!actuallyAnimated || r.time <= startTime)
+        (*startTransform)(r, tr);
+    else if (r.time >= endTime)
+        (*endTransform)(r, tr);
+    else {
+        Matrix4x4 m;
+        InterpolateMatrix(r.time, &m);
+        (*this)(Ray(r), tr);
+        tr->hasDifferentials = r.hasDifferentials;
+        tr->rxOrigin = ApplyAffine(m, r.rxOrigin);
+        tr->ryOrigin = ApplyAffine(m, r.ryOrigin);
+        tr->rxDirection = ApplyAffine(m, r.rxDirection);
+        tr->ryDirection = ApplyAffine(m, r.ryDirection);
+    }
+}
+
+Point AnimatedTransform::operator()(float time, const Point& p) const {
+    if (!actuallyAnimated)
+        return (*startTransform)(p);
+    Matrix4x4 m;
+    InterpolateMatrix(time, &m);
+    return ApplyAffine(m, p);
+}
+
+Vector AnimatedTransform::operator()(float time, const Vector& v) const {
+    if (!actuallyAnimated)
+        return (*startTransform)(v);
+    Matrix4x4 m;
+    InterpolateMatrix(time, &m);
+    return ApplyAffine(m, v);
+}
+
+Ray AnimatedTransform::operator()(const Ray& r) const {
+    Ray ret;
+    (*this)(r, &ret);
+    return ret;
+}
+
+BBox AnimatedTransform::MotionBounds(const BBox& b, bool useInverse) const {
+    if (!actuallyAnimated)
+        return useInverse ? Inverse(*startTransform)(b) : (*startTransform)(b);
+
+    // 在时间上采样每个角点的轨迹. 相邻两个采样之间的圆弧落在以弦为直径的
+    // 球里, 所以每段再并上这个球, 得到的包围盒不会漏掉采样之间的运动
+    const int nSteps = 32;
+    BBox ret;
+    Point prev[8];
+    for (int step = 0; step < nSteps; ++step) {
+        float time = Lerp(float(step) / float(nSteps - 1), startTime, endTime);
+        Transform t;
+        Interpolate(time, &t);
+        if (useInverse)
+            t = Inverse(t);
+        for (int c = 0; c < 8; ++c) {
+            Point p = t(Point(b[c & 1].x, b[(c >> 1) & 1].y, b[(c >> 2) & 1].z));
+            ret = Union(ret, p);
+            if (step > 0) {
+                Point mid = (p + prev[c]) * 0.5f;
+                float radius = Distance(p, prev[c]) * 0.5f;
+                BBox ball(mid, mid);
+                ball.Expand(radius);
+                ret = Union(ret, ball);
+            }
+            prev[c] = p;
         }
     }
-    return Matrix4x4(minv);
+    return ret;
+}
+
+bool Transform::SwapsHandedness() const {
+    float det = ((m.m[0][0] * (m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1])) -
+                 (m.m[0][1] * (m.m[1][0] * m.m[2][2] - m.m[1][2] * m.m[2][0])) +
+                 (m.m[0][2] * (m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0])));
+    return det < 0.f;
+}
+
+Transform Transform::operator*(const Transform& t2) const {
+    return Transform(Matrix4x4::Mul(m, t2.m), Matrix4x4::Mul(t2.mInv, mInv));
+}
+
+// 实例摆放用的基本变换, 逆矩阵直接写出来, 不走求逆
+static inline float Radians(float deg) {
+    return (M_PI / 180.f) * deg;
+}
+
+Transform Translate(const Vector& delta) {
+    Matrix4x4 m(1, 0, 0, delta.x, 0, 1, 0, delta.y, 0, 0, 1, delta.z, 0, 0, 0,
+                1);
+    Matrix4x4 minv(1, 0, 0, -delta.x, 0, 1, 0, -delta.y, 0, 0, 1, -delta.z, 0,
+                   0, 0, 1);
+    return Transform(m, minv);
+}
+
+Transform Scale(float x, float y, float z) {
+    Matrix4x4 m(x, 0, 0, 0, 0, y, 0, 0, 0, 0, z, 0, 0, 0, 0, 1);
+    Matrix4x4 minv(1.f / x, 0, 0, 0, 0, 1.f / y, 0, 0, 0, 0, 1.f / z, 0, 0, 0,
+                   0, 1);
+    return Transform(m, minv);
+}
+
+Transform RotateX(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m(1, 0, 0, 0, 0, cos_t, -sin_t, 0, 0, sin_t, cos_t, 0, 0, 0, 0,
+                1);
+    return Transform(m, Transpose(m));
+}
+
+Transform RotateY(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m(cos_t, 0, sin_t, 0, 0, 1, 0, 0, -sin_t, 0, cos_t, 0, 0, 0, 0,
+                1);
+    return Transform(m, Transpose(m));
+}
+
+Transform RotateZ(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m(cos_t, -sin_t, 0, 0, sin_t, cos_t, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+                1);
+    return Transform(m, Transpose(m));
+}
+
+Transform Rotate(float angle, const Vector& axis) {
+    Vector a = Normalize(axis);
+    float s = sinf(Radians(angle));
+    float c = cosf(Radians(angle));
+    float m[4][4];
+
+    m[0][0] = a.x * a.x + (1.f - a.x * a.x) * c;
+    m[0][1] = a.x * a.y * (1.f - c) - a.z * s;
+    m[0][2] = a.x * a.z * (1.f - c) + a.y * s;
+    m[0][3] = 0;
+
+    m[1][0] = a.x * a.y * (1.f - c) + a.z * s;
+    m[1][1] = a.y * a.y + (1.f - a.y * a.y) * c;
+    m[1][2] = a.y * a.z * (1.f - c) - a.x * s;
+    m[1][3] = 0;
+
+    m[2][0] = a.x * a.z * (1.f - c) - a.y * s;
+    m[2][1] = a.y * a.z * (1.f - c) + a.x * s;
+    m[2][2] = a.z * a.z + (1.f - a.z * a.z) * c;
+    m[2][3] = 0;
+
+    m[3][0] = 0;
+    m[3][1] = 0;
+    m[3][2] = 0;
+    m[3][3] = 1;
+
+    Matrix4x4 mat(m);
+    return Transform(mat, Transpose(mat));
+}
+
+// AffineTransform Method Definitions
+AffineTransform::AffineTransform() : ownsInverse(false), inverse(NULL) {
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+            m[i][j] = (i == j) ? 1.f : 0.f;
+    ComputeFlags();
+}
+
+AffineTransform::AffineTransform(const Transform& t)
+    : ownsInverse(false), inverse(NULL) {
+    memcpy(m, t.GetMatrix().m, sizeof(m));
+    ComputeFlags();
+}
+
+AffineTransform::AffineTransform(const Matrix4x4& mat)
+    : ownsInverse(false), inverse(NULL) {
+    memcpy(m, mat.m, sizeof(m));
+    ComputeFlags();
+}
+
+// 配对的逆可能比新对象先释放, 所以不共享
+AffineTransform::AffineTransform(const AffineTransform& t)
+    : flags(t.flags), ownsInverse(false), inverse(NULL) {
+    memcpy(m, t.m, sizeof(m));
+}
+
+AffineTransform& AffineTransform::operator=(const AffineTransform& t) {
+    if (this != &t) {
+        memcpy(m, t.m, sizeof(m));
+        flags = t.flags;
+        if (ownsInverse)
+            delete inverse;
+        ownsInverse = false;
+        inverse = NULL;
+    }
+    return *this;
+}
+
+AffineTransform::~AffineTransform() {
+    if (ownsInverse)
+        delete inverse;
+}
+
+void AffineTransform::MakePair(const Transform& t,
+                               AffineTransform* at,
+                               AffineTransform* atInv) {
+    *at = AffineTransform(t.GetMatrix());
+    *atInv = AffineTransform(t.GetInverseMatrix());
+    at->inverse = atInv;
+    atInv->inverse = at;
+}
+
+void AffineTransform::ComputeFlags() {
+    flags = 0;
+    bool identity = true;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+            if (m[i][j] != ((i == j) ? 1.f : 0.f))
+                identity = false;
+    if (identity)
+        flags |= IS_IDENTITY;
+
+#define NOT_ONE(x) ((x) < .999f || (x) > 1.001f)
+    for (int j = 0; j < 3; ++j) {
+        float l2 = m[0][j] * m[0][j] + m[1][j] * m[1][j] + m[2][j] * m[2][j];
+        if (NOT_ONE(l2))
+            flags |= HAS_SCALE;
+    }
+#undef NOT_ONE
+
+    float det = ((m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])) -
+                 (m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])) +
+                 (m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])));
+    if (det < 0.f)
+        flags |= SWAPS_HANDEDNESS;
+}
+
+const float (*AffineTransform::Inv() const)[4] {
+    if (inverse)
+        return inverse->m;
+    Matrix4x4 inv;
+    if (!InverseAffine(GetMatrix(), &inv))
+        fprintf(stderr, "Singular matrix in AffineTransform\n");
+    AffineTransform* computed = new AffineTransform(inv);
+    computed->inverse = const_cast<AffineTransform*>(this);
+    // 其它线程可能已经抢先算好了, 那就用它的, 丢掉自己的
+    if (AtomicCompareAndSwapPointer(&inverse, computed,
+                                    (AffineTransform*)NULL) != NULL)
+        delete computed;
+    else
+        ownsInverse = true;
+    return inverse->m;
+}
+
+Matrix4x4 AffineTransform::GetMatrix() const {
+    return Matrix4x4(m[0][0], m[0][1], m[0][2], m[0][3], m[1][0], m[1][1],
+                     m[1][2], m[1][3], m[2][0], m[2][1], m[2][2], m[2][3], 0.f,
+                     0.f, 0.f, 1.f);
+}
+
+Transform AffineTransform::ToTransform() const {
+    const float(*inv)[4] = Inv();
+    Matrix4x4 mi(inv[0][0], inv[0][1], inv[0][2], inv[0][3], inv[1][0],
+                 inv[1][1], inv[1][2], inv[1][3], inv[2][0], inv[2][1],
+                 inv[2][2], inv[2][3], 0.f, 0.f, 0.f, 1.f);
+    return Transform(GetMatrix(), mi);
+}
+
+AffineTransform Inverse(const AffineTransform& t) {
+    t.Inv();
+    return *t.inverse;
+}
+
+BBox AffineTransform::operator()(const BBox& b) const {
+    return ArvoBound(m, b);
+}
+
+void AffineTransform::operator()(const BBox* b, BBox* bt, int n) const {
+    const AffineTransform& t = *this;
+    TransformChunked(n, [&](int start, int end) {
+        for (int i = start; i < end; ++i)
+            bt[i] = ArvoBound(t.m, b[i]);
+    });
 }
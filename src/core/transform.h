@@ -1,10 +1,11 @@
 #pragma once
 
 #include "pbrt.h"
+#include "quaternion.h"
 
-// 4 * 4 矩阵
+// 4 * 4 矩阵, 行按 16 字节对齐以便 SSE 整行读写
 struct Matrix4x4 {
-    float m[4][4];
+    alignas(16) float m[4][4];
     Matrix4x4() {
         m[0][0] = m[1][1] = m[2][2] = m[3][3] = 1.f;
         m[0][1] = m[0][2] = m[0][3] = m[1][0] = m[1][2] = m[1][3] = m[2][0] =
@@ -54,17 +55,19 @@ struct Matrix4x4 {
         fprintf(f, " ] ");
     }
 
-    static Matrix4x4 Mul(const Matrix4x4& m1, const Matrix4x4& m2) {
-        Matrix4x4 r;
-        for (int i = 0; i < 4; i++)
-            for (int j = 0; j < 4; j++)
-                r.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][0] * m2.m[0][j] +
-                            m1.m[i][0] * m2.m[0][j] + m1.m[i][0] * m2.m[0][j];
-
-        return r;
+    // 最后一行是 0 0 0 1
+    bool IsAffine() const {
+        return m[3][0] == 0.f && m[3][1] == 0.f && m[3][2] == 0.f &&
+               m[3][3] == 1.f;
     }
 
+    static Matrix4x4 Mul(const Matrix4x4& m1, const Matrix4x4& m2);
+
     friend Matrix4x4 Inverse(const Matrix4x4&);
+    // 奇异矩阵返回 false, *inv 不变
+    friend bool Inverse(const Matrix4x4& m, Matrix4x4* inv);
+    // 只对仿射矩阵有效: 求 3x3 部分的逆, 跳过投影行
+    friend bool InverseAffine(const Matrix4x4& m, Matrix4x4* inv);
 };
 
 class Transform {
@@ -86,9 +89,11 @@ class Transform {
         return Transform(Transpose(t.m), Transpose(t.mInv));
     }
 
-    bool operator==(const Transform& t) { return t.m == m && t.mInv == mInv; }
+    bool operator==(const Transform& t) const {
+        return t.m == m && t.mInv == mInv;
+    }
 
-    bool operator!=(const Transform& t) {
+    bool operator!=(const Transform& t) const {
         return !(t.m == m) || !(t.mInv == mInv);
     }
 
@@ -135,6 +140,41 @@ class Transform {
     inline RayDifferential operator()(const RayDifferential& r) const;
     inline void operator()(const RayDifferential& r, RayDifferential* rt) const;
     BBox operator()(const BBox& b) const;
+    // 光线包版本, 定义在 raypacket.h
+    template <int N>
+    void operator()(const RayPacket<N>& r, RayPacket<N>* rt) const;
+
+    // 批量变换: pt 可以等于 p (原地变换). 仿射矩阵走 SIMD 核,
+    // 大数组会切块交给任务池并行处理
+    void operator()(const Point* p, Point* pt, int n) const;
+    void operator()(const Vector* v, Vector* vt, int n) const;
+    void operator()(const Normal* nrm, Normal* nt, int n) const;
+    void operator()(const Ray* r, Ray* rt, int n) const;
+    // 大量实例的世界包围盒, 比如构建加速结构时
+    void operator()(const BBox* b, BBox* bt, int n) const;
+    // SoA 版本, 输入和输出各是 x/y/z 三个数组
+    void TransformPoints(int n,
+                         const float* x,
+                         const float* y,
+                         const float* z,
+                         float* xt,
+                         float* yt,
+                         float* zt) const;
+    void TransformVectors(int n,
+                          const float* x,
+                          const float* y,
+                          const float* z,
+                          float* xt,
+                          float* yt,
+                          float* zt) const;
+    void TransformNormals(int n,
+                          const float* x,
+                          const float* y,
+                          const float* z,
+                          float* xt,
+                          float* yt,
+                          float* zt) const;
+
     Transform operator*(const Transform& t2) const;
     bool SwapsHandedness() const;
 };
@@ -189,6 +229,21 @@ inline void Transform::operator()(const Vector& v, Vector* vt) const {
     vt->z = m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z;
 }
 
+// 法线用逆矩阵的转置变换
+inline Normal Transform::operator()(const Normal& n) const {
+    float x = n.x, y = n.y, z = n.z;
+    return Normal(mInv.m[0][0] * x + mInv.m[1][0] * y + mInv.m[2][0] * z,
+                  mInv.m[0][1] * x + mInv.m[1][1] * y + mInv.m[2][1] * z,
+                  mInv.m[0][2] * x + mInv.m[1][2] * y + mInv.m[2][2] * z);
+}
+
+inline void Transform::operator()(const Normal& n, Normal* nt) const {
+    float x = n.x, y = n.y, z = n.z;
+    nt->x = mInv.m[0][0] * x + mInv.m[1][0] * y + mInv.m[2][0] * z;
+    nt->y = mInv.m[0][1] * x + mInv.m[1][1] * y + mInv.m[2][1] * z;
+    nt->z = mInv.m[0][2] * x + mInv.m[1][2] * y + mInv.m[2][2] * z;
+}
+
 inline Ray Transform::operator()(const Ray& r) const {
     Ray ret = r;
     (*this)(ret.o, &ret.o);
@@ -228,11 +283,190 @@ inline void Transform::operator()(const RayDifferential& r,
     (*this)(r.ryDirection, &rt->ryDirection);
 }
 
+// 仿射变换的紧凑表示: 只存 3x4 的正向矩阵 (最后一行总是 0 0 0 1),
+// 逆变换是另一个 AffineTransform, 用指针引用. 形状的物体/世界变换
+// 都是仿射的, 用 MakePair 配成一对后互为逆, 不再另存逆矩阵,
+// 一对只占一对 Transform 一半的内存. 单独构造的逆在第一次用到时才算
+class AffineTransform {
+   public:
+    AffineTransform();
+    // t 必须是仿射的
+    explicit AffineTransform(const Transform& t);
+    explicit AffineTransform(const Matrix4x4& mat);
+    // 只拷贝正向矩阵, 逆需要时再算
+    AffineTransform(const AffineTransform& t);
+    AffineTransform& operator=(const AffineTransform& t);
+    ~AffineTransform();
+
+    // 把 t 和它的逆存进 at 和 atInv, 两者互相引用作为逆, 谁都不拥有
+    // 对方, 要一起释放. t 必须是仿射的
+    static void MakePair(const Transform& t,
+                         AffineTransform* at,
+                         AffineTransform* atInv);
+
+    friend AffineTransform Inverse(const AffineTransform& t);
+    Transform ToTransform() const;
+    Matrix4x4 GetMatrix() const;
+
+    // 这些在构造时就算好了
+    bool IsIdentity() const { return (flags & IS_IDENTITY) != 0; }
+    bool HasScale() const { return (flags & HAS_SCALE) != 0; }
+    bool SwapsHandedness() const { return (flags & SWAPS_HANDEDNESS) != 0; }
+
+    inline Point operator()(const Point& pt) const;
+    inline void operator()(const Point& pt, Point* ptrans) const;
+    inline Vector operator()(const Vector& v) const;
+    inline void operator()(const Vector& v, Vector* vt) const;
+    inline Normal operator()(const Normal& n) const;
+    inline void operator()(const Normal& n, Normal* nt) const;
+    inline Ray operator()(const Ray& r) const;
+    inline void operator()(const Ray& r, Ray* rt) const;
+    inline RayDifferential operator()(const RayDifferential& r) const;
+    inline void operator()(const RayDifferential& r, RayDifferential* rt) const;
+    BBox operator()(const BBox& b) const;
+    void operator()(const BBox* b, BBox* bt, int n) const;
+    template <int N>
+    void operator()(const RayPacket<N>& r, RayPacket<N>* rt) const;
+
+   private:
+    enum {
+        IS_IDENTITY = 1 << 0,
+        HAS_SCALE = 1 << 1,
+        SWAPS_HANDEDNESS = 1 << 2
+    };
+    void ComputeFlags();
+    // 返回 3x4 逆矩阵, 没有的话先算出来. 多个线程同时调用是安全的
+    const float (*Inv() const)[4];
+
+    float m[3][4];
+    uint32_t flags;
+    // inverse 是第一次用到时自己算出来的, 析构时要删掉
+    mutable bool ownsInverse;
+    mutable AffineTransform* inverse;
+};
+
+inline Point AffineTransform::operator()(const Point& pt) const {
+    float x = pt.x, y = pt.y, z = pt.z;
+    return Point(m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3],
+                 m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3],
+                 m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3]);
+}
+
+inline void AffineTransform::operator()(const Point& pt, Point* ptrans) const {
+    float x = pt.x, y = pt.y, z = pt.z;
+    ptrans->x = m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3];
+    ptrans->y = m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3];
+    ptrans->z = m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3];
+}
+
+inline Vector AffineTransform::operator()(const Vector& v) const {
+    float x = v.x, y = v.y, z = v.z;
+    return Vector(m[0][0] * x + m[0][1] * y + m[0][2] * z,
+                  m[1][0] * x + m[1][1] * y + m[1][2] * z,
+                  m[2][0] * x + m[2][1] * y + m[2][2] * z);
+}
+
+inline void AffineTransform::operator()(const Vector& v, Vector* vt) const {
+    float x = v.x, y = v.y, z = v.z;
+    vt->x = m[0][0] * x + m[0][1] * y + m[0][2] * z;
+    vt->y = m[1][0] * x + m[1][1] * y + m[1][2] * z;
+    vt->z = m[2][0] * x + m[2][1] * y + m[2][2] * z;
+}
+
+inline Normal AffineTransform::operator()(const Normal& n) const {
+    Normal ret;
+    (*this)(n, &ret);
+    return ret;
+}
+
+inline void AffineTransform::operator()(const Normal& n, Normal* nt) const {
+    float x = n.x, y = n.y, z = n.z;
+    const float(*inv)[4] = Inv();
+    nt->x = inv[0][0] * x + inv[1][0] * y + inv[2][0] * z;
+    nt->y = inv[0][1] * x + inv[1][1] * y + inv[2][1] * z;
+    nt->z = inv[0][2] * x + inv[1][2] * y + inv[2][2] * z;
+}
+
+inline Ray AffineTransform::operator()(const Ray& r) const {
+    Ray ret = r;
+    (*this)(ret.o, &ret.o);
+    (*this)(ret.d, &ret.d);
+    return ret;
+}
+
+inline void AffineTransform::operator()(const Ray& r, Ray* rt) const {
+    (*this)(r.o, &rt->o);
+    (*this)(r.d, &rt->d);
+    if (rt != &r) {
+        rt->mint = r.mint;
+        rt->maxt = r.maxt;
+        rt->time = r.time;
+        rt->depth = r.depth;
+    }
+}
+
+inline RayDifferential AffineTransform::operator()(
+    const RayDifferential& r) const {
+    RayDifferential ret;
+    (*this)(r, &ret);
+    return ret;
+}
+
+inline void AffineTransform::operator()(const RayDifferential& r,
+                                        RayDifferential* rt) const {
+    (*this)(Ray(r), rt);
+    rt->hasDifferentials = r.hasDifferentials;
+    (*this)(r.rxOrigin, &rt->rxOrigin);
+    (*this)(r.rxDirection, &rt->rxDirection);
+    (*this)(r.ryOrigin, &rt->ryOrigin);
+    (*this)(r.ryDirection, &rt->ryDirection);
+}
+
+// 两个关键帧之间的运动变换. 构造时把每个关键帧分解成平移 T, 旋转 R
+// 和缩放 S, 之后按时间插值只需要一次 Slerp 和几次乘加
 class AnimatedTransform {
    public:
+    AnimatedTransform(const Transform* transform1,
+                      float time1,
+                      const Transform* transform2,
+                      float time2)
+        : startTime(time1),
+          endTime(time2),
+          startTransform(transform1),
+          endTransform(transform2),
+          actuallyAnimated(*startTransform != *endTransform) {
+        if (actuallyAnimated) {
+            Decompose(startTransform->GetMatrix(), &T[0], &R[0], &S[0]);
+            Decompose(endTransform->GetMatrix(), &T[1], &R[1], &S[1]);
+        }
+    }
+
+    static void Decompose(const Matrix4x4& m,
+                          Vector* T,
+                          Quaternion* R,
+                          Matrix4x4* S);
+    void Interpolate(float time, Transform* t) const;
+    // 只算正向矩阵, 不求逆
+    void InterpolateMatrix(float time, Matrix4x4* m) const;
+
+    void operator()(const Ray& r, Ray* tr) const;
+    void operator()(const RayDifferential& r, RayDifferential* tr) const;
+    Point operator()(float time, const Point& p) const;
+    Vector operator()(float time, const Vector& v) const;
+    Ray operator()(const Ray& r) const;
+    // b 在整个时间区间内扫过的范围. useInverse 时用世界到物体的方向
+    BBox MotionBounds(const BBox& b, bool useInverse) const;
+
+    bool IsAnimated() const { return actuallyAnimated; }
+    bool HasScale() const {
+        return startTransform->HasScale() || endTransform->HasScale();
+    }
+
    private:
     const float startTime, endTime;
     const Transform *startTransform, *endTransform;
     const bool actuallyAnimated;
     Vector T[2];
+    Quaternion R[2];
+    Matrix4x4 S[2];
 };
@@ -0,0 +1,149 @@
+#include "transformcache.h"
+#include "probes.h"
+
+static const int TRANSFORMS_PER_BLOCK = 512;
+
+TransformCache::TransformCache() {
+    blockOffset = TRANSFORMS_PER_BLOCK;
+    affineBlockOffset = TRANSFORMS_PER_BLOCK;
+    nLookups = 0;
+    bytesLookedUp = bytesAllocated = 0;
+    table.resize(1024, -1);
+}
+
+TransformCache::~TransformCache() {
+    Clear();
+}
+
+void TransformCache::Clear() {
+    for (uint32_t i = 0; i < blocks.size(); ++i)
+        delete[] blocks[i];
+    blocks.clear();
+    for (uint32_t i = 0; i < affineBlocks.size(); ++i)
+        delete[] affineBlocks[i];
+    affineBlocks.clear();
+    entries.clear();
+    table.assign(1024, -1);
+    blockOffset = TRANSFORMS_PER_BLOCK;
+    affineBlockOffset = TRANSFORMS_PER_BLOCK;
+    nLookups = 0;
+    bytesLookedUp = bytesAllocated = 0;
+}
+
+// 对正向矩阵的位模式做 FNV-1a. +0 和 -0 按 operator< 相等, 所以先统一成 +0
+uint32_t TransformCache::Hash(const Transform& t) {
+    const Matrix4x4& m = t.GetMatrix();
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j) {
+            uint32_t bits;
+            float f = m.m[i][j] == 0.f ? 0.f : m.m[i][j];
+            memcpy(&bits, &f, sizeof(float));
+            hash = (hash ^ bits) * 16777619u;
+        }
+    return hash;
+}
+
+Transform* TransformCache::Alloc() {
+    if (blockOffset == TRANSFORMS_PER_BLOCK) {
+        blocks.push_back(new Transform[TRANSFORMS_PER_BLOCK]);
+        blockOffset = 0;
+    }
+    return &blocks.back()[blockOffset++];
+}
+
+void TransformCache::Grow() {
+    table.assign(table.size() * 2, -1);
+    uint32_t mask = table.size() - 1;
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+        uint32_t slot = entries[i].hash & mask;
+        while (table[slot] != -1)
+            slot = (slot + 1) & mask;
+        table[slot] = i;
+    }
+}
+
+AffineTransform* TransformCache::AllocAffine() {
+    if (affineBlockOffset == TRANSFORMS_PER_BLOCK) {
+        affineBlocks.push_back(new AffineTransform[TRANSFORMS_PER_BLOCK]);
+        affineBlockOffset = 0;
+    }
+    return &affineBlocks.back()[affineBlockOffset++];
+}
+
+// 条目里有哪种形式就用哪种和 t 比较. 仿射形式的最后一行总是 0 0 0 1
+bool TransformCache::SameMatrix(const Entry& e, const Transform& t) {
+    if (e.t)
+        return !(*e.t < t) && !(t < *e.t);
+    Matrix4x4 m = e.at->GetMatrix();
+    const Matrix4x4& tm = t.GetMatrix();
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+            if (m.m[i][j] != tm.m[i][j])
+                return false;
+    return true;
+}
+
+TransformCache::Entry& TransformCache::FindOrInsert(const Transform& t) {
+    ++nLookups;
+    uint32_t hash = Hash(t);
+    uint32_t mask = table.size() - 1;
+    uint32_t slot = hash & mask;
+    while (table[slot] != -1) {
+        Entry& e = entries[table[slot]];
+        // 哈希相同时再判断两个矩阵是否真的相等
+        if (e.hash == hash && SameMatrix(e, t)) {
+            PBRT_FOUND_CACHED_TRANSFORM();
+            return e;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    PBRT_ALLOCATED_CACHED_TRANSFORM();
+    Entry e;
+    e.hash = hash;
+    e.t = e.tInv = NULL;
+    e.at = e.atInv = NULL;
+    int index = entries.size();
+    table[slot] = index;
+    entries.push_back(e);
+    // 装载因子超过 1/2 时扩容
+    if (2 * entries.size() > table.size())
+        Grow();
+    return entries[index];
+}
+
+void TransformCache::Lookup(const Transform& t,
+                            Transform** tCached,
+                            Transform** tCachedInverse) {
+    Entry& e = FindOrInsert(t);
+    bytesLookedUp += 2 * sizeof(Transform);
+    if (!e.t) {
+        bytesAllocated += 2 * sizeof(Transform);
+        e.t = Alloc();
+        *e.t = t;
+        e.tInv = Alloc();
+        *e.tInv = Inverse(t);
+    }
+    if (tCached)
+        *tCached = e.t;
+    if (tCachedInverse)
+        *tCachedInverse = e.tInv;
+}
+
+void TransformCache::Lookup(const Transform& t,
+                            AffineTransform** tCached,
+                            AffineTransform** tCachedInverse) {
+    Entry& e = FindOrInsert(t);
+    bytesLookedUp += 2 * sizeof(AffineTransform);
+    if (!e.at) {
+        bytesAllocated += 2 * sizeof(AffineTransform);
+        e.at = AllocAffine();
+        e.atInv = AllocAffine();
+        AffineTransform::MakePair(t, e.at, e.atInv);
+    }
+    if (tCached)
+        *tCached = e.at;
+    if (tCachedInverse)
+        *tCachedInverse = e.atInv;
+}
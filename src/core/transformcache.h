@@ -0,0 +1,60 @@
+#pragma once
+
+#include "pbrt.h"
+#include "transform.h"
+
+// 变换缓存: 相同的矩阵只保存一份, 重复的查找返回同一个指针.
+// 实例化场景里大量形状共享少数几个变换, 这样每个形状只付出两个指针的开销.
+// 只在场景创建时使用, 不是线程安全的
+class TransformCache {
+   public:
+    TransformCache();
+    ~TransformCache();
+
+    // 返回 t 和它的逆在缓存里的唯一副本
+    void Lookup(const Transform& t,
+                Transform** tCached,
+                Transform** tCachedInverse);
+    // 同一个变换的紧凑仿射版本, 给 Shape 用
+    void Lookup(const Transform& t,
+                AffineTransform** tCached,
+                AffineTransform** tCachedInverse);
+    void Clear();
+
+    // 统计: 查找次数和实际分配的变换个数
+    int NumLookups() const { return nLookups; }
+    int NumUnique() const { return (int)entries.size(); }
+    // 和每次查找都分配一对新变换相比省下的字节数.
+    // 两种形式大小不同, 按每次查找和每次分配的实际形式分别计
+    size_t BytesSaved() const { return bytesLookedUp - bytesAllocated; }
+
+   private:
+    // TransformCache Private Methods
+    static uint32_t Hash(const Transform& t);
+    struct Entry;
+    Entry& FindOrInsert(const Transform& t);
+    static bool SameMatrix(const Entry& e, const Transform& t);
+    Transform* Alloc();
+    AffineTransform* AllocAffine();
+    void Grow();
+
+    // TransformCache Private Data
+    // 两种形式都在第一次按那种形式查找时才创建, 只按仿射形式查找的
+    // 条目只有 at 和 atInv, 两者互为逆
+    struct Entry {
+        uint32_t hash;
+        Transform *t, *tInv;
+        AffineTransform *at, *atInv;
+    };
+    vector<Entry> entries;
+    // 开放寻址表, 存 entries 的下标, -1 表示空槽
+    vector<int> table;
+    // 变换按块分配, 指针在缓存的生命周期内保持不变
+    vector<Transform*> blocks;
+    int blockOffset;
+    vector<AffineTransform*> affineBlocks;
+    int affineBlockOffset;
+    int nLookups;
+    // 每次查找都分配时要用的字节数, 和实际分配的字节数
+    size_t bytesLookedUp, bytesAllocated;
+};
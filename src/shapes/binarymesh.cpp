@@ -0,0 +1,221 @@
+#include "shapes/binarymesh.h"
+#include <algorithm>
+
+static const char binaryMeshMagic[8] = "PBRTMSH";
+static const uint64_t binaryMeshPageSize = 4096;
+
+static uint64_t roundUp(uint64_t n, uint64_t align) {
+    return (n + align - 1) / align * align;
+}
+
+// 写一段数据, 先补零到 offset
+static bool writeSection(FILE* fp,
+                         uint64_t* written,
+                         uint64_t offset,
+                         const void* data,
+                         size_t bytes) {
+    static const char zeros[binaryMeshPageSize] = {0};
+    while (*written < offset) {
+        size_t n = (size_t)min(offset - *written, binaryMeshPageSize);
+        if (fwrite(zeros, n, 1, fp) != 1)
+            return false;
+        *written += n;
+    }
+    if (bytes && fwrite(data, bytes, 1, fp) != 1)
+        return false;
+    *written += bytes;
+    return true;
+}
+
+bool WriteBinaryMesh(const std::string& filename,
+                     int ntris,
+                     int nverts,
+                     const int* vptr,
+                     const Point* P,
+                     const Normal* N,
+                     const float* uv) {
+    // 三角形按质心的 Morton 码排序
+    BBox centroidBounds;
+    vector<Point> centroids(ntris);
+    for (int i = 0; i < ntris; ++i) {
+        const int* v = &vptr[3 * i];
+        centroids[i] = (P[v[0]] + P[v[1]] + P[v[2]]) / 3.f;
+        centroidBounds = Union(centroidBounds, centroids[i]);
+    }
+    for (int axis = 0; axis < 3; ++axis)
+        if (!(centroidBounds.pMax[axis] > centroidBounds.pMin[axis]))
+            centroidBounds.pMax[axis] = centroidBounds.pMin[axis] + 1.f;
+    vector<std::pair<uint32_t, uint32_t>> order(ntris);
+    for (int i = 0; i < ntris; ++i)
+        order[i] = std::make_pair(
+            EncodeMorton3(centroidBounds.Offset(centroids[i])), uint32_t(i));
+    std::sort(order.begin(), order.end());
+
+    // 顶点按第一次用到的顺序重新编号
+    vector<uint32_t> remap(nverts, ~0u), indices(3 * size_t(ntris));
+    vector<int> vertexOrder;
+    vertexOrder.reserve(nverts);
+    for (int i = 0; i < ntris; ++i)
+        for (int j = 0; j < 3; ++j) {
+            int v = vptr[3 * order[i].second + j];
+            if (v < 0 || v >= nverts) {
+                fprintf(stderr,
+                        "WriteBinaryMesh: vertex index %d out of range\n", v);
+                return false;
+            }
+            if (remap[v] == ~0u) {
+                remap[v] = (uint32_t)vertexOrder.size();
+                vertexOrder.push_back(v);
+            }
+            indices[3 * i + j] = remap[v];
+        }
+    uint32_t nv = (uint32_t)vertexOrder.size();
+    vector<float> p[3], n[3], uvs;
+    for (int axis = 0; axis < 3; ++axis) {
+        p[axis].resize(nv);
+        for (uint32_t i = 0; i < nv; ++i)
+            p[axis][i] = P[vertexOrder[i]][axis];
+        if (N) {
+            n[axis].resize(nv);
+            for (uint32_t i = 0; i < nv; ++i)
+                n[axis][i] = N[vertexOrder[i]][axis];
+        }
+    }
+    if (uv) {
+        uvs.resize(2 * size_t(nv));
+        for (uint32_t i = 0; i < nv; ++i) {
+            uvs[2 * i] = uv[2 * vertexOrder[i]];
+            uvs[2 * i + 1] = uv[2 * vertexOrder[i] + 1];
+        }
+    }
+
+    BinaryMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, binaryMeshMagic, sizeof(header.magic));
+    header.version = BINARY_MESH_VERSION;
+    header.byteOrder = BINARY_MESH_BYTE_ORDER;
+    header.ntris = ntris;
+    header.nverts = nv;
+    uint64_t offset = binaryMeshPageSize;
+    auto place = [&](uint64_t bytes) {
+        uint64_t o = offset;
+        offset = roundUp(offset + bytes, binaryMeshPageSize);
+        return o;
+    };
+    header.indexOffset = place(indices.size() * sizeof(uint32_t));
+    for (int axis = 0; axis < 3; ++axis)
+        header.pOffset[axis] = place(nv * sizeof(float));
+    if (N)
+        for (int axis = 0; axis < 3; ++axis)
+            header.nOffset[axis] = place(nv * sizeof(float));
+    if (uv)
+        header.uvOffset = place(uvs.size() * sizeof(float));
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "WriteBinaryMesh: unable to create \"%s\"\n",
+                filename.c_str());
+        return false;
+    }
+    uint64_t written = 0;
+    bool ok = writeSection(fp, &written, 0, &header, sizeof(header)) &&
+              writeSection(fp, &written, header.indexOffset,
+                           indices.data(), indices.size() * sizeof(uint32_t));
+    for (int axis = 0; axis < 3; ++axis)
+        ok = ok && writeSection(fp, &written, header.pOffset[axis],
+                                p[axis].data(), nv * sizeof(float));
+    if (N)
+        for (int axis = 0; axis < 3; ++axis)
+            ok = ok && writeSection(fp, &written, header.nOffset[axis],
+                                    n[axis].data(), nv * sizeof(float));
+    if (uv)
+        ok = ok && writeSection(fp, &written, header.uvOffset, uvs.data(),
+                                uvs.size() * sizeof(float));
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "WriteBinaryMesh: unable to write \"%s\"\n",
+                filename.c_str());
+    return ok;
+}
+
+BinaryMesh* BinaryMesh::Open(const std::string& filename) {
+    MappedFile* file = MappedFile::Open(filename);
+    if (!file) {
+        fprintf(stderr, "BinaryMesh: unable to map \"%s\"\n", filename.c_str());
+        return NULL;
+    }
+    const BinaryMeshHeader* h = (const BinaryMeshHeader*)file->Data();
+    uint64_t size = file->Size();
+    const char* error = NULL;
+    if (size < sizeof(BinaryMeshHeader) ||
+        memcmp(h->magic, binaryMeshMagic, sizeof(h->magic)) != 0)
+        error = "not a binary mesh";
+    else if (h->version != BINARY_MESH_VERSION ||
+             h->byteOrder != BINARY_MESH_BYTE_ORDER)
+        error = "written by another version or byte order";
+    else {
+        // 每段都要按页对齐并且完整地在文件里, 必需的段不能缺
+        uint64_t nv = h->nverts;
+        uint64_t offsets[8] = {h->indexOffset, h->pOffset[0], h->pOffset[1],
+                               h->pOffset[2],  h->nOffset[0], h->nOffset[1],
+                               h->nOffset[2],  h->uvOffset};
+        uint64_t bytes[8] = {3 * uint64_t(h->ntris) * sizeof(uint32_t),
+                             nv * sizeof(float), nv * sizeof(float),
+                             nv * sizeof(float), nv * sizeof(float),
+                             nv * sizeof(float), nv * sizeof(float),
+                             2 * nv * sizeof(float)};
+        for (int i = 0; i < 8 && !error; ++i) {
+            if (offsets[i] == 0 && i < 4)
+                error = "missing index or position section";
+            else if (offsets[i] % binaryMeshPageSize != 0 ||
+                     offsets[i] + bytes[i] > size)
+                error = "truncated or corrupt section";
+        }
+        int nNormalAxes = (h->nOffset[0] != 0) + (h->nOffset[1] != 0) +
+                          (h->nOffset[2] != 0);
+        if (!error && nNormalAxes != 0 && nNormalAxes != 3)
+            error = "incomplete normal section";
+        // 下标越界会让求交读到映射外面, 顺便检查一遍
+        if (!error) {
+            const uint32_t* vi = (const uint32_t*)((const char*)h +
+                                                   h->indexOffset);
+            for (uint64_t i = 0; i < 3 * uint64_t(h->ntris); ++i)
+                if (vi[i] >= h->nverts) {
+                    error = "vertex index out of range";
+                    break;
+                }
+        }
+    }
+    if (error) {
+        fprintf(stderr, "BinaryMesh: \"%s\": %s\n", filename.c_str(), error);
+        delete file;
+        return NULL;
+    }
+    return new BinaryMesh(file);
+}
+
+void BinaryMesh::advise(uint64_t offset,
+                        size_t bytes,
+                        MappedFileAccess access) const {
+    if (offset)
+        file->Advise(offset, bytes, access);
+}
+
+void BinaryMesh::AdviseBuild() const {
+    size_t nv = header->nverts;
+    advise(header->indexOffset, 3 * size_t(header->ntris) * sizeof(uint32_t),
+           MAPPED_WILLNEED);
+    for (int axis = 0; axis < 3; ++axis)
+        advise(header->pOffset[axis], nv * sizeof(float), MAPPED_WILLNEED);
+}
+
+void BinaryMesh::AdviseRender() const {
+    size_t nv = header->nverts;
+    advise(header->indexOffset, 3 * size_t(header->ntris) * sizeof(uint32_t),
+           MAPPED_RANDOM);
+    for (int axis = 0; axis < 3; ++axis) {
+        advise(header->pOffset[axis], nv * sizeof(float), MAPPED_RANDOM);
+        advise(header->nOffset[axis], nv * sizeof(float), MAPPED_RANDOM);
+    }
+    advise(header->uvOffset, 2 * nv * sizeof(float), MAPPED_RANDOM);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/geometry.h"
+#include "core/mmap.h"
+
+// 二进制网格文件: 一个文件头, 后面是下标, 位置, 法线和 UV 几段,
+// 每段都从页边界开始. 位置和法线按轴分成三个 float 数组, 和
+// TriangleMesh 的 SoA 布局一样, 所以网格可以直接用映射的内存, 不用
+// 解析也不用拷贝, 同一个文件在多个渲染进程之间共用页缓存.
+// 文件头的版本或字节序对不上时打不开
+
+static const uint32_t BINARY_MESH_VERSION = 1;
+static const uint32_t BINARY_MESH_BYTE_ORDER = 0x01020304;
+
+struct BinaryMeshHeader {
+    char magic[8];
+    uint32_t version;
+    // 写入的机器上的 BINARY_MESH_BYTE_ORDER
+    uint32_t byteOrder;
+    uint32_t ntris, nverts;
+    // 各段在文件里的偏移, 没有法线或 UV 时为 0
+    uint64_t indexOffset;
+    uint64_t pOffset[3];
+    uint64_t nOffset[3];
+    uint64_t uvOffset;
+};
+
+// 写二进制网格. 三角形按质心的 Morton 顺序重排, 顶点按第一次被
+// 用到的顺序重新编号 (没用到的丢掉), 空间上挨着的三角形在文件里也
+// 挨着, 遍历和着色时碰到的页面更少. N, uv 可以为 NULL
+bool WriteBinaryMesh(const std::string& filename,
+                     int ntris,
+                     int nverts,
+                     const int* vptr,
+                     const Point* P,
+                     const Normal* N,
+                     const float* uv);
+
+// 映射好的二进制网格, 各段的指针在它被引用期间一直有效
+class BinaryMesh : public ReferenceCounted {
+   public:
+    // 文件打不开或者内容不对时打印原因并返回 NULL
+    static BinaryMesh* Open(const std::string& filename);
+
+    int NumTriangles() const { return header->ntris; }
+    int NumVertices() const { return header->nverts; }
+    const uint32_t* Indices() const {
+        return (const uint32_t*)section(header->indexOffset);
+    }
+    const float* P(int axis) const {
+        return (const float*)section(header->pOffset[axis]);
+    }
+    // 没有法线或 UV 时返回 NULL
+    const float* N(int axis) const {
+        return (const float*)section(header->nOffset[axis]);
+    }
+    const float* UVs() const {
+        return (const float*)section(header->uvOffset);
+    }
+    bool Contains(const void* p) const { return file->Contains(p); }
+
+    // 访问模式的提示. 构建 BVH 时要顺序读完下标和位置, 提前让内核
+    // 读进来; 建好以后只有命中时才按三角形随机读, 不再预读
+    void AdviseBuild() const;
+    void AdviseRender() const;
+
+   private:
+    BinaryMesh(MappedFile* f)
+        : file(f), header((const BinaryMeshHeader*)f->Data()) {}
+    const void* section(uint64_t offset) const {
+        return offset ? (const char*)file->Data() + offset : NULL;
+    }
+    void advise(uint64_t offset, size_t bytes, MappedFileAccess access) const;
+
+    Reference<MappedFile> file;
+    const BinaryMeshHeader* header;
+};
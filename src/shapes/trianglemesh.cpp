@@ -0,0 +1,648 @@
+#include "shapes/trianglemesh.h"
+#include "accelerators/bvhcache.h"
+#include "core/probes.h"
+#if defined(PBRT_HAS_AVX)
+#include <immintrin.h>
+#elif defined(PBRT_HAS_SSE)
+#include <emmintrin.h>
+#endif
+
+// TriangleMesh Method Definitions
+TriangleMesh::TriangleMesh(const AffineTransform* o2w,
+                           const AffineTransform* w2o,
+                           bool ro,
+                           int nt,
+                           int nv,
+                           const int* vi,
+                           const Point* P,
+                           const Normal* N,
+                           const Vector* S,
+                           const float* uv,
+                           BVHLayout layout,
+                           BVHSplitMethod splitMethod)
+    : Shape(o2w, w2o, ro) {
+    ntris = nt;
+    nverts = nv;
+    vertexIndex = new uint32_t[3 * ntris];
+    for (int i = 0; i < 3 * ntris; ++i)
+        vertexIndex[i] = (uint32_t)vi[i];
+
+    px = new float[nverts];
+    py = new float[nverts];
+    pz = new float[nverts];
+    nx = ny = nz = NULL;
+    if (N) {
+        nx = new float[nverts];
+        ny = new float[nverts];
+        nz = new float[nverts];
+    }
+    sx = sy = sz = NULL;
+    if (S) {
+        sx = new float[nverts];
+        sy = new float[nverts];
+        sz = new float[nverts];
+    }
+    setVertices(P, N, S);
+    uvs = NULL;
+    if (uv) {
+        uvs = new float[2 * nverts];
+        memcpy(uvs, uv, 2 * nverts * sizeof(float));
+    }
+    init(layout, splitMethod);
+}
+
+TriangleMesh::TriangleMesh(const AffineTransform* o2w,
+                           const AffineTransform* w2o,
+                           bool ro,
+                           const Reference<BinaryMesh>& mesh,
+                           BVHLayout layout,
+                           BVHSplitMethod splitMethod)
+    : Shape(o2w, w2o, ro), binaryMesh(mesh) {
+    ntris = mesh->NumTriangles();
+    nverts = mesh->NumVertices();
+    mesh->AdviseBuild();
+    // 下标和 UV 总是直接用映射的内存
+    vertexIndex = const_cast<uint32_t*>(mesh->Indices());
+    uvs = const_cast<float*>(mesh->UVs());
+    px = const_cast<float*>(mesh->P(0));
+    py = const_cast<float*>(mesh->P(1));
+    pz = const_cast<float*>(mesh->P(2));
+    nx = const_cast<float*>(mesh->N(0));
+    ny = const_cast<float*>(mesh->N(1));
+    nz = const_cast<float*>(mesh->N(2));
+    sx = sy = sz = NULL;
+    if (ObjectToWorld->IsIdentity()) {
+        // 物体空间就是世界空间, 位置和法线也不用拷贝
+        computeWorldBound();
+    } else {
+        ownVertices(true);
+        float* p[3] = {px, py, pz};
+        float* n[3] = {nx, ny, nz};
+        for (int axis = 0; axis < 3; ++axis) {
+            memcpy(p[axis], mesh->P(axis), nverts * sizeof(float));
+            if (nx)
+                memcpy(n[axis], mesh->N(axis), nverts * sizeof(float));
+        }
+        transformVertices(nx != NULL, false);
+    }
+    init(layout, splitMethod);
+    mesh->AdviseRender();
+}
+
+// BVH 只取决于下标, 世界空间的位置, 变换和构建参数,
+// 法线, 切线和 UV 变了不影响缓存
+uint64_t TriangleMesh::cacheKey(BVHLayout layout,
+                                BVHSplitMethod splitMethod) const {
+    BVHCacheKey key;
+    key.Add(ntris);
+    key.Add(nverts);
+    key.Add(vertexIndex, 3 * size_t(ntris) * sizeof(uint32_t));
+    key.Add(px, nverts * sizeof(float));
+    key.Add(py, nverts * sizeof(float));
+    key.Add(pz, nverts * sizeof(float));
+    key.Add(ObjectToWorld->GetMatrix().m);
+    key.Add(int(layout));
+    key.Add(int(splitMethod));
+    key.Add(TRIANGLE_BLOCK_SIZE);
+    return key.Value();
+}
+
+void TriangleMesh::init(BVHLayout layout, BVHSplitMethod splitMethod) {
+    // 句柄在遍历时反复临时构造, 所以在这里每个三角形报告一次
+    for (int i = 0; i < ntris; ++i) {
+        Triangle tri(i);
+        PBRT_CREATED_TRIANGLE(&tri);
+    }
+    PBRT_BVH_STARTED_CONSTRUCTION(this, ntris);
+    bool useCache = BVHCacheEnabled() && ntris > 0;
+    uint64_t key = useCache ? cacheKey(layout, splitMethod) : 0;
+    bool cached = useCache && loadTree(key, layout);
+    if (!cached) {
+        buildTree(layout, splitMethod);
+        if (useCache) {
+            vector<uint32_t> order(leafTris.size());
+            for (uint32_t i = 0; i < order.size(); ++i)
+                order[i] = leafTris[i].index;
+            tree.SaveCache(key, order);
+        }
+    }
+    PBRT_BVH_FINISHED_CONSTRUCTION(this);
+    PBRT_CREATED_TRIANGLE_MESH(this, ntris, MemoryUsage());
+}
+
+void TriangleMesh::buildTree(BVHLayout layout, BVHSplitMethod splitMethod) {
+    vector<BBox> triBounds(ntris);
+    for (int i = 0; i < ntris; ++i)
+        triBounds[i] = Triangle(i).WorldBound(*this);
+    vector<uint32_t> triOrder;
+    tree.Build(triBounds, TRIANGLE_BLOCK_SIZE, layout, &triOrder,
+               TRIANGLE_BLOCK_SIZE, splitMethod);
+    // 每个叶子的三角形从块的边界开始排, 叶子改为指向它的第一个块.
+    // 叶子不满时只空出几个 4 字节的下标, 不是整个块的顶点
+    leafTris.reserve(ntris + ntris / 2);
+    tree.RemapLeaves([&](uint32_t offset, uint32_t n) {
+        uint32_t first = (uint32_t)leafTris.size() / TRIANGLE_BLOCK_SIZE;
+        for (uint32_t i = 0; i < n; ++i)
+            leafTris.push_back(Triangle(triOrder[offset + i]));
+        while (leafTris.size() % TRIANGLE_BLOCK_SIZE)
+            leafTris.push_back(Triangle(~0u));
+        return first;
+    });
+    leafTris.shrink_to_fit();
+}
+
+bool TriangleMesh::loadTree(uint64_t key, BVHLayout layout) {
+    const uint32_t* order;
+    uint32_t n;
+    if (!tree.LoadCache(key, layout, TRIANGLE_BLOCK_SIZE, &order, &n) ||
+        n % TRIANGLE_BLOCK_SIZE != 0)
+        return false;
+    // 节点已经指向块了, 三角形顺序原样拿过来
+    leafTris.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        // 哈希相同而内容不符的文件不应该出现, 出现了就重新构建
+        if (order[i] != ~0u && order[i] >= (uint32_t)ntris) {
+            vector<Triangle>().swap(leafTris);
+            return false;
+        }
+        leafTris[i] = Triangle(order[i]);
+    }
+    return true;
+}
+
+TriangleMesh::~TriangleMesh() {
+    // 映射来的数组随 binaryMesh 一起释放
+    if (!isMapped(vertexIndex))
+        delete[] vertexIndex;
+    float* arrays[] = {px, py, pz, nx, ny, nz, sx, sy, sz, uvs};
+    for (float* a : arrays)
+        if (!isMapped(a))
+            delete[] a;
+}
+
+// 映射来的顶点是只读的, 要改写之前换成自己的数组
+void TriangleMesh::ownVertices(bool normals) {
+    if (isMapped(px)) {
+        px = new float[nverts];
+        py = new float[nverts];
+        pz = new float[nverts];
+    }
+    if (normals && isMapped(nx)) {
+        nx = new float[nverts];
+        ny = new float[nverts];
+        nz = new float[nverts];
+    }
+}
+
+// 拷贝成 SoA 再整体变换到世界空间, 之后求交不再需要变换光线
+void TriangleMesh::setVertices(const Point* P,
+                               const Normal* N,
+                               const Vector* S) {
+    ownVertices(N != NULL);
+    for (int i = 0; i < nverts; ++i) {
+        px[i] = P[i].x;
+        py[i] = P[i].y;
+        pz[i] = P[i].z;
+    }
+    if (N && nx)
+        for (int i = 0; i < nverts; ++i) {
+            nx[i] = N[i].x;
+            ny[i] = N[i].y;
+            nz[i] = N[i].z;
+        }
+    if (S && sx)
+        for (int i = 0; i < nverts; ++i) {
+            sx[i] = S[i].x;
+            sy[i] = S[i].y;
+            sz[i] = S[i].z;
+        }
+    transformVertices(N && nx, S && sx);
+}
+
+// 就地把物体空间的位置 (和法线, 切线) 变换到世界空间
+void TriangleMesh::transformVertices(bool normals, bool tangents) {
+    Transform o2wFull = ObjectToWorld->ToTransform();
+    o2wFull.TransformPoints(nverts, px, py, pz, px, py, pz);
+    if (normals)
+        o2wFull.TransformNormals(nverts, nx, ny, nz, nx, ny, nz);
+    if (tangents)
+        o2wFull.TransformVectors(nverts, sx, sy, sz, sx, sy, sz);
+    computeWorldBound();
+}
+
+void TriangleMesh::computeWorldBound() {
+    worldBound = BBox();
+    for (int i = 0; i < nverts; ++i)
+        worldBound = Union(worldBound, Point(px[i], py[i], pz[i]));
+}
+
+float TriangleMesh::UpdateVertices(const Point* P,
+                                   const Normal* N,
+                                   const Vector* S,
+                                   float rebuildThreshold) {
+    setVertices(P, N, S);
+    // 叶子和三角形的顺序不变, 只重算叶子的包围盒
+    return tree.Refit(
+        [&](uint32_t offset, uint32_t n) {
+            const Triangle* tris = &leafTris[offset * TRIANGLE_BLOCK_SIZE];
+            BBox b;
+            for (uint32_t i = 0; i < n; ++i)
+                b = Union(b, tris[i].WorldBound(*this));
+            return b;
+        },
+        rebuildThreshold);
+}
+
+size_t TriangleMesh::MemoryUsage() const {
+    size_t perVertex = 3 * sizeof(float);
+    if (nx)
+        perVertex += 3 * sizeof(float);
+    if (sx)
+        perVertex += 3 * sizeof(float);
+    if (uvs)
+        perVertex += 2 * sizeof(float);
+    return sizeof(*this) + size_t(nverts) * perVertex +
+           size_t(ntris) * 3 * sizeof(uint32_t) +
+           leafTris.capacity() * sizeof(Triangle) + tree.MemoryUsage();
+}
+
+BBox TriangleMesh::objectBound() const {
+    return (*WorldToObject)(worldBound);
+}
+
+BBox TriangleMesh::WorldBound() const {
+    return worldBound;
+}
+
+bool TriangleMesh::Intersect(const Ray& r,
+                             float* tHit,
+                             float* rayEpsilon,
+                             DifferentialGeometry* dg) const {
+    if (tree.Empty())
+        return false;
+    PBRT_BVH_INTERSECTION_STARTED(const_cast<TriangleMesh*>(this),
+                                  const_cast<Ray*>(&r));
+    TraversalRay ray(r);
+    // 每次命中都缩短 maxt, 最后只为最近的三角形构造 dg
+    const Triangle* hitTri = NULL;
+    float hb0 = 0.f, hb1 = 0.f, hb2 = 0.f;
+    tree.IntersectLeaves(
+        ray, [&](uint32_t offset, uint32_t n, const TraversalRay& tr) {
+            bool hit = false;
+            for (uint32_t first = 0; first < n;
+                 first += TRIANGLE_BLOCK_SIZE, ++offset) {
+                const Triangle* tris = &leafTris[offset * TRIANGLE_BLOCK_SIZE];
+                uint32_t count = min(n - first, (uint32_t)TRIANGLE_BLOCK_SIZE);
+                for (uint32_t i = 0; i < count; ++i)
+                    PBRT_RAY_TRIANGLE_INTERSECTION_TEST(&r, &tris[i]);
+                float t[TRIANGLE_BLOCK_SIZE], b[3][TRIANGLE_BLOCK_SIZE];
+                int mask = intersectBlock(offset, count, tr, t, b);
+                if (!mask)
+                    continue;
+                // 块里可能同时命中几个, 取最近的
+                for (uint32_t i = 0; i < count; ++i) {
+                    if (!(mask & (1 << i)) || t[i] > tr.maxt)
+                        continue;
+                    PBRT_RAY_TRIANGLE_INTERSECTION_HIT(&r, t[i]);
+                    tr.maxt = t[i];
+                    hitTri = &tris[i];
+                    hb0 = b[0][i];
+                    hb1 = b[1][i];
+                    hb2 = b[2][i];
+                    hit = true;
+                }
+            }
+            return hit;
+        });
+    PBRT_BVH_INTERSECTION_FINISHED();
+    if (!hitTri)
+        return false;
+    GetDifferentialGeometry(hitTri->index, hb0, hb1, hb2, dg);
+    *tHit = ray.maxt;
+    *rayEpsilon = 1e-3f * *tHit;
+    r.maxt = *tHit;
+    return true;
+}
+
+bool TriangleMesh::IntersectP(const Ray& r) const {
+    if (tree.Empty())
+        return false;
+    PBRT_BVH_INTERSECTIONP_STARTED(const_cast<TriangleMesh*>(this),
+                                   const_cast<Ray*>(&r));
+    TraversalRay ray(r);
+    bool hit = tree.IntersectPLeaves(
+        ray, [&](uint32_t offset, uint32_t n, const TraversalRay& tr) {
+            for (uint32_t first = 0; first < n;
+                 first += TRIANGLE_BLOCK_SIZE, ++offset) {
+                const Triangle* tris = &leafTris[offset * TRIANGLE_BLOCK_SIZE];
+                uint32_t count = min(n - first, (uint32_t)TRIANGLE_BLOCK_SIZE);
+                for (uint32_t i = 0; i < count; ++i)
+                    PBRT_RAY_TRIANGLE_INTERSECTIONP_TEST(&r, &tris[i]);
+                float t[TRIANGLE_BLOCK_SIZE], b[3][TRIANGLE_BLOCK_SIZE];
+                int mask = intersectBlock(offset, count, tr, t, b);
+                for (uint32_t i = 0; i < count; ++i)
+                    if (mask & (1 << i)) {
+                        PBRT_RAY_TRIANGLE_INTERSECTIONP_HIT(&r, t[i]);
+                        return true;
+                    }
+            }
+            return false;
+        });
+    PBRT_BVH_INTERSECTIONP_FINISHED();
+    return hit;
+}
+
+void TriangleMesh::GetUVs(uint32_t tri, float uv[3][2]) const {
+    const uint32_t* v = VertexIndices(tri);
+    if (uvs) {
+        for (int i = 0; i < 3; ++i) {
+            uv[i][0] = uvs[2 * v[i]];
+            uv[i][1] = uvs[2 * v[i] + 1];
+        }
+    } else {
+        uv[0][0] = 0.f;
+        uv[0][1] = 0.f;
+        uv[1][0] = 1.f;
+        uv[1][1] = 0.f;
+        uv[2][0] = 1.f;
+        uv[2][1] = 1.f;
+    }
+}
+
+void TriangleMesh::GetDifferentialGeometry(uint32_t tri,
+                                           float b0,
+                                           float b1,
+                                           float b2,
+                                           DifferentialGeometry* dg) const {
+    const uint32_t* v = VertexIndices(tri);
+    Point p1 = P(v[0]), p2 = P(v[1]), p3 = P(v[2]);
+
+    // 由 uv 的差分求 dpdu, dpdv
+    float uv[3][2];
+    GetUVs(tri, uv);
+    float du1 = uv[0][0] - uv[2][0];
+    float du2 = uv[1][0] - uv[2][0];
+    float dv1 = uv[0][1] - uv[2][1];
+    float dv2 = uv[1][1] - uv[2][1];
+    Vector dp1 = p1 - p3, dp2 = p2 - p3;
+    Vector dpdu, dpdv;
+    float determinant = du1 * dv2 - dv1 * du2;
+    if (determinant == 0.f) {
+        // uv 退化时随便取一组和法线正交的切向量
+        CoordinateSystem(Normalize(Cross(p3 - p1, p2 - p1)), &dpdu, &dpdv);
+    } else {
+        float invdet = 1.f / determinant;
+        dpdu = (dv2 * dp1 - dv1 * dp2) * invdet;
+        dpdv = (-du2 * dp1 + du1 * dp2) * invdet;
+    }
+
+    float tu = b0 * uv[0][0] + b1 * uv[1][0] + b2 * uv[2][0];
+    float tv = b0 * uv[0][1] + b1 * uv[1][1] + b2 * uv[2][1];
+    Point pHit = b0 * p1 + b1 * p2 + b2 * p3;
+    *dg = DifferentialGeometry(pHit, dpdu, dpdv, Normal(0, 0, 0),
+                               Normal(0, 0, 0), tu, tv, this);
+}
+
+// Triangle Method Definitions
+Triangle::Triangle(uint32_t n) : index(n) {}
+
+BBox Triangle::WorldBound(const TriangleMesh& mesh) const {
+    const uint32_t* v = mesh.VertexIndices(index);
+    return Union(BBox(mesh.P(v[0]), mesh.P(v[1])), mesh.P(v[2]));
+}
+
+bool Triangle::Intersect(const TriangleMesh& mesh,
+                         const TraversalRay& ray,
+                         float* tHit,
+                         float* b0,
+                         float* b1,
+                         float* b2) const {
+    const uint32_t* v = mesh.VertexIndices(index);
+    // 顶点平移到光线原点, 按光线的轴重排, 再剪切成沿 +z 的光线
+    Vector a0 = mesh.P(v[0]) - ray.o;
+    Vector a1 = mesh.P(v[1]) - ray.o;
+    Vector a2 = mesh.P(v[2]) - ray.o;
+    float p0z = a0[ray.kz], p1z = a1[ray.kz], p2z = a2[ray.kz];
+    float p0x = a0[ray.kx] - ray.Sx * p0z, p0y = a0[ray.ky] - ray.Sy * p0z;
+    float p1x = a1[ray.kx] - ray.Sx * p1z, p1y = a1[ray.ky] - ray.Sy * p1z;
+    float p2x = a2[ray.kx] - ray.Sx * p2z, p2y = a2[ray.ky] - ray.Sy * p2z;
+
+    // 2D 边函数, 符号不一致说明原点在三角形外
+    float e0 = p1x * p2y - p1y * p2x;
+    float e1 = p2x * p0y - p2y * p0x;
+    float e2 = p0x * p1y - p0y * p1x;
+    if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) &&
+        (e0 > 0.f || e1 > 0.f || e2 > 0.f))
+        return false;
+    float det = e0 + e1 + e2;
+    if (det == 0.f)
+        return false;
+
+    // 先不做除法, 用缩放后的 t 和区间比较
+    float tScaled = (e0 * p0z + e1 * p1z + e2 * p2z) * ray.Sz;
+    if (det < 0.f && (tScaled >= ray.mint * det || tScaled < ray.maxt * det))
+        return false;
+    if (det > 0.f && (tScaled <= ray.mint * det || tScaled > ray.maxt * det))
+        return false;
+
+    float invDet = 1.f / det;
+    *b0 = e0 * invDet;
+    *b1 = e1 * invDet;
+    *b2 = e2 * invDet;
+    *tHit = tScaled * invDet;
+    return true;
+}
+
+bool Triangle::IntersectP(const TriangleMesh& mesh,
+                          const TraversalRay& ray) const {
+    float t, b0, b1, b2;
+    return Intersect(mesh, ray, &t, &b0, &b1, &b2);
+}
+
+// TriangleBlock Method Definitions
+template <int N>
+void TriangleBlock<N>::Gather(const TriangleMesh& mesh,
+                              const Triangle* tris,
+                              int n) {
+    // 空位重复第一个三角形, 调用者按 n 屏蔽掉它们的结果
+    const uint32_t* v[N];
+    for (int i = 0; i < N; ++i)
+        v[i] = mesh.VertexIndices(tris[i < n ? i : 0].index);
+    for (int j = 0; j < 3; ++j) {
+#ifdef PBRT_HAS_SSE
+        // 每 4 个 lane 先在寄存器里拼好再整体写入. 逐个 float 写进去
+        // 再用 SIMD 读出来, 存储转发会失败, 每次读都要等写完
+        for (int i = 0; i < N; i += 4) {
+            Point a = mesh.P(v[i][j]), b = mesh.P(v[i + 1][j]);
+            Point c = mesh.P(v[i + 2][j]), d = mesh.P(v[i + 3][j]);
+            _mm_store_ps(&p[j][0][i], _mm_setr_ps(a.x, b.x, c.x, d.x));
+            _mm_store_ps(&p[j][1][i], _mm_setr_ps(a.y, b.y, c.y, d.y));
+            _mm_store_ps(&p[j][2][i], _mm_setr_ps(a.z, b.z, c.z, d.z));
+        }
+#else
+        for (int i = 0; i < N; ++i) {
+            Point pj = mesh.P(v[i][j]);
+            p[j][0][i] = pj.x;
+            p[j][1][i] = pj.y;
+            p[j][2][i] = pj.z;
+        }
+#endif
+    }
+}
+
+template void TriangleBlock<4>::Gather(const TriangleMesh& mesh,
+                                       const Triangle* tris,
+                                       int n);
+template void TriangleBlock<8>::Gather(const TriangleMesh& mesh,
+                                       const Triangle* tris,
+                                       int n);
+
+#ifdef PBRT_HAS_SSE
+// 4 个三角形的不漏缝测试. p 指向 [3][3][stride] 布局里这 4 个三角形的
+// 起点, 结果写到 tHit 和 b0, b1, b2 开始的 4 个位置
+static inline int IntersectTriangles4(const float* p,
+                                      int stride,
+                                      const TraversalRay& ray,
+                                      float* tHit,
+                                      float* b0,
+                                      float* b1,
+                                      float* b2) {
+    const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    __m128 ox = _mm_set1_ps(ray.o[kx]), oy = _mm_set1_ps(ray.o[ky]),
+           oz = _mm_set1_ps(ray.o[kz]);
+    __m128 Sx = _mm_set1_ps(ray.Sx), Sy = _mm_set1_ps(ray.Sy);
+#define VERT(v, axis) _mm_load_ps(p + ((v)*3 + (axis)) * stride)
+    // 平移到光线原点, 按光线的轴重排, 再剪切成沿 +z 的光线
+    __m128 px[3], py[3], pz[3];
+    for (int v = 0; v < 3; ++v) {
+        pz[v] = _mm_sub_ps(VERT(v, kz), oz);
+        px[v] = _mm_sub_ps(_mm_sub_ps(VERT(v, kx), ox), _mm_mul_ps(Sx, pz[v]));
+        py[v] = _mm_sub_ps(_mm_sub_ps(VERT(v, ky), oy), _mm_mul_ps(Sy, pz[v]));
+    }
+#undef VERT
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(px[1], py[2]), _mm_mul_ps(py[1], px[2]));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(px[2], py[0]), _mm_mul_ps(py[2], px[0]));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(px[0], py[1]), _mm_mul_ps(py[0], px[1]));
+
+    // 边函数同时有正有负时原点在三角形外
+    __m128 zero = _mm_setzero_ps();
+    __m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero),
+                                        _mm_cmplt_ps(e1, zero)),
+                              _mm_cmplt_ps(e2, zero));
+    __m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero),
+                                        _mm_cmpgt_ps(e1, zero)),
+                              _mm_cmpgt_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 valid =
+        _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+
+    // 按 det 的符号翻转以后和 [mint, maxt] 比较
+    __m128 tScaled = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, pz[0]), _mm_mul_ps(e1, pz[1])),
+                   _mm_mul_ps(e2, pz[2])),
+        _mm_set1_ps(ray.Sz));
+    __m128 detSign = _mm_and_ps(det, _mm_set1_ps(-0.f));
+    __m128 absDet = _mm_xor_ps(det, detSign);
+    __m128 tSigned = _mm_xor_ps(tScaled, detSign);
+    valid = _mm_and_ps(
+        valid, _mm_cmpgt_ps(tSigned, _mm_mul_ps(_mm_set1_ps(ray.mint), absDet)));
+    valid = _mm_and_ps(
+        valid, _mm_cmple_ps(tSigned, _mm_mul_ps(_mm_set1_ps(ray.maxt), absDet)));
+    int mask = _mm_movemask_ps(valid);
+    if (!mask)
+        return 0;
+
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+    _mm_storeu_ps(tHit, _mm_mul_ps(tScaled, invDet));
+    _mm_storeu_ps(b0, _mm_mul_ps(e0, invDet));
+    _mm_storeu_ps(b1, _mm_mul_ps(e1, invDet));
+    _mm_storeu_ps(b2, _mm_mul_ps(e2, invDet));
+    return mask;
+}
+
+template <>
+int TriangleBlock<4>::Intersect(const TraversalRay& ray,
+                                float tHit[4],
+                                float b[3][4]) const {
+    return IntersectTriangles4(&p[0][0][0], 4, ray, tHit, b[0], b[1], b[2]);
+}
+#endif  // PBRT_HAS_SSE
+
+#ifdef PBRT_HAS_AVX
+template <>
+int TriangleBlock<8>::Intersect(const TraversalRay& ray,
+                                float tHit[8],
+                                float b[3][8]) const {
+    const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    __m256 ox = _mm256_set1_ps(ray.o[kx]), oy = _mm256_set1_ps(ray.o[ky]),
+           oz = _mm256_set1_ps(ray.o[kz]);
+    __m256 Sx = _mm256_set1_ps(ray.Sx), Sy = _mm256_set1_ps(ray.Sy);
+    __m256 px[3], py[3], pz[3];
+    for (int v = 0; v < 3; ++v) {
+        pz[v] = _mm256_sub_ps(_mm256_load_ps(p[v][kz]), oz);
+        px[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p[v][kx]), ox),
+                              _mm256_mul_ps(Sx, pz[v]));
+        py[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p[v][ky]), oy),
+                              _mm256_mul_ps(Sy, pz[v]));
+    }
+    __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(px[1], py[2]),
+                              _mm256_mul_ps(py[1], px[2]));
+    __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(px[2], py[0]),
+                              _mm256_mul_ps(py[2], px[0]));
+    __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(px[0], py[1]),
+                              _mm256_mul_ps(py[0], px[1]));
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 anyNeg =
+        _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ),
+                                  _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+                     _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+    __m256 anyPos =
+        _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ),
+                                  _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+                     _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 valid = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos),
+                                    _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+
+    __m256 tScaled = _mm256_mul_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, pz[0]),
+                                    _mm256_mul_ps(e1, pz[1])),
+                      _mm256_mul_ps(e2, pz[2])),
+        _mm256_set1_ps(ray.Sz));
+    __m256 detSign = _mm256_and_ps(det, _mm256_set1_ps(-0.f));
+    __m256 absDet = _mm256_xor_ps(det, detSign);
+    __m256 tSigned = _mm256_xor_ps(tScaled, detSign);
+    valid = _mm256_and_ps(
+        valid,
+        _mm256_cmp_ps(tSigned,
+                      _mm256_mul_ps(_mm256_set1_ps(ray.mint), absDet),
+                      _CMP_GT_OQ));
+    valid = _mm256_and_ps(
+        valid,
+        _mm256_cmp_ps(tSigned,
+                      _mm256_mul_ps(_mm256_set1_ps(ray.maxt), absDet),
+                      _CMP_LE_OQ));
+    int mask = _mm256_movemask_ps(valid);
+    if (!mask)
+        return 0;
+
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+    _mm256_storeu_ps(tHit, _mm256_mul_ps(tScaled, invDet));
+    _mm256_storeu_ps(b[0], _mm256_mul_ps(e0, invDet));
+    _mm256_storeu_ps(b[1], _mm256_mul_ps(e1, invDet));
+    _mm256_storeu_ps(b[2], _mm256_mul_ps(e2, invDet));
+    return mask;
+}
+#elif defined(PBRT_HAS_SSE)
+// 没有 AVX 时分两半用 SSE 测
+template <>
+int TriangleBlock<8>::Intersect(const TraversalRay& ray,
+                                float tHit[8],
+                                float b[3][8]) const {
+    return IntersectTriangles4(&p[0][0][0], 8, ray, tHit, b[0], b[1], b[2]) |
+           (IntersectTriangles4(&p[0][0][4], 8, ray, tHit + 4, b[0] + 4,
+                                b[1] + 4, b[2] + 4)
+            << 4);
+}
+#endif  // PBRT_HAS_AVX
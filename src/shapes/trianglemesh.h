@@ -0,0 +1,210 @@
+#pragma once
+
+#include "core/pbrt.h"
+#include "core/shape.h"
+#include "accelerators/bvh.h"
+#include "shapes/binarymesh.h"
+
+class TriangleMesh;
+
+// 三角形只是网格里的一个下标, 顶点数据都在 TriangleMesh 里.
+// 不是 Shape, 没有虚函数表也没有自己的变换指针, 只占 4 个字节
+class Triangle {
+   public:
+    Triangle() {}
+    explicit Triangle(uint32_t n);
+
+    BBox WorldBound(const TriangleMesh& mesh) const;
+    // 不漏缝的求交, 命中时返回 t 和三个顶点的重心坐标
+    bool Intersect(const TriangleMesh& mesh,
+                   const TraversalRay& ray,
+                   float* tHit,
+                   float* b0,
+                   float* b1,
+                   float* b2) const;
+    bool IntersectP(const TriangleMesh& mesh, const TraversalRay& ray) const;
+
+    uint32_t index;
+};
+
+// N 个三角形的 SoA 块, 测试叶子时在栈上临时收集: 网格里只存共享的
+// 顶点和按叶子排好的三角形下标, 不为每个块再存一份顶点坐标.
+// BVH 叶子里的三角形一次 SIMD 测完
+template <int N>
+struct TriangleBlock {
+    // 收集 tris 里前 n 个三角形的顶点. tris 要有 N 个可读的位置,
+    // 后面的 lane 内容不定, 结果要按 n 屏蔽
+    void Gather(const TriangleMesh& mesh, const Triangle* tris, int n);
+
+    // 和 Triangle::Intersect 相同的不漏缝测试. 返回命中掩码, 第 i 位
+    // 对应第 i 个三角形; 每个 lane 的 t 和重心坐标写入 tHit, b
+    int Intersect(const TraversalRay& ray, float tHit[N], float b[3][N]) const;
+
+    alignas(32) float p[3][3][N];  // [顶点][轴][lane]
+};
+
+// 叶子按块对齐, 最多装一个块. 有 AVX 时一次测 8 个三角形, 否则 4 个
+#ifdef PBRT_HAS_AVX
+static const int TRIANGLE_BLOCK_SIZE = 8;
+#else
+static const int TRIANGLE_BLOCK_SIZE = 4;
+#endif
+typedef TriangleBlock<TRIANGLE_BLOCK_SIZE> MeshTriangleBlock;
+
+// 标量版本, 没有 SIMD 时使用
+template <int N>
+int TriangleBlock<N>::Intersect(const TraversalRay& ray,
+                                float tHit[N],
+                                float b[3][N]) const {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float px[3], py[3], pz[3];
+        for (int v = 0; v < 3; ++v) {
+            pz[v] = p[v][ray.kz][i] - ray.o[ray.kz];
+            px[v] = p[v][ray.kx][i] - ray.o[ray.kx] - ray.Sx * pz[v];
+            py[v] = p[v][ray.ky][i] - ray.o[ray.ky] - ray.Sy * pz[v];
+        }
+        float e0 = px[1] * py[2] - py[1] * px[2];
+        float e1 = px[2] * py[0] - py[2] * px[0];
+        float e2 = px[0] * py[1] - py[0] * px[1];
+        if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) &&
+            (e0 > 0.f || e1 > 0.f || e2 > 0.f))
+            continue;
+        float det = e0 + e1 + e2;
+        if (det == 0.f)
+            continue;
+        // 按 det 的符号翻转以后和 [mint, maxt] 比较, 不用先做除法
+        float tScaled = (e0 * pz[0] + e1 * pz[1] + e2 * pz[2]) * ray.Sz;
+        float absDet = fabsf(det);
+        if (det < 0.f)
+            tScaled = -tScaled;
+        if (tScaled <= ray.mint * absDet || tScaled > ray.maxt * absDet)
+            continue;
+        float invDet = 1.f / det;
+        b[0][i] = e0 * invDet;
+        b[1][i] = e1 * invDet;
+        b[2][i] = e2 * invDet;
+        tHit[i] = tScaled / absDet;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_HAS_SSE
+template <>
+int TriangleBlock<4>::Intersect(const TraversalRay& ray,
+                                float tHit[4],
+                                float b[3][4]) const;
+template <>
+int TriangleBlock<8>::Intersect(const TraversalRay& ray,
+                                float tHit[8],
+                                float b[3][8]) const;
+#endif
+
+// 三角网格: 顶点位置, 法线, 切线和 UV 都是网格自己持有的 SoA 数组,
+// 用 32 位下标索引. 位置在构造时一次性变换到世界空间.
+// 网格自带一棵建在三角形上的 BVH, 叶子指向 leafTris 里按块对齐的一段
+class TriangleMesh : public Shape {
+   public:
+    // N, S, uv 可以为 NULL
+    TriangleMesh(const AffineTransform* o2w,
+                 const AffineTransform* w2o,
+                 bool ro,
+                 int ntris,
+                 int nverts,
+                 const int* vptr,
+                 const Point* P,
+                 const Normal* N,
+                 const Vector* S,
+                 const float* uv,
+                 BVHLayout layout = BVH_BINARY,
+                 BVHSplitMethod splitMethod = BVH_SPLIT_SAH);
+    // 直接用映射的二进制网格. 下标和 UV 总是不拷贝; 物体到世界是
+    // 单位变换时位置和法线也不拷贝, 否则变换到自己的数组里
+    TriangleMesh(const AffineTransform* o2w,
+                 const AffineTransform* w2o,
+                 bool ro,
+                 const Reference<BinaryMesh>& mesh,
+                 BVHLayout layout = BVH_BINARY,
+                 BVHSplitMethod splitMethod = BVH_SPLIT_SAH);
+    ~TriangleMesh();
+
+    BBox objectBound() const;
+    BBox WorldBound() const;
+    bool Intersect(const Ray& ray,
+                   float* tHit,
+                   float* rayEpsilon,
+                   DifferentialGeometry* dg) const;
+    bool IntersectP(const Ray& ray) const;
+
+    // 只给最终最近的命中构造微分几何, 求交过程中不做
+    void GetDifferentialGeometry(uint32_t tri,
+                                 float b0,
+                                 float b1,
+                                 float b2,
+                                 DifferentialGeometry* dg) const;
+    void GetUVs(uint32_t tri, float uv[3][2]) const;
+
+    // 动画网格换一帧的顶点: 拓扑不变, 参数和构造时一样 (物体空间,
+    // N, S 可以为 NULL). BVH 只重新拟合, 返回值同 BVHTree::Refit
+    float UpdateVertices(const Point* P,
+                         const Normal* N = NULL,
+                         const Vector* S = NULL,
+                         float rebuildThreshold = BVH_REBUILD_THRESHOLD);
+
+    int NumTriangles() const { return ntris; }
+    int NumVertices() const { return nverts; }
+    const uint32_t* VertexIndices(uint32_t tri) const {
+        return &vertexIndex[3 * tri];
+    }
+    Point P(uint32_t v) const { return Point(px[v], py[v], pz[v]); }
+    bool HasNormals() const { return nx != NULL; }
+    Normal N(uint32_t v) const { return Normal(nx[v], ny[v], nz[v]); }
+
+    // 网格和它的三角形一共占用的字节数
+    size_t MemoryUsage() const;
+    float BytesPerTriangle() const {
+        return ntris ? float(MemoryUsage()) / float(ntris) : 0.f;
+    }
+
+   protected:
+    void init(BVHLayout layout, BVHSplitMethod splitMethod);
+    void setVertices(const Point* P, const Normal* N, const Vector* S);
+    void transformVertices(bool normals, bool tangents);
+    void computeWorldBound();
+    void ownVertices(bool normals);
+    bool isMapped(const void* p) const {
+        return binaryMesh && binaryMesh->Contains(p);
+    }
+    uint64_t cacheKey(BVHLayout layout, BVHSplitMethod splitMethod) const;
+    // 建树并把每个叶子的三角形按块对齐排进 leafTris
+    void buildTree(BVHLayout layout, BVHSplitMethod splitMethod);
+    // 从缓存映射树, leafTris 就是缓存里保存的图元顺序
+    bool loadTree(uint64_t key, BVHLayout layout);
+    // 测试从第 block 个块开始的 n 个三角形, 返回值同 TriangleBlock::Intersect
+    int intersectBlock(uint32_t block,
+                       uint32_t n,
+                       const TraversalRay& ray,
+                       float tHit[TRIANGLE_BLOCK_SIZE],
+                       float b[3][TRIANGLE_BLOCK_SIZE]) const {
+        MeshTriangleBlock tris;
+        tris.Gather(*this, &leafTris[block * TRIANGLE_BLOCK_SIZE], n);
+        return tris.Intersect(ray, tHit, b) & ((1 << n) - 1);
+    }
+
+    // TriangleMesh Protected Data
+    int ntris, nverts;
+    uint32_t* vertexIndex;
+    // 世界空间的顶点位置
+    float *px, *py, *pz;
+    // 可选的顶点属性, 没有时为 NULL
+    float *nx, *ny, *nz;
+    float *sx, *sy, *sz;
+    float* uvs;
+    // 叶子顺序的三角形, 每个叶子从块的边界开始, 空位是 ~0u
+    vector<Triangle> leafTris;
+    BVHTree tree;
+    BBox worldBound;
+    // 从二进制网格构造时, 上面的数组可能指向它的映射
+    Reference<BinaryMesh> binaryMesh;
+};
@@ -0,0 +1,128 @@
+#include "core/pbrt.h"
+#include "core/geometry.h"
+#include <stdlib.h>
+#include <chrono>
+
+// 包围盒测试的吞吐量.
+// 用法: bboxbench [盒子数, 默认 4096] [光线数, 默认 2048]
+// 单独的程序, 不和 main/pbrt.cpp 一起链接.
+// 每条光线和所有盒子各测一次, 比较每次测试都做除法的 Ray 版本,
+// 预先算好倒数的 TraversalRay 版本, 以及 BBox4/BBox8 的 SoA 版本
+
+static double Now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static float RandomFloat() {
+    return rand() / (float)RAND_MAX;
+}
+
+static int CountBits(int mask) {
+    int n = 0;
+    for (; mask; mask &= mask - 1)
+        ++n;
+    return n;
+}
+
+// 跑三遍取最快的一遍, 打印每秒百万个盒子.
+// 命中数也打出来, 各个版本应该一样, 也防止编译器把循环删掉
+template <typename Func>
+static void Report(const char* name, double nTests, Func func) {
+    double best = INFINITY;
+    uint64_t hits = 0;
+    for (int pass = 0; pass < 3; ++pass) {
+        double start = Now();
+        hits = func();
+        best = min(best, Now() - start);
+    }
+    printf("%-26s %8.1f M boxes/s %6.2f ns/box (%llu hits)\n", name,
+           nTests / best * 1e-6, best / nTests * 1e9,
+           (unsigned long long)hits);
+}
+
+int main(int argc, const char** argv) {
+    int nBoxes = argc > 1 ? atoi(argv[1]) : 4096;
+    int nRays = argc > 2 ? atoi(argv[2]) : 2048;
+    // SoA 版本按 8 个一组存, 盒子数取 8 的倍数
+    nBoxes = max(8, nBoxes & ~7);
+    srand(1);
+
+    // 边长 0 到 2 的盒子, 随机撒在 [-10, 10]^3 里
+    vector<BBox> boxes;
+    vector<BBox4> boxes4(nBoxes / 4);
+    vector<BBox8> boxes8(nBoxes / 8);
+    for (int i = 0; i < nBoxes; ++i) {
+        Point c(RandomFloat() * 20.f - 10.f, RandomFloat() * 20.f - 10.f,
+                RandomFloat() * 20.f - 10.f);
+        Vector size(RandomFloat(), RandomFloat(), RandomFloat());
+        boxes.push_back(BBox(c, c + 2.f * size));
+        boxes4[i / 4].Set(i % 4, boxes[i]);
+        boxes8[i / 8].Set(i % 8, boxes[i]);
+    }
+    vector<Ray> rays;
+    vector<TraversalRay> traversalRays;
+    for (int i = 0; i < nRays; ++i) {
+        Point o(RandomFloat() * 20.f - 10.f, RandomFloat() * 20.f - 10.f,
+                RandomFloat() * 20.f - 10.f);
+        Vector d(RandomFloat() - .5f, RandomFloat() - .5f,
+                 RandomFloat() - .5f);
+        rays.push_back(Ray(o, Normalize(d), 0.f, INFINITY));
+        traversalRays.push_back(TraversalRay(rays.back()));
+    }
+
+    double nTests = double(nBoxes) * nRays;
+    Report("Ray", nTests, [&]() {
+        uint64_t hits = 0;
+        for (int r = 0; r < nRays; ++r)
+            for (int i = 0; i < nBoxes; ++i)
+                hits += boxes[i].IntersectP(rays[r]);
+        return hits;
+    });
+    Report("TraversalRay", nTests, [&]() {
+        uint64_t hits = 0;
+        for (int r = 0; r < nRays; ++r) {
+            float t0, t1;
+            for (int i = 0; i < nBoxes; ++i)
+                hits += boxes[i].IntersectP(traversalRays[r], &t0, &t1);
+        }
+        return hits;
+    });
+    Report("BBox4", nTests, [&]() {
+        uint64_t hits = 0;
+        for (int r = 0; r < nRays; ++r) {
+            float tNear[4];
+            for (int i = 0; i < nBoxes / 4; ++i)
+                hits +=
+                    CountBits(boxes4[i].IntersectP(traversalRays[r], tNear));
+        }
+        return hits;
+    });
+    Report("BBox8", nTests, [&]() {
+        uint64_t hits = 0;
+        for (int r = 0; r < nRays; ++r) {
+            float tNear[8];
+            for (int i = 0; i < nBoxes / 8; ++i)
+                hits +=
+                    CountBits(boxes8[i].IntersectP(traversalRays[r], tNear));
+        }
+        return hits;
+    });
+
+    // TraversalRay 的构造要做三次除法, 每条光线只做一次
+    const int nRepeat = 200;
+    uint64_t sum = 0;
+    double start = Now();
+    for (int k = 0; k < nRepeat; ++k)
+        for (int i = 0; i < nRays; ++i) {
+            TraversalRay tr(rays[i]);
+            sum += tr.dirIsNeg[0];
+        }
+    printf("TraversalRay construction: %.1f ns/ray (%llu)\n",
+           (Now() - start) / (double(nRepeat) * nRays) * 1e9,
+           (unsigned long long)sum);
+    printf("sizeof(TraversalRay) = %d, alignof = %d\n",
+           (int)sizeof(TraversalRay), (int)alignof(TraversalRay));
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "core/pbrt.h"
+#include "core/parallel.h"
+#include "shapes/trianglemesh.h"
+#include <stdlib.h>
+#include <chrono>
+
+// BVH 的建树时间和求交速度.
+// 用法: bvhbench [三角形数, 默认 10M] [0 SAH | 1 LBVH | 2 HLBVH] [布局]
+// 单独的程序, 不和 main/pbrt.cpp 一起链接. 工作线程数可以用环境变量
+// PBRT_NCORES 指定
+// 场景是带起伏的球面网格, 光线是 512x512 的相机光线和同样多的
+// 从四周射向球心附近的随机光线
+
+static double Now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static float RandomFloat() {
+    return rand() / (float)RAND_MAX;
+}
+
+// 每种光线跑三遍取最快的一遍, 打印每秒百万条
+static void TraceRays(const TriangleMesh& mesh,
+                      const vector<Ray>& rays,
+                      const char* name) {
+    double closest = INFINITY, shadow = INFINITY;
+    for (int pass = 0; pass < 3; ++pass) {
+        double start = Now();
+        for (uint32_t i = 0; i < rays.size(); ++i) {
+            Ray r = rays[i];
+            float tHit, rayEpsilon;
+            DifferentialGeometry dg;
+            mesh.Intersect(r, &tHit, &rayEpsilon, &dg);
+        }
+        closest = min(closest, Now() - start);
+        start = Now();
+        for (uint32_t i = 0; i < rays.size(); ++i)
+            mesh.IntersectP(rays[i]);
+        shadow = min(shadow, Now() - start);
+    }
+    printf("%s rays: %.2f Mrays/s closest hit, %.2f Mrays/s shadow\n", name,
+           rays.size() / closest * 1e-6, rays.size() / shadow * 1e-6);
+}
+
+int main(int argc, const char** argv) {
+    int nTris = argc > 1 ? atoi(argv[1]) : 10000000;
+    BVHSplitMethod split = argc > 2 ? (BVHSplitMethod)atoi(argv[2])
+                                    : BVH_SPLIT_SAH;
+    BVHLayout layout = argc > 3 ? (BVHLayout)atoi(argv[3]) : BVH_BINARY;
+    TasksInit();
+
+    // 经纬网格, U 约为 V 的两倍, 每个格子两个三角形
+    int V = max(1, (int)sqrtf(nTris / 4.f)), U = max(1, nTris / (2 * V));
+    vector<Point> P;
+    vector<int> indices;
+    P.reserve(size_t(U + 1) * (V + 1));
+    indices.reserve(size_t(6) * U * V);
+    for (int v = 0; v <= V; ++v)
+        for (int u = 0; u <= U; ++u) {
+            float theta = M_PI * v / V, phi = 2.f * M_PI * u / U;
+            float r = 5.f + 0.05f * sinf(13.f * theta) * cosf(7.f * phi);
+            P.push_back(Point(r * sinf(theta) * cosf(phi),
+                              r * sinf(theta) * sinf(phi), r * cosf(theta)));
+        }
+    for (int v = 0; v < V; ++v)
+        for (int u = 0; u < U; ++u) {
+            int a = v * (U + 1) + u, b = a + 1, c = a + U + 1, d = c + 1;
+            int quad[6] = {a, b, d, a, d, c};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+
+    AffineTransform identity;
+    int n = (int)indices.size() / 3;
+    double start = Now();
+    TriangleMesh mesh(&identity, &identity, false, n, (int)P.size(),
+                      &indices[0], &P[0], NULL, NULL, NULL, layout, split);
+    printf("%d triangles: BVH built in %.2f s, %.1f bytes/triangle\n", n,
+           Now() - start, mesh.BytesPerTriangle());
+
+    const int res = 512;
+    vector<Ray> camera, random;
+    Point eye(0, -15, 2);
+    for (int y = 0; y < res; ++y)
+        for (int x = 0; x < res; ++x) {
+            Vector d(0.8f * (x - res / 2) / res, 1.f,
+                     0.8f * (res / 2 - y) / res);
+            camera.push_back(Ray(eye, Normalize(d), 0.f, INFINITY));
+        }
+    for (int i = 0; i < res * res; ++i) {
+        Point o(RandomFloat() * 40 - 20, RandomFloat() * 40 - 20,
+                RandomFloat() * 40 - 20);
+        Point target(RandomFloat() * 8 - 4, RandomFloat() * 8 - 4,
+                     RandomFloat() * 8 - 4);
+        random.push_back(Ray(o, Normalize(target - o), 0.f, INFINITY));
+    }
+    TraceRays(mesh, camera, "camera");
+    TraceRays(mesh, random, "random");
+
+    TasksCleanup();
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "core/pbrt.h"
+#include "core/transform.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+// Matrix4x4 的乘法, 转置和求逆, 和改成 SIMD 之前的写法比较.
+// 用法: matrixbench [矩阵数, 默认 4096] [重复次数, 默认 200]
+// 单独的程序, 不和 main/pbrt.cpp 一起链接.
+// 旧的三个函数原样抄在这里, 最后还比较新旧求逆的残差
+
+static double Now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static float RandomFloat() {
+    return rand() / (float)RAND_MAX;
+}
+
+// 原来的 Gauss-Jordan 消元, 带全选主元
+static Matrix4x4 OldInverse(const Matrix4x4& m) {
+    int indxc[4], indxr[4];
+    int ipiv[4] = {0, 0, 0, 0};
+    float minv[4][4];
+    memcpy(minv, m.m, 4 * 4 * sizeof(float));
+    for (int i = 0; i < 4; i++) {
+        int irow = -1, icol = -1;
+        float big = 0.;
+        // 选主元
+        for (int j = 0; j < 4; j++) {
+            if (ipiv[j] != 1) {
+                for (int k = 0; k < 4; k++) {
+                    if (ipiv[k] == 0) {
+                        if (fabsf(minv[j][k]) >= big) {
+                            big = float(fabsf(minv[j][k]));
+                            irow = j;
+                            icol = k;
+                        }
+                    }
+                }
+            }
+        }
+        ++ipiv[icol];
+        // 把主元换到对角线上
+        if (irow != icol) {
+            for (int k = 0; k < 4; ++k)
+                swap(minv[irow][k], minv[icol][k]);
+        }
+        indxr[i] = irow;
+        indxc[i] = icol;
+
+        float pivinv = 1.f / minv[icol][icol];
+        minv[icol][icol] = 1.f;
+        for (int j = 0; j < 4; j++)
+            minv[icol][j] *= pivinv;
+
+        // 消掉其他行的这一列
+        for (int j = 0; j < 4; j++) {
+            if (j != icol) {
+                float save = minv[j][icol];
+                minv[j][icol] = 0;
+                for (int k = 0; k < 4; k++)
+                    minv[j][k] -= minv[icol][k] * save;
+            }
+        }
+    }
+    // 按交换的顺序把列换回来
+    for (int j = 3; j >= 0; j--) {
+        if (indxr[j] != indxc[j]) {
+            for (int k = 0; k < 4; k++)
+                swap(minv[k][indxr[j]], minv[k][indxc[j]]);
+        }
+    }
+    return Matrix4x4(minv);
+}
+
+static Matrix4x4 OldMul(const Matrix4x4& m1, const Matrix4x4& m2) {
+    Matrix4x4 r;
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+            r.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][1] * m2.m[1][j] +
+                        m1.m[i][2] * m2.m[2][j] + m1.m[i][3] * m2.m[3][j];
+    return r;
+}
+
+static Matrix4x4 OldTranspose(const Matrix4x4& m) {
+    return Matrix4x4(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0], m.m[0][1],
+                     m.m[1][1], m.m[2][1], m.m[3][1], m.m[0][2], m.m[1][2],
+                     m.m[2][2], m.m[3][2], m.m[0][3], m.m[1][3], m.m[2][3],
+                     m.m[3][3]);
+}
+
+// |m * inv - I| 的最大元素. 随机矩阵的条件数可能很大, 直接比较两个
+// 逆矩阵的元素没有意义, 比较残差才公平
+static float Residual(const Matrix4x4& m, const Matrix4x4& inv) {
+    Matrix4x4 p = OldMul(m, inv);
+    float err = 0.f;
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+            err = max(err, fabsf(p.m[i][j] - (i == j ? 1.f : 0.f)));
+    return err;
+}
+
+int main(int argc, const char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 4096;
+    int nRepeat = argc > 2 ? atoi(argv[2]) : 200;
+    // 下标用 & (n - 1) 轮转, n 取 2 的幂
+    int lg = 0;
+    while ((2 << lg) <= n)
+        ++lg;
+    n = 1 << lg;
+    srand(1);
+
+    // 一般矩阵的元素在 [-1, 1] 里; 仿射矩阵是平移, 旋转和缩放的组合
+    vector<Matrix4x4> a(n), b(n), affine(n), out(n);
+    for (int i = 0; i < n; ++i) {
+        for (int r = 0; r < 4; ++r)
+            for (int c = 0; c < 4; ++c) {
+                a[i].m[r][c] = RandomFloat() * 2.f - 1.f;
+                b[i].m[r][c] = RandomFloat() * 2.f - 1.f;
+            }
+        Transform t = Translate(Vector(RandomFloat(), RandomFloat(),
+                                       RandomFloat())) *
+                      RotateX(RandomFloat() * 90.f) *
+                      Scale(1.f + RandomFloat(), 1.f + RandomFloat(),
+                            1.f + RandomFloat());
+        affine[i] = t.GetMatrix();
+    }
+
+    // 每个结果都读一个元素加起来, 防止编译器把循环删掉
+    float sum = 0.f;
+    auto report = [&](const char* name, double elapsed) {
+        for (int i = 0; i < n; ++i)
+            sum += out[i].m[1][2];
+        printf("%-28s %6.1f ns\n", name,
+               elapsed / (double(n) * nRepeat) * 1e9);
+    };
+#define MATRIX_BENCH(name, statement)      \
+    do {                                   \
+        double start = Now();              \
+        for (int k = 0; k < nRepeat; ++k)  \
+            for (int i = 0; i < n; ++i) {  \
+                int j = (i + k) & (n - 1); \
+                statement;                 \
+            }                              \
+        report(name, Now() - start);       \
+    } while (0)
+
+    MATRIX_BENCH("Mul, old", out[i] = OldMul(a[i], b[j]));
+    MATRIX_BENCH("Mul", out[i] = Matrix4x4::Mul(a[i], b[j]));
+    MATRIX_BENCH("Transpose, old", out[i] = OldTranspose(a[j]));
+    MATRIX_BENCH("Transpose", out[i] = Transpose(a[j]));
+    MATRIX_BENCH("Inverse, old", out[i] = OldInverse(a[j]));
+    MATRIX_BENCH("Inverse", Inverse(a[j], &out[i]));
+    MATRIX_BENCH("Inverse affine, old", out[i] = OldInverse(affine[j]));
+    MATRIX_BENCH("Inverse affine", Inverse(affine[j], &out[i]));
+    MATRIX_BENCH("InverseAffine", InverseAffine(affine[j], &out[i]));
+#undef MATRIX_BENCH
+
+    // 残差取中位数, 个别接近奇异的矩阵会把最大值拉得很大
+    vector<float> err, errOld, errAffine, errAffineOld;
+    for (int i = 0; i < n; ++i) {
+        Matrix4x4 inv;
+        Inverse(a[i], &inv);
+        err.push_back(Residual(a[i], inv));
+        errOld.push_back(Residual(a[i], OldInverse(a[i])));
+        Inverse(affine[i], &inv);
+        errAffine.push_back(Residual(affine[i], inv));
+        errAffineOld.push_back(Residual(affine[i], OldInverse(affine[i])));
+    }
+    auto median = [](vector<float>& v) {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    };
+    printf("median |M * Inverse(M) - I|: %g (old %g), affine %g (old %g)\n",
+           median(err), median(errOld), median(errAffine),
+           median(errAffineOld));
+    printf("(%g)\n", sum);
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "core/pbrt.h"
+#include "core/geometry.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+// 遍历时每个节点的开销, 比较 Ray 和 TraversalRay 两种包围盒测试.
+// 用法: nodebench [盒子数, 默认 1M] [光线数, 默认 64K]
+// 单独的程序, 不和 main/pbrt.cpp 一起链接.
+// bboxbench 只测盒子本身; 这里把同样的测试放进一棵二叉 BVH 的遍历里,
+// 算上栈, 子节点排序和 maxt 缩短, 看每个节点实际花多少时间.
+// 叶子里的盒子当作图元, 命中就把 maxt 缩到入点, 模拟最近交点查询
+
+static double Now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static float RandomFloat() {
+    return rand() / (float)RAND_MAX;
+}
+
+// 和 LinearBVHNode 一样按深度优先排: 第一个子节点紧跟在后面,
+// 第二个子节点在 offset; 叶子的盒子从 boxes[offset] 开始
+struct BenchNode {
+    BBox bounds;
+    uint32_t offset;
+    uint8_t nBoxes;
+    uint8_t axis;
+};
+
+static const int LEAF_BOXES = 4;
+
+static uint32_t Build(vector<BBox>& boxes,
+                      uint32_t start,
+                      uint32_t end,
+                      vector<BenchNode>* nodes) {
+    uint32_t index = nodes->size();
+    nodes->push_back(BenchNode());
+    BBox bounds, centroids;
+    for (uint32_t i = start; i < end; ++i) {
+        bounds = Union(bounds, boxes[i]);
+        centroids = Union(centroids, .5f * (boxes[i].pMin + boxes[i].pMax));
+    }
+    if (end - start <= LEAF_BOXES) {
+        BenchNode& node = (*nodes)[index];
+        node.bounds = bounds;
+        node.offset = start;
+        node.nBoxes = end - start;
+        return index;
+    }
+    // 按质心最长的轴对半分
+    int axis = centroids.MaximumExtent();
+    uint32_t mid = (start + end) / 2;
+    std::nth_element(&boxes[start], &boxes[mid], &boxes[0] + end,
+                     [axis](const BBox& a, const BBox& b) {
+                         return a.pMin[axis] + a.pMax[axis] <
+                                b.pMin[axis] + b.pMax[axis];
+                     });
+    Build(boxes, start, mid, nodes);
+    uint32_t second = Build(boxes, mid, end, nodes);
+    BenchNode& node = (*nodes)[index];
+    node.bounds = bounds;
+    node.offset = second;
+    node.nBoxes = 0;
+    node.axis = axis;
+    return index;
+}
+
+// 返回测试过的盒子数, 内部节点和叶子里的盒子都算.
+// RayType 是 Ray 或 TraversalRay, 两者的 IntersectP 接口相同
+template <typename RayType>
+static uint64_t Traverse(const vector<BenchNode>& nodes,
+                         const vector<BBox>& boxes,
+                         const RayType& ray,
+                         const uint8_t dirIsNeg[3]) {
+    uint64_t nTests = 0;
+    uint32_t todo[64];
+    int todoOffset = 0, current = 0;
+    while (true) {
+        const BenchNode& node = nodes[current];
+        ++nTests;
+        if (node.bounds.IntersectP(ray)) {
+            if (node.nBoxes > 0) {
+                for (int i = 0; i < node.nBoxes; ++i) {
+                    float t0;
+                    ++nTests;
+                    if (boxes[node.offset + i].IntersectP(ray, &t0))
+                        ray.maxt = t0;
+                }
+            } else if (dirIsNeg[node.axis]) {
+                todo[todoOffset++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                todo[todoOffset++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (todoOffset == 0)
+            break;
+        current = todo[--todoOffset];
+    }
+    return nTests;
+}
+
+int main(int argc, const char** argv) {
+    int nBoxes = argc > 1 ? atoi(argv[1]) : 1000000;
+    int nRays = argc > 2 ? atoi(argv[2]) : 65536;
+    srand(1);
+
+    // 半径 5 的球壳附近的小盒子, 大小和同样数量三角形的包围盒相当
+    vector<BBox> boxes;
+    float size = 10.f / sqrtf(float(nBoxes));
+    for (int i = 0; i < nBoxes; ++i) {
+        Vector d = Normalize(Vector(RandomFloat() - .5f, RandomFloat() - .5f,
+                                    RandomFloat() - .5f));
+        Point c = Point(0, 0, 0) + (5.f + .1f * RandomFloat()) * d;
+        boxes.push_back(
+            BBox(c, c + size * Vector(RandomFloat(), RandomFloat(),
+                                      RandomFloat())));
+    }
+    vector<BenchNode> nodes;
+    nodes.reserve(2 * nBoxes / LEAF_BOXES + 1);
+    Build(boxes, 0, boxes.size(), &nodes);
+
+    // 从半径 20 的球面射向球心附近
+    vector<Ray> rays;
+    for (int i = 0; i < nRays; ++i) {
+        Vector d = Normalize(Vector(RandomFloat() - .5f, RandomFloat() - .5f,
+                                    RandomFloat() - .5f));
+        Point o = Point(0, 0, 0) + 20.f * d;
+        Point target(RandomFloat() * 4.f - 2.f, RandomFloat() * 4.f - 2.f,
+                     RandomFloat() * 4.f - 2.f);
+        rays.push_back(Ray(o, Normalize(target - o), 0.f, INFINITY));
+    }
+
+    // 跑三遍取最快的一遍. 两种光线走的节点应该几乎一样,
+    // TraversalRay 的远端距离放大了一点, 可能多走几个
+    double best[2] = {INFINITY, INFINITY};
+    uint64_t nTests[2] = {0, 0};
+    for (int pass = 0; pass < 3; ++pass) {
+        nTests[0] = nTests[1] = 0;
+        double start = Now();
+        for (int i = 0; i < nRays; ++i) {
+            Ray r = rays[i];
+            uint8_t dirIsNeg[3] = {r.d.x < 0, r.d.y < 0, r.d.z < 0};
+            nTests[0] += Traverse(nodes, boxes, r, dirIsNeg);
+        }
+        best[0] = min(best[0], Now() - start);
+        start = Now();
+        for (int i = 0; i < nRays; ++i) {
+            TraversalRay r(rays[i]);
+            nTests[1] += Traverse(nodes, boxes, r, r.dirIsNeg);
+        }
+        best[1] = min(best[1], Now() - start);
+    }
+    printf("%d boxes, %d nodes, %d rays\n", nBoxes, (int)nodes.size(), nRays);
+    const char* names[2] = {"Ray", "TraversalRay"};
+    for (int i = 0; i < 2; ++i)
+        printf("%-14s %6.1f tests/ray %6.2f ns/test %6.2f Mrays/s\n",
+               names[i], double(nTests[i]) / nRays, best[i] / nTests[i] * 1e9,
+               nRays / best[i] * 1e-6);
+    return 0;
+}